@@ -0,0 +1,108 @@
+#!/usr/bin/env bash
+#
+#  Measures read performance of a mounted sparse-bundle using fio
+#
+#  Usage: bench.sh [sparsebundle]
+#
+#  Without a sparse-bundle, one is generated using mkbundle.sh and
+#  the BENCH_SIZE, BENCH_BAND_SIZE and BENCH_PERCENT_PRESENT variables.
+#  Each combination of read path, pattern, block size and thread count
+#  is run for BENCH_RUNTIME seconds, and reported as one JSON object
+#  per line on stdout, with bandwidth in bytes per second, IOPS and
+#  completion latency percentiles in nanoseconds.
+#
+# ----------------------------------------------------------
+
+set -e
+
+: ${BENCH_SIZE:=4G}
+: ${BENCH_BAND_SIZE:=8M}
+: ${BENCH_PERCENT_PRESENT:=25}
+: ${BENCH_PATHS:="read_buf read"}
+: ${BENCH_PATTERNS:="read randread"}
+: ${BENCH_BLOCK_SIZES:="4k 64k 1m"}
+: ${BENCH_THREADS:="1 4 16"}
+: ${BENCH_RUNTIME:=10}
+
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+
+for binary in sparsebundlefs fio jq; do
+    if ! which $binary >/dev/null; then
+        echo "Could not find '$binary' binary" >&2
+        exit 1
+    fi
+done
+
+work_dir=$(mktemp -d)
+mount_dir=$work_dir/mount
+
+function cleanup() {
+    umount $mount_dir >/dev/null 2>&1 || true
+    rm -Rf $work_dir
+}
+trap cleanup EXIT
+
+bundle=$1
+if [[ -z "$bundle" ]]; then
+    bundle=$work_dir/bench.sparsebundle
+    $bench_dir/mkbundle.sh -s $BENCH_SIZE -b $BENCH_BAND_SIZE \
+        -p $BENCH_PERCENT_PRESENT $bundle
+fi
+
+function mount_sparsebundle() {
+    mkdir -p $mount_dir
+    sparsebundlefs -f $* $bundle $mount_dir &
+    for i in {0..50}; do
+        test -f $mount_dir/sparsebundle.dmg && return 0 || sleep 0.1
+    done
+    echo "Failed to mount $bundle" >&2
+    exit 1
+}
+
+dmg_file=$mount_dir/sparsebundle.dmg
+
+for path in $BENCH_PATHS; do
+    case $path in
+        read_buf) mount_options= ;;
+        read) mount_options="-o noreadbuf" ;;
+        *) echo "Unknown read path '$path'" >&2; exit 1 ;;
+    esac
+
+    mount_sparsebundle $mount_options
+    image_size=$(ls -dn $dmg_file | awk '{print $5; exit}')
+
+    for pattern in $BENCH_PATTERNS; do
+        for block_size in $BENCH_BLOCK_SIZES; do
+            for threads in $BENCH_THREADS; do
+                echo "Running $path $pattern with $block_size blocks and $threads threads" >&2
+
+                # Sequential readers each get their own part of the image
+                region_options=
+                if [[ $pattern == "read" ]]; then
+                    region_size=$((image_size / threads))
+                    region_options="--size=$region_size --offset_increment=$region_size"
+                fi
+
+                fio --name=bench --filename=$dmg_file --readonly \
+                    --rw=$pattern --bs=$block_size --numjobs=$threads \
+                    --ioengine=psync --invalidate=1 $region_options \
+                    --time_based --runtime=$BENCH_RUNTIME \
+                    --group_reporting --output-format=json \
+                | jq -c --arg path $path --arg pattern $pattern \
+                    --arg block_size $block_size --argjson threads $threads \
+                    '.jobs[0].read | {
+                        path: $path, pattern: $pattern,
+                        block_size: $block_size, threads: $threads,
+                        bandwidth: .bw_bytes, iops: .iops,
+                        latency_mean: .clat_ns.mean,
+                        latency_p50: .clat_ns.percentile["50.000000"],
+                        latency_p99: .clat_ns.percentile["99.000000"],
+                        latency_p999: .clat_ns.percentile["99.900000"]
+                    }'
+            done
+        done
+    done
+
+    umount $mount_dir
+    wait
+done
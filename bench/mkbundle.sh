@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+#
+#  Generates a synthetic sparse-bundle for benchmarking
+#
+#  Usage: mkbundle.sh [-s size] [-b band-size] [-p percent] [-S seed] <sparsebundle>
+#
+#  Sizes may be suffixed with K, M, G or T. The given percentage of
+#  the bands is written with random data, and the rest are left out,
+#  as for a sparse-bundle that has never been written to there. Which
+#  bands are present is decided by the seed, so the same arguments
+#  always give the same layout.
+#
+# ----------------------------------------------------------
+
+set -e
+
+size=4G
+band_size=8M
+percent_present=25
+seed=1
+
+function usage() {
+    echo "usage: $(basename $0) [-s size] [-b band-size] [-p percent] [-S seed] <sparsebundle>" >&2
+    exit 1
+}
+
+function to_bytes() {
+    local number=${1%[KkMmGgTt]}
+    case ${1#$number} in
+        K|k) echo $((number << 10)) ;;
+        M|m) echo $((number << 20)) ;;
+        G|g) echo $((number << 30)) ;;
+        T|t) echo $((number << 40)) ;;
+        *) echo $number ;;
+    esac
+}
+
+while getopts "s:b:p:S:" option; do
+    case $option in
+        s) size=$OPTARG ;;
+        b) band_size=$OPTARG ;;
+        p) percent_present=$OPTARG ;;
+        S) seed=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+test $# -eq 1 || usage
+bundle=$1
+
+size=$(to_bytes $size)
+band_size=$(to_bytes $band_size)
+test $size -gt 0 -a $band_size -gt 0 || usage
+test $percent_present -ge 0 -a $percent_present -le 100 || usage
+
+test ! -e $bundle || rm -Rf $bundle
+mkdir -p $bundle/bands
+
+cat > $bundle/Info.plist <<PLIST
+<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<dict>
+	<key>CFBundleInfoDictionaryVersion</key>
+	<string>6.0</string>
+	<key>band-size</key>
+	<integer>$band_size</integer>
+	<key>bundle-backingstore-version</key>
+	<integer>1</integer>
+	<key>diskimage-bundle-type</key>
+	<string>com.apple.diskimage.sparsebundle</string>
+	<key>size</key>
+	<integer>$size</integer>
+</dict>
+</plist>
+PLIST
+
+band_count=$(((size + band_size - 1) / band_size))
+present=0
+state=$seed
+for ((band = 0; band < band_count; band++)); do
+    # Portable LCG, so the layout doesn't depend on the shell's RANDOM
+    state=$(((state * 1103515245 + 12345) % 2147483648))
+    test $(((state >> 16) % 100)) -lt $percent_present || continue
+
+    length=$band_size
+    if [[ $band -eq $((band_count - 1)) ]]; then
+        length=$((size - band * band_size))
+    fi
+
+    band_file=$bundle/bands/$(printf "%x" $band)
+    head -c $length /dev/urandom > $band_file
+    present=$((present + 1))
+done
+
+echo "Created $bundle with $present of $band_count bands of $band_size bytes present" >&2
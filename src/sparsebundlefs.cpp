@@ -23,36 +23,91 @@
 */
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <grp.h>
 
 #include <algorithm>
-#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <limits>
-#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <sstream>
-#include <streambuf>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <fuse.h>
 
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+
 #define FUSE_SUPPORTS_ZERO_COPY FUSE_VERSION >= 29
+#define FUSE_SUPPORTS_CONFIG FUSE_USE_VERSION >= 30
+#define FUSE_SUPPORTS_LSEEK FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+#if defined(FALLOC_FL_PUNCH_HOLE)
+#define SPARSEBUNDLE_SUPPORTS_DISCARD 1
+#else
+#define SPARSEBUNDLE_SUPPORTS_DISCARD 0
+#endif
+#define FUSE_SUPPORTS_FALLOCATE FUSE_VERSION >= 29 && SPARSEBUNDLE_SUPPORTS_DISCARD
 
 using namespace std;
 
-static const char image_path[] = "/sparsebundle.dmg";
+static const char single_image_path[] = "/sparsebundle.dmg";
+static const char stats_path[] = "/.stats";
+
+/*
+    Debug logging
+
+    Debug messages are only formatted and passed on to syslog when
+    debug logging has been enabled with -D, which is checked with a
+    plain flag instead of relying on the log mask, as syslog() would
+    still be called. Tracing of the individual steps of each read,
+    which happens several times per read, can in addition be compiled
+    out completely, by building with SPARSEBUNDLEFS_NO_TRACE defined.
+*/
+
+static bool sparsebundle_debug_enabled = false;
+
+#define sparsebundle_debug(...) \
+    do { if (sparsebundle_debug_enabled) syslog(LOG_DEBUG, __VA_ARGS__); } while (0)
+
+#if defined(SPARSEBUNDLEFS_NO_TRACE)
+// Still type-checks the arguments, but is compiled away
+#define sparsebundle_trace(...) \
+    do { if (false) syslog(LOG_DEBUG, __VA_ARGS__); } while (0)
+#else
+#define sparsebundle_trace(...) sparsebundle_debug(__VA_ARGS__)
+#endif
 
 /*
     Size data-types used by sparsebundlefs
@@ -81,27 +136,257 @@ static const char image_path[] = "/sparsebundle.dmg";
     though that's a possibility with the size_t input argument.
 */
 
+/*
+    Thread safety
+
+    Unless -s is passed, FUSE serves requests from multiple threads,
+    so all mutable state in sparsebundle_mount_t, and in each of its
+    bundles, is guarded by the mutex of the mount.
+
+    File descriptors in the band table are reference counted,
+    and only closed when no thread is using them. A thread using the
+    zero-copy read_buf path hands FUSE duplicates of the descriptors
+    instead, as FUSE reads from them after we return, and drops its
+    references to the bands straight away, so that a thread left idle
+    after a read doesn't keep the bands from being evicted or deleted.
+    The duplicates are closed when the same thread comes back for its
+    next request (FUSE replies to a request on the thread that
+    processed it).
+*/
+
+/*
+    Band file descriptor cache
+
+    Band files are kept open between reads, in a table indexed by band
+    number, and opened relative to the bands directory, so that reading
+    from an already open band needs no allocations or path lookups.
+
+    The number of open bands is bounded by max_open_bands, which defaults
+    to what RLIMIT_NOFILE allows for, and when full the least recently
+    used band that no thread is reading from is closed. Running into
+    EMFILE regardless, e.g. because the limit was lowered after mount,
+    evicts the same way and shrinks the cache to what actually fits.
+
+    The open bands form a doubly linked list through the table, in
+    order of use, so the band table is limited to 2^32 - 1 bands.
+
+    Which bands exist is recorded in a table when mounting, so that
+    reads from bands that were never written, which make up most of a
+    typical sparse bundle, are padded with zeroes without touching
+    the file system. The length of each band file, and the space used
+    by all of them, is recorded at the same time, and kept up to date
+    by writes when mounted read-write. Whether a band exists is an
+    atomic, so that reads can check it without taking the lock.
+*/
+
+static const uint32_t sparsebundle_no_band = numeric_limits<uint32_t>::max();
+
+struct sparsebundle_band_t {
+    off_t length;
+    blkcnt_t blocks;
+    int fd;
+    unsigned references;
+    uint32_t more_recently_used;
+    uint32_t less_recently_used;
+    bool needs_sync;
+    bool discarding;
+};
+
+/*
+    Block cache
+
+    When reading without zero-copy, e.g. because splice isn't available,
+    blocks of the band files can be cached in memory, so that data read
+    over and over, such as the HFS+ catalog and extents B-trees while a
+    tree is walked, is served without a syscall.
+
+    The cache is a segmented LRU: blocks enter a probationary segment,
+    and only move to the protected segment when read again. Blocks read
+    only once, e.g. by a sequential scan of the image, are thus evicted
+    before the working set.
+*/
+
+static const size_t sparsebundle_block_size = 64 * 1024;
+
+struct sparsebundle_block_t {
+    uint64_t key;
+    size_t length;
+    bool is_protected;
+    unique_ptr<char[]> data;
+};
+
+typedef list<sparsebundle_block_t> sparsebundle_blocks_t;
+
+struct sparsebundle_block_cache_t {
+    mutex lock;
+    size_t max_blocks;
+    size_t block_count;
+    sparsebundle_blocks_t probationary_blocks;
+    sparsebundle_blocks_t protected_blocks;
+    unordered_map<uint64_t, sparsebundle_blocks_t::iterator> blocks;
+    uint64_t generation;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/*
+    Statistics
+
+    Counters that are cheap enough to always keep, exposed through the
+    read-only /.stats file next to the image, so that a slow mount can
+    be diagnosed without remounting it with debug logging. Counters of
+    the read paths are atomics, so reads don't contend on them, while
+    the band and block cache counters are kept under the lock of their
+    cache. Latencies are recorded in power-of-two microsecond buckets.
+*/
+
+static const unsigned sparsebundle_latency_buckets = 32;
+
+struct sparsebundle_read_stats_t {
+    atomic<uint64_t> calls;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> latencies[sparsebundle_latency_buckets];
+};
+
+struct sparsebundle_stats_t {
+    sparsebundle_read_stats_t read;
+    sparsebundle_read_stats_t read_buf;
+    atomic<uint64_t> hole_bytes;
+    atomic<uint64_t> bands_touched;
+};
+
+/*
+    Multiple bundles
+
+    One mount can serve several sparse-bundles, each as its own image
+    in the root of the mount, named after the bundle. A lone bundle is
+    always served as sparsebundle.dmg. The band table, and thereby the
+    budget of open files, the block cache and the I/O pool are shared
+    by all bundles, with the bands of each bundle making up a range of
+    the band table starting at its first_band. So are the statistics.
+*/
+
+struct sparsebundle_mount_t;
+struct sparsebundle_crypto_t;
+struct sparsebundle_hfs_t;
+struct sparsebundle_checksums_t;
+
 struct sparsebundle_t {
+    sparsebundle_mount_t *mount;
     char *path;
-    char *mountpoint;
+    string image_path;
     uint64_t band_size;
     uint64_t size;
+    struct stat bundle_stat;
+    uint64_t allocated_blocks;
+    int bands_fd;
     uint64_t times_opened;
-    map<string, int> open_files;
+    uint32_t first_band;
+    uint32_t band_count;
+    vector<atomic<bool>> present_bands;
+    vector<uint32_t> unsynced_bands;
+    bool needs_bands_sync;
+    sparsebundle_crypto_t *crypto;
+    sparsebundle_hfs_t *hfs;
+    sparsebundle_checksums_t *checksums;
+};
+
+struct sparsebundle_mount_t {
+    char *mountpoint;
+    int zeroes_fd;
+    mutex lock;
+    condition_variable band_discarded;
+    vector<unique_ptr<sparsebundle_t>> bundles;
+    unordered_map<string, sparsebundle_t *> images;
+    unordered_map<string, sparsebundle_t *> volumes;
+    vector<sparsebundle_band_t> bands;
+    uint32_t most_recently_used_band;
+    uint32_t least_recently_used_band;
+    size_t open_bands;
+    size_t max_open_bands;
+    struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t emfile_recoveries;
+    } band_cache_stats;
+    sparsebundle_block_cache_t block_cache;
+    sparsebundle_stats_t stats;
     struct {
         bool allow_other = false;
         bool allow_root = false;
         bool noreadbuf = false;
         bool always_close = false;
+        size_t max_open_bands = 0;
+        unsigned read_ahead = 1;
+        uint64_t cache_size = 0;
+        unsigned io_threads = 4;
+        bool read_write = false;
+        const char *passphrase_file = nullptr;
+        const char *key_file = nullptr;
+        bool nbd = false;
+        unsigned nbd_queue_depth = 8;
+        bool hfs = false;
+        bool scrub = false;
+        unsigned scrub_threads = 0;
+        uint64_t scrub_rate = 0;
+        bool verify = false;
+        bool export_image = false;
+        const char *format = nullptr;
+        vector<char *> arguments;
     } options;
 };
 
-#define sparsebundle_current() \
-    static_cast<sparsebundle_t *>(fuse_get_context()->private_data)
+#define sparsebundle_current_mount() \
+    static_cast<sparsebundle_mount_t *>(fuse_get_context()->private_data)
+
+static sparsebundle_t *sparsebundle_lookup(sparsebundle_mount_t *mount, const char *path)
+{
+    auto iter = mount->images.find(path);
+    return iter != mount->images.end() ? iter->second : nullptr;
+}
+
+/*
+    Read-ahead
+
+    Each open file handle tracks where its last read ended, and once
+    a handle has been read sequentially for a while, the next bands
+    are opened and the kernel is asked to start reading them into
+    the page cache, so that the stream doesn't stall at each band
+    boundary. The read-ahead window is given in bands.
+*/
+
+struct sparsebundle_hfs_fork_t;
+
+struct sparsebundle_handle_t {
+    sparsebundle_t *sparsebundle = nullptr;
+    shared_ptr<const sparsebundle_hfs_fork_t> fork; // Of a file in the volume
+    mutex lock;
+    uint64_t next_offset = 0;
+    unsigned sequential_reads = 0;
+    uint64_t read_ahead_band = 0;
+    string stats;
+};
+
+#define sparsebundle_handle(fi) \
+    reinterpret_cast<sparsebundle_handle_t *>((fi)->fh)
+
+static sparsebundle_t *sparsebundle_hfs_volume(sparsebundle_mount_t *mount, const char *path,
+    const char **volume_path);
+static int sparsebundle_hfs_getattr(sparsebundle_t *sparsebundle, const char *path, struct stat *stbuf);
+static int sparsebundle_hfs_readdir(sparsebundle_t *sparsebundle, const char *path,
+    void *buf, fuse_fill_dir_t filler);
+static int sparsebundle_hfs_open(sparsebundle_t *sparsebundle, const char *path,
+    shared_ptr<const sparsebundle_hfs_fork_t> *fork);
 
 static int sparsebundle_getattr(const char *path, struct stat *stbuf)
 {
-    sparsebundle_t *sparsebundle = sparsebundle_current();
+    sparsebundle_mount_t *mount = sparsebundle_current_mount();
+    sparsebundle_t *sparsebundle = sparsebundle_lookup(mount, path);
+
+    const char *volume_path;
+    if (sparsebundle_t *volume = sparsebundle_hfs_volume(mount, path, &volume_path))
+        return sparsebundle_hfs_getattr(volume, volume_path, stbuf);
 
     memset(stbuf, 0, sizeof(struct stat));
 
@@ -109,10 +394,18 @@ static int sparsebundle_getattr(const char *path, struct stat *stbuf)
         stbuf->st_mode = S_IFDIR | 0500;
         stbuf->st_nlink = 3;
         stbuf->st_size = sizeof(sparsebundle_t);
-    } else if (strcmp(path, image_path) == 0) {
-        stbuf->st_mode = S_IFREG | 0400;
+    } else if (sparsebundle) {
+        lock_guard<mutex> locker(mount->lock);
+        stbuf->st_mode = S_IFREG | (mount->options.read_write ? 0600 : 0400);
         stbuf->st_nlink = 1;
         stbuf->st_size = sparsebundle->size;
+        stbuf->st_blocks = sparsebundle->allocated_blocks;
+        stbuf->st_blksize = blksize_t(min(sparsebundle->band_size,
+            uint64_t(numeric_limits<blksize_t>::max())));
+    } else if (strcmp(path, stats_path) == 0) {
+        // Generated when opened, so the size isn't known up front
+        stbuf->st_mode = S_IFREG | 0400;
+        stbuf->st_nlink = 1;
     } else
         return -ENOENT;
 
@@ -133,68 +426,282 @@ static int sparsebundle_getattr(const char *path, struct stat *stbuf)
 
     // Once allow_other or allow_root is added into the mix we
     // want the permissions to also reflect the the situation.
-    if (sparsebundle->options.allow_other
-        || (sparsebundle->options.allow_root && stbuf->st_uid != 0))
-        stbuf->st_mode |= S_ISDIR(stbuf->st_mode) ? 0005 : 0004;
+    if (mount->options.allow_other
+        || (mount->options.allow_root && stbuf->st_uid != 0))
+        stbuf->st_mode |= S_ISDIR(stbuf->st_mode) ? 0005 : (stbuf->st_mode & S_IWUSR) ? 0006 : 0004;
 
-    struct stat bundle_stat;
-    stat(sparsebundle->path, &bundle_stat);
-    stbuf->st_atime = bundle_stat.st_atime;
-    stbuf->st_mtime = bundle_stat.st_mtime;
-    stbuf->st_ctime = bundle_stat.st_ctime;
+    // The root and the stats file go by the first bundle
+    if (!sparsebundle)
+        sparsebundle = mount->bundles.front().get();
+
+    stbuf->st_atime = sparsebundle->bundle_stat.st_atime;
+    stbuf->st_mtime = sparsebundle->bundle_stat.st_mtime;
+    stbuf->st_ctime = sparsebundle->bundle_stat.st_ctime;
 
     return 0;
 }
 
+#if FUSE_SUPPORTS_CONFIG
+static int sparsebundle_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *)
+{
+    return sparsebundle_getattr(path, stbuf);
+}
+
+#define sparsebundle_fill_dir(filler, buf, name, stbuf) \
+    filler(buf, name, stbuf, 0, fuse_fill_dir_flags(0))
+#else
+#define sparsebundle_fill_dir(filler, buf, name, stbuf) \
+    filler(buf, name, stbuf, 0)
+#endif
+
 static int sparsebundle_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
               off_t /* offset */, struct fuse_file_info *)
 {
+    sparsebundle_mount_t *mount = sparsebundle_current_mount();
+
+    const char *volume_path;
+    if (sparsebundle_t *volume = sparsebundle_hfs_volume(mount, path, &volume_path))
+        return sparsebundle_hfs_readdir(volume, volume_path, buf, filler);
+
     if (strcmp(path, "/") != 0)
         return -ENOENT;
 
-    struct stat image_stat;
-    sparsebundle_getattr(image_path, &image_stat);
+    sparsebundle_fill_dir(filler, buf, ".", 0);
+    sparsebundle_fill_dir(filler, buf, "..", 0);
+
+    for (auto &sparsebundle : mount->bundles) {
+        const char *image_path = sparsebundle->image_path.c_str();
+        struct stat image_stat;
+        sparsebundle_getattr(image_path, &image_stat);
+        sparsebundle_fill_dir(filler, buf, image_path + 1, &image_stat);
+    }
+
+    for (auto &volume : mount->volumes) {
+        struct stat volume_stat;
+        if (sparsebundle_getattr(volume.first.c_str(), &volume_stat) == 0)
+            sparsebundle_fill_dir(filler, buf, volume.first.c_str() + 1, &volume_stat);
+    }
 
-    filler(buf, ".", 0, 0);
-    filler(buf, "..", 0, 0);
-    filler(buf, image_path + 1, &image_stat, 0);
+    struct stat stats_stat;
+    sparsebundle_getattr(stats_path, &stats_stat);
+    sparsebundle_fill_dir(filler, buf, stats_path + 1, &stats_stat);
 
     return 0;
 }
 
+#if FUSE_SUPPORTS_CONFIG
+static int sparsebundle_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags)
+{
+    return sparsebundle_readdir(path, buf, filler, offset, fi);
+}
+#endif
+
+static string sparsebundle_format_stats(sparsebundle_mount_t *mount);
+
 static int sparsebundle_open(const char *path, struct fuse_file_info *fi)
 {
-    if (strcmp(path, image_path) != 0)
+    sparsebundle_mount_t *mount = sparsebundle_current_mount();
+
+    sparsebundle_t *sparsebundle = sparsebundle_lookup(mount, path);
+    bool is_stats = strcmp(path, stats_path) == 0;
+
+    shared_ptr<const sparsebundle_hfs_fork_t> fork;
+    const char *volume_path;
+    if (!sparsebundle && (sparsebundle = sparsebundle_hfs_volume(mount, path, &volume_path))) {
+        int ret = sparsebundle_hfs_open(sparsebundle, volume_path, &fork);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (!sparsebundle && !is_stats)
         return -ENOENT;
 
-    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    if ((fi->flags & O_ACCMODE) != O_RDONLY && (is_stats || !mount->options.read_write))
         return -EACCES;
 
-    sparsebundle_t *sparsebundle = sparsebundle_current();
+    sparsebundle_handle_t *handle = new (nothrow) sparsebundle_handle_t;
+    if (!handle)
+        return -ENOMEM;
+    fi->fh = reinterpret_cast<uint64_t>(handle);
+
+    if (is_stats) {
+        // Each open gets a snapshot, which the page cache mustn't outlive
+        handle->stats = sparsebundle_format_stats(mount);
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    handle->sparsebundle = sparsebundle;
+    handle->fork = fork;
 
+    // Nothing but us changes a read-only image, so what the page
+    // cache has from earlier opens is still good.
+    if (!mount->options.read_write)
+        fi->keep_cache = 1;
+
+    lock_guard<mutex> locker(mount->lock);
     sparsebundle->times_opened++;
-    syslog(LOG_DEBUG, "opened %s%s, now referenced %ju times",
-        sparsebundle->mountpoint, path, uintmax_t(sparsebundle->times_opened));
+    sparsebundle_debug("opened %s%s, now referenced %ju times",
+        mount->mountpoint, path, uintmax_t(sparsebundle->times_opened));
 
     return 0;
 }
 
-static void sparsebundle_close_files()
+// Must be called with the mount lock held
+static void sparsebundle_unlink_band(sparsebundle_mount_t *mount, uint32_t band_number)
+{
+    sparsebundle_band_t &band = mount->bands[band_number];
+
+    if (band.more_recently_used != sparsebundle_no_band)
+        mount->bands[band.more_recently_used].less_recently_used = band.less_recently_used;
+    else
+        mount->most_recently_used_band = band.less_recently_used;
+
+    if (band.less_recently_used != sparsebundle_no_band)
+        mount->bands[band.less_recently_used].more_recently_used = band.more_recently_used;
+    else
+        mount->least_recently_used_band = band.more_recently_used;
+
+    band.more_recently_used = band.less_recently_used = sparsebundle_no_band;
+}
+
+// Must be called with the mount lock held
+static void sparsebundle_mark_band_used(sparsebundle_mount_t *mount, uint32_t band_number)
+{
+    if (mount->most_recently_used_band == band_number)
+        return;
+
+    sparsebundle_band_t &band = mount->bands[band_number];
+    if (band.more_recently_used != sparsebundle_no_band)
+        sparsebundle_unlink_band(mount, band_number);
+
+    band.less_recently_used = mount->most_recently_used_band;
+    if (band.less_recently_used != sparsebundle_no_band)
+        mount->bands[band.less_recently_used].more_recently_used = band_number;
+    else
+        mount->least_recently_used_band = band_number;
+
+    mount->most_recently_used_band = band_number;
+}
+
+// Must be called with the mount lock held
+static void sparsebundle_close_band(sparsebundle_mount_t *mount, uint32_t band_number)
 {
-    sparsebundle_t *sparsebundle = sparsebundle_current();
+    sparsebundle_band_t &band = mount->bands[band_number];
+    assert(band.fd != -1 && !band.references);
+
+    close(band.fd);
+    band.fd = -1;
+    sparsebundle_debug("closed band %jx", uintmax_t(band_number));
+
+    sparsebundle_unlink_band(mount, band_number);
+    mount->open_bands--;
+}
 
-    if (sparsebundle->open_files.empty())
+// Closes the bands of the given bundle, or of all bundles.
+// Must be called with the mount lock held.
+static void sparsebundle_close_files(sparsebundle_mount_t *mount, sparsebundle_t *sparsebundle = nullptr)
+{
+    if (!mount->open_bands)
         return;
 
-    syslog(LOG_DEBUG, "closing %zu open file descriptor(s)", sparsebundle->open_files.size());
+    sparsebundle_debug("closing %zu open file descriptor(s)", mount->open_bands);
+
+    uint32_t band_number = mount->most_recently_used_band;
+    while (band_number != sparsebundle_no_band) {
+        uint32_t next_band_number = mount->bands[band_number].less_recently_used;
+        bool is_closing = !sparsebundle || (band_number >= sparsebundle->first_band
+            && band_number - sparsebundle->first_band < sparsebundle->band_count);
+        if (is_closing) {
+            if (mount->bands[band_number].references)
+                sparsebundle_debug("not closing band %jx, still in use", uintmax_t(band_number));
+            else
+                sparsebundle_close_band(mount, band_number);
+        }
+        band_number = next_band_number;
+    }
+}
+
+// Closes the least recently used band not in use by any thread.
+// Must be called with the mount lock held.
+static bool sparsebundle_evict_band(sparsebundle_mount_t *mount)
+{
+    uint32_t band_number = mount->least_recently_used_band;
+    for (; band_number != sparsebundle_no_band;
+           band_number = mount->bands[band_number].more_recently_used) {
+        if (mount->bands[band_number].references)
+            continue;
+
+        sparsebundle_debug("evicting band %jx", uintmax_t(band_number));
+        sparsebundle_close_band(mount, band_number);
+        mount->band_cache_stats.evictions++;
+        return true;
+    }
+
+    return false;
+}
+
+struct sparsebundle_held_files_t {
+    sparsebundle_mount_t *mount = nullptr;
+    vector<uint32_t> bands;
+    vector<int> handed_over_fds;
+
+    void release()
+    {
+        for (int fd : handed_over_fds)
+            close(fd);
+        handed_over_fds.clear();
+
+        if (bands.empty())
+            return;
+
+        lock_guard<mutex> locker(mount->lock);
+        for (uint32_t band_number : bands) {
+            assert(mount->bands[band_number].references);
+            mount->bands[band_number].references--;
+        }
+        bands.clear();
+    }
+
+    ~sparsebundle_held_files_t() { release(); }
+};
+
+// File descriptors referenced by the current thread
+static thread_local sparsebundle_held_files_t sparsebundle_held_files;
+
+static void sparsebundle_release_files()
+{
+    sparsebundle_held_files.release();
+}
+
+// Lets go of the band the current thread opened last
+static void sparsebundle_release_last_band()
+{
+    sparsebundle_held_files_t &held_files = sparsebundle_held_files;
+    assert(!held_files.bands.empty());
+
+    lock_guard<mutex> locker(held_files.mount->lock);
+    assert(held_files.mount->bands[held_files.bands.back()].references);
+    held_files.mount->bands[held_files.bands.back()].references--;
+    held_files.bands.pop_back();
+}
 
-    map<string, int>::iterator iter;
-    for(iter = sparsebundle->open_files.begin(); iter != sparsebundle->open_files.end(); ++iter) {
-        close(iter->second);
-        syslog(LOG_DEBUG, "closed %s", iter->first.c_str());
+// Returns a duplicate of the file descriptor of the band the current
+// thread opened last, for FUSE to read from after we return, and lets
+// go of the band. Without a descriptor to spare the band is kept, and
+// its own descriptor returned, until sparsebundle_release_files().
+static int sparsebundle_hand_over_band(int band_file_fd)
+{
+    int fd = dup(band_file_fd);
+    if (fd == -1) {
+        sparsebundle_debug("holding on to band for zero-copy read: %s", strerror(errno));
+        return band_file_fd;
     }
 
-    sparsebundle->open_files.clear();
+    sparsebundle_held_files.handed_over_fds.push_back(fd);
+    sparsebundle_release_last_band();
+    return fd;
 }
 
 static rlim_t sparsebundle_max_files()
@@ -204,62 +711,137 @@ static rlim_t sparsebundle_max_files()
     return fd_limit.rlim_cur;
 }
 
-static int sparsebundle_open_file(const char *path)
+enum {
+    sparsebundle_band_read_ahead = 1 << 0,
+    sparsebundle_band_create = 1 << 1
+};
+
+// Returns a file descriptor that stays valid until the current
+// thread calls sparsebundle_release_files(), or -1 on error, and
+// the length of the band file. Bands opened for read-ahead only
+// use spare room in the cache, and never evict other bands, and
+// missing bands are only created when asked to.
+static int sparsebundle_open_band(sparsebundle_t *sparsebundle, uint64_t band_number,
+    off_t *length, int flags = 0)
 {
-    sparsebundle_t *sparsebundle = sparsebundle_current();
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+    bool read_ahead = flags & sparsebundle_band_read_ahead;
+
+    assert(band_number < sparsebundle->band_count);
+    uint32_t band_index = sparsebundle->first_band + uint32_t(band_number);
+    sparsebundle_band_t &band = mount->bands[band_index];
+
+    unique_lock<mutex> locker(mount->lock);
 
-    int fd = -1;
-    map<string, int>::const_iterator iter = sparsebundle->open_files.find(path);
-    if (iter != sparsebundle->open_files.end()) {
-        fd = iter->second;
+    // Not reopened, or recreated, while being deleted
+    mount->band_discarded.wait(locker, [&band]() { return !band.discarding; });
+
+    if (band.fd != -1) {
+        mount->band_cache_stats.hits++;
     } else {
-        if (sparsebundle->options.always_close) {
+        if (read_ahead && mount->open_bands >= mount->max_open_bands) {
+            errno = EMFILE;
+            return -1;
+        }
+
+        mount->band_cache_stats.misses++;
+
+        if (mount->options.always_close && !read_ahead) {
             // Escape hatch in case the logic below doesn't work.
             // We're closing files here, instead of after use, since
             // we don't know when the file will be read in the case
-            // of read_buf (but looking at the code, it looks like
-            // it's synchronous).
-            sparsebundle_close_files();
-        }
-        syslog(LOG_DEBUG, "file %s not opened yet, opening", path);
-        if ((fd = open(path, O_RDONLY)) == -1) {
-            if (errno == EMFILE) {
-                syslog(LOG_DEBUG, "too many open file descriptors (max %ju)",
-                    uintmax_t(sparsebundle_max_files()));
-
-                sparsebundle_close_files();
-                return sparsebundle_open_file(path);
-            } else if (errno == ENOENT) {
-                syslog(LOG_DEBUG, "%s does not exist", path);
-                return -1;
-            } else {
-                syslog(LOG_ERR, "failed to open %s: %s", path, strerror(errno));
+            // of read_buf. Files in use by other threads are kept.
+            sparsebundle_close_files(mount);
+        }
+
+        while (mount->open_bands >= mount->max_open_bands) {
+            // All bands may be in use by other threads, in which
+            // case we go above the limit and let EMFILE decide.
+            if (!sparsebundle_evict_band(mount))
+                break;
+        }
+
+        char band_name[sizeof(uintmax_t) * 2 + 1];
+        snprintf(band_name, sizeof(band_name), "%jx", uintmax_t(band_number));
+
+        sparsebundle_debug("band %s not opened yet, opening", band_name);
+
+        int open_flags = mount->options.read_write ? O_RDWR : O_RDONLY;
+        if (flags & sparsebundle_band_create)
+            open_flags |= O_CREAT;
+
+        int fd = -1;
+        while ((fd = openat(sparsebundle->bands_fd, band_name, open_flags, 0644)) == -1) {
+            if (errno != EMFILE || read_ahead)
+                break;
+
+            sparsebundle_debug("too many open file descriptors (max %ju)",
+                uintmax_t(sparsebundle_max_files()));
+
+            // Only closes bands not in use by other threads,
+            // so if that doesn't free up anything we give up.
+            if (!sparsebundle_evict_band(mount))
+                break;
+
+            // Don't try to keep more bands open than what fits
+            mount->max_open_bands = mount->open_bands + 1;
+            mount->band_cache_stats.emfile_recoveries++;
+        }
+
+        if (fd == -1) {
+            if (read_ahead)
+                sparsebundle_debug("not reading ahead band %s: %s", band_name, strerror(errno));
+            else if (errno == ENOENT)
+                sparsebundle_debug("band %s does not exist", band_name);
+            else
+                syslog(LOG_ERR, "failed to open band %s: %s", band_name, strerror(errno));
+            return -1;
+        }
+
+        if (band.length == -1) {
+            struct stat band_stat;
+            if (fstat(fd, &band_stat) == -1) {
+                syslog(LOG_ERR, "failed to stat band %s: %s", band_name, strerror(errno));
+                int stat_error = errno;
+                close(fd);
+                errno = stat_error;
                 return -1;
             }
+            band.length = band_stat.st_size;
+            band.blocks = band_stat.st_blocks;
         }
 
-        sparsebundle->open_files[path] = fd;
+        if (!sparsebundle->present_bands[band_number]) {
+            sparsebundle_debug("created band %s", band_name);
+            sparsebundle->present_bands[band_number] = true;
+            sparsebundle->needs_bands_sync = true;
+        }
+
+        band.fd = fd;
+        mount->open_bands++;
     }
 
-    return fd;
+    sparsebundle_mark_band_used(mount, band_index);
+
+    band.references++;
+    sparsebundle_held_files.mount = mount;
+    sparsebundle_held_files.bands.push_back(band_index);
+
+    *length = band.length;
+    return band.fd;
 }
 
 struct sparsebundle_read_operations {
-    int (*process_band) (const char *, size_t, off_t, void *);
-    int (*pad_with_zeroes) (size_t, void *);
+    int (*process_band) (sparsebundle_t *, uint64_t, size_t, off_t, void *);
+    int (*pad_with_zeroes) (sparsebundle_t *, size_t, void *);
     void *data;
 };
 
-static int sparsebundle_iterate_bands(const char *path, size_t length, off_t offset,
+static int sparsebundle_iterate_bands(sparsebundle_t *sparsebundle, size_t length, off_t offset,
            struct sparsebundle_read_operations *read_ops)
 {
     assert(length <= numeric_limits<int>::max());
 
-    if (strcmp(path, image_path) != 0)
-        return -ENOENT;
-
-    sparsebundle_t *sparsebundle = sparsebundle_current();
-
     assert(offset >= 0);
     if (uint64_t(offset) >= sparsebundle->size)
         return 0;
@@ -267,7 +849,10 @@ static int sparsebundle_iterate_bands(const char *path, size_t length, off_t off
     if (uint64_t(offset) + length > sparsebundle->size)
         length = sparsebundle->size - offset;
 
-    syslog(LOG_DEBUG, "iterating %zu bytes at offset %ju", length, uintmax_t(offset));
+    sparsebundle_trace("iterating %zu bytes at offset %ju", length, uintmax_t(offset));
+
+    uint64_t bands_touched = 0;
+    uint64_t hole_bytes = 0;
 
     size_t bytes_read = 0;
     while (bytes_read < length) {
@@ -276,17 +861,12 @@ static int sparsebundle_iterate_bands(const char *path, size_t length, off_t off
 
         size_t to_read = min(length - bytes_read, size_t(sparsebundle->band_size - band_offset));
 
-        char *band_path;
-        if (asprintf(&band_path, "%s/bands/%jx", sparsebundle->path, uintmax_t(band_number)) == -1) {
-            syslog(LOG_ERR, "failed to resolve band name");
-            return -errno;
-        }
-
-        syslog(LOG_DEBUG, "processing %zu bytes from band %jx at offset %ju",
+        sparsebundle_trace("processing %zu bytes from band %jx at offset %ju",
             to_read, uintmax_t(band_number), uintmax_t(band_offset));
 
-        ssize_t read = read_ops->process_band(band_path, to_read, band_offset, read_ops->data);
-        free(band_path);
+        ssize_t read = 0;
+        if (sparsebundle->present_bands[band_number])
+            read = read_ops->process_band(sparsebundle, band_number, to_read, band_offset, read_ops->data);
 
         if (read < 0) {
             // Got -errno from processing
@@ -295,259 +875,5347 @@ static int sparsebundle_iterate_bands(const char *path, size_t length, off_t off
 
         if (size_t(read) < to_read) {
             to_read = to_read - read;
-            syslog(LOG_DEBUG, "missing %zu bytes from band %jx, padding with zeroes",
+            sparsebundle_trace("missing %zu bytes from band %jx, padding with zeroes",
                 to_read, uintmax_t(band_number));
-            read += read_ops->pad_with_zeroes(to_read, read_ops->data);
+            read += read_ops->pad_with_zeroes(sparsebundle, to_read, read_ops->data);
+            hole_bytes += to_read;
         }
 
         bytes_read += read;
+        bands_touched++;
 
-        syslog(LOG_DEBUG, "done processing band %jx, %zu bytes left to read",
+        sparsebundle_trace("done processing band %jx, %zu bytes left to read",
                 uintmax_t(band_number), length - bytes_read);
     }
 
     assert(bytes_read == length);
+
+    sparsebundle_stats_t &stats = sparsebundle->mount->stats;
+    stats.bands_touched.fetch_add(bands_touched, memory_order_relaxed);
+    stats.hole_bytes.fetch_add(hole_bytes, memory_order_relaxed);
+
     return bytes_read;
 }
 
-static int sparsebundle_read_process_band(const char *band_path, size_t length, off_t offset, void *read_data)
+static bool sparsebundle_is_zeroes(const char *buffer, size_t length)
 {
-    assert(length <= numeric_limits<int>::max());
-
-    ssize_t read = 0;
-
-    char **buffer = static_cast<char **>(read_data);
-
-    syslog(LOG_DEBUG, "reading %zu bytes at offset %ju into %p",
-        length, uintmax_t(offset), static_cast<void *>(*buffer));
-
-    int band_file_fd = sparsebundle_open_file(band_path);
-    if (band_file_fd == -1)
-        return errno == ENOENT ? 0 : -errno;
+    return !length || (!buffer[0] && memcmp(buffer, buffer + 1, length - 1) == 0);
+}
 
-    read = pread(band_file_fd, *buffer, length, offset);
-    if (read == -1) {
-        syslog(LOG_ERR, "failed to read band: %s", strerror(errno));
-        return -errno;
-    }
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+/*
+    Encryption
+
+    Sparse-bundles created by hdiutil with -encryption are encrypted in
+    chunks, usually of 4 KB, each with AES in CBC mode, using the HMAC-
+    SHA1 of the chunk number as the IV. Reads are widened to whole chunks,
+    which are decrypted once read from the bands, so there's no zero-copy
+    reading of them. A chunk that was never written is all zeroes, which
+    no written chunk encrypts to, so such chunks are left as holes.
+*/
 
-    *buffer += read;
+static const size_t sparsebundle_hmac_key_size = 20;
 
-    return read;
-}
+struct sparsebundle_crypto_t {
+    const EVP_CIPHER *cipher;
+    unsigned char key[32];
+    unsigned char hmac_key[sparsebundle_hmac_key_size];
+    size_t chunk_size;
+};
 
-static int sparsebundle_read_pad_with_zeroes(size_t length, void *read_data)
+// Decrypts whole chunks in place, the first having the given number.
+// Returns 0, or -errno on failure.
+static int sparsebundle_decrypt(const sparsebundle_crypto_t *crypto, char *buffer, size_t length,
+    uint64_t chunk_number)
 {
-    char **buffer = static_cast<char **>(read_data);
+    assert(length % crypto->chunk_size == 0);
 
-    syslog(LOG_DEBUG, "padding %zu bytes of zeroes into %p",
-        length, static_cast<void *>(*buffer));
+    EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+    if (!context)
+        return -ENOMEM;
 
-    memset(*buffer, 0, length);
-    *buffer += length;
+    int ret = 0;
+    if (EVP_DecryptInit_ex(context, crypto->cipher, 0, crypto->key, 0) != 1)
+        ret = -EIO;
+    EVP_CIPHER_CTX_set_padding(context, 0);
+
+    for (size_t decrypted = 0; !ret && decrypted < length; decrypted += crypto->chunk_size, chunk_number++) {
+        char *chunk = buffer + decrypted;
+        if (sparsebundle_is_zeroes(chunk, crypto->chunk_size))
+            continue;
+
+        unsigned char number[4] = { uint8_t(chunk_number >> 24), uint8_t(chunk_number >> 16),
+            uint8_t(chunk_number >> 8), uint8_t(chunk_number) };
+        unsigned char iv[EVP_MAX_MD_SIZE];
+        unsigned iv_length = 0;
+        HMAC(EVP_sha1(), crypto->hmac_key, sizeof(crypto->hmac_key), number, sizeof(number), iv, &iv_length);
+
+        unsigned char *data = reinterpret_cast<unsigned char *>(chunk);
+        int decrypted_length = 0;
+        if (EVP_DecryptInit_ex(context, 0, 0, 0, iv) != 1
+            || EVP_DecryptUpdate(context, data, &decrypted_length, data, int(crypto->chunk_size)) != 1) {
+            syslog(LOG_ERR, "failed to decrypt chunk %ju", uintmax_t(chunk_number));
+            ret = -EIO;
+        }
+    }
 
-    return length;
+    EVP_CIPHER_CTX_free(context);
+    return ret;
 }
+#endif
 
-static int sparsebundle_read(const char *path, char *buffer, size_t length, off_t offset,
-           struct fuse_file_info *)
+// Number of sequential reads before reading ahead
+static const unsigned sparsebundle_read_ahead_threshold = 2;
+
+static void sparsebundle_read_ahead(struct fuse_file_info *fi, size_t length, off_t offset)
 {
-    sparsebundle_read_operations read_ops = {
-        &sparsebundle_read_process_band,
-        sparsebundle_read_pad_with_zeroes,
-        &buffer
-    };
+    sparsebundle_handle_t *handle = sparsebundle_handle(fi);
+    sparsebundle_t *sparsebundle = handle->sparsebundle;
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+    if (!mount->options.read_ahead)
+        return;
 
-    syslog(LOG_DEBUG, "asked to read %zu bytes at offset %ju", length, uintmax_t(offset));
+    uint64_t end_offset = min(uint64_t(offset) + length, sparsebundle->size);
+    uint64_t first_band = 0;
+    uint64_t last_band = 0;
+
+    {
+        lock_guard<mutex> locker(handle->lock);
+
+        // The kernel may have several reads in flight for the same
+        // handle, so allow for some reordering of sequential reads.
+        uint64_t slack = max(uint64_t(length), uint64_t(1 << 20));
+        if (uint64_t(offset) + slack >= handle->next_offset
+            && uint64_t(offset) <= handle->next_offset + slack) {
+            handle->sequential_reads++;
+        } else {
+            handle->sequential_reads = 0;
+            handle->read_ahead_band = 0;
+        }
+        handle->next_offset = max(handle->next_offset, end_offset);
 
-    return sparsebundle_iterate_bands(path, length, offset, &read_ops);
-}
+        if (handle->sequential_reads < sparsebundle_read_ahead_threshold)
+            return;
 
-#if FUSE_SUPPORTS_ZERO_COPY
-static int sparsebundle_read_buf_process_band(const char *band_path, size_t length, off_t offset, void *read_data)
-{
-    size_t read = 0;
+        first_band = max(handle->read_ahead_band,
+            handle->next_offset / sparsebundle->band_size + 1);
+        last_band = min(uint64_t(sparsebundle->band_count),
+            handle->next_offset / sparsebundle->band_size + 1 + mount->options.read_ahead);
+        if (first_band >= last_band)
+            return;
 
-    vector<fuse_buf> *buffers = static_cast<vector<fuse_buf> *>(read_data);
+        handle->read_ahead_band = last_band;
+    }
 
-    syslog(LOG_DEBUG, "preparing %zu bytes at offset %ju", length,
-        uintmax_t(offset));
+    for (uint64_t band_number = first_band; band_number < last_band; ++band_number) {
+        if (!sparsebundle->present_bands[band_number])
+            continue;
 
-    int band_file_fd = sparsebundle_open_file(band_path);
-    if (band_file_fd == -1)
-        return errno == ENOENT ? 0 : -errno;
+        off_t band_length;
+        int band_file_fd = sparsebundle_open_band(sparsebundle, band_number, &band_length, sparsebundle_band_read_ahead);
+        if (band_file_fd == -1 || !band_length)
+            continue;
 
-    struct stat band_stat;
-    stat(band_path, &band_stat);
-    read += max(off_t(0), min(static_cast<off_t>(length), band_stat.st_size - offset));
+        sparsebundle_debug("reading ahead %ju bytes of band %jx",
+            uintmax_t(band_length), uintmax_t(band_number));
 
-    if (read > 0) {
-        fuse_buf buffer = { read, fuse_buf_flags(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK), 0, band_file_fd, offset };
-        buffers->push_back(buffer);
+#if defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(band_file_fd, 0, band_length, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+        struct radvisory advice = { 0, int(min(band_length, off_t(numeric_limits<int>::max()))) };
+        fcntl(band_file_fd, F_RDADVISE, &advice);
+#endif
     }
-
-    return read;
 }
 
-static const char zero_device[] = "/dev/zero";
+// Protected blocks may use this share of the block cache
+static const unsigned sparsebundle_protected_blocks_percentage = 80;
 
-static int sparsebundle_read_buf_pad_with_zeroes(size_t length, void *read_data)
+// Blocks are keyed by the band's index in the band table shared by
+// all bundles, and the number of the block within the band.
+static uint64_t sparsebundle_block_key(sparsebundle_t *sparsebundle, uint64_t band_number,
+    uint64_t block_number)
 {
-    vector<fuse_buf> *buffers = static_cast<vector<fuse_buf> *>(read_data);
-    int zero_device_fd = sparsebundle_open_file(zero_device);
-    fuse_buf buffer = { length, fuse_buf_flags(FUSE_BUF_IS_FD), 0, zero_device_fd, 0 };
-    buffers->push_back(buffer);
-
-    return length;
+    assert(block_number <= numeric_limits<uint32_t>::max());
+    return (uint64_t(sparsebundle->first_band + band_number) << 32) | block_number;
 }
 
-static int sparsebundle_read_buf(const char *path, struct fuse_bufvec **bufp,
-                        size_t length, off_t offset, struct fuse_file_info *)
+static ssize_t sparsebundle_read_cached(sparsebundle_t *sparsebundle, uint64_t band_number,
+    int band_file_fd, off_t band_length, char *buffer, size_t length, off_t offset)
 {
-    assert(length <= numeric_limits<int>::max());
+    sparsebundle_block_cache_t &cache = sparsebundle->mount->block_cache;
 
-    int ret = 0;
+    size_t bytes_read = 0;
+    while (bytes_read < length) {
+        uint64_t block_number = (offset + bytes_read) / sparsebundle_block_size;
+        size_t block_offset = (offset + bytes_read) % sparsebundle_block_size;
+        uint64_t key = sparsebundle_block_key(sparsebundle, band_number, block_number);
 
-    vector<fuse_buf> buffers;
+        unique_lock<mutex> locker(cache.lock);
 
-    sparsebundle_read_operations read_ops = {
-        &sparsebundle_read_buf_process_band,
-        sparsebundle_read_buf_pad_with_zeroes,
-        &buffers
-    };
+        auto iter = cache.blocks.find(key);
+        if (iter != cache.blocks.end()) {
+            cache.hits++;
 
-    syslog(LOG_DEBUG, "asked to read %zu bytes at offset %ju using zero-copy read",
-        length, uintmax_t(offset));
+            sparsebundle_blocks_t::iterator block = iter->second;
+            if (block->is_protected) {
+                cache.protected_blocks.splice(cache.protected_blocks.begin(),
+                    cache.protected_blocks, block);
+            } else {
+                block->is_protected = true;
+                cache.protected_blocks.splice(cache.protected_blocks.begin(),
+                    cache.probationary_blocks, block);
+
+                size_t max_protected_blocks = cache.max_blocks
+                    * sparsebundle_protected_blocks_percentage / 100;
+                if (cache.protected_blocks.size() > max_protected_blocks) {
+                    cache.protected_blocks.back().is_protected = false;
+                    cache.probationary_blocks.splice(cache.probationary_blocks.begin(),
+                        cache.protected_blocks, prev(cache.protected_blocks.end()));
+                }
+            }
+        } else {
+            cache.misses++;
+
+            // Read into a block that's not in the cache while unlocked,
+            // either a new one or the least recently used probationary
+            // block, which is then only put back when the read is done.
+            sparsebundle_blocks_t reading_block;
+            if (cache.block_count < cache.max_blocks || cache.probationary_blocks.empty()) {
+                sparsebundle_block_t new_block = { key, 0, false,
+                    unique_ptr<char[]>(new (nothrow) char[sparsebundle_block_size]) };
+                if (!new_block.data)
+                    return -ENOMEM;
+                reading_block.push_back(move(new_block));
+                cache.block_count++;
+            } else {
+                reading_block.splice(reading_block.begin(), cache.probationary_blocks,
+                    prev(cache.probationary_blocks.end()));
+                cache.blocks.erase(reading_block.front().key);
+                reading_block.front().key = key;
+            }
 
-    ret = sparsebundle_iterate_bands(path, length, offset, &read_ops);
-    if (ret < 0)
-        return ret;
+            // Writes while reading make the block stale
+            uint64_t generation = cache.generation;
 
-    size_t bufvec_size = sizeof(struct fuse_bufvec) + (sizeof(struct fuse_buf) * (buffers.size() - 1));
-    struct fuse_bufvec *buffer_vector = static_cast<fuse_bufvec *>(malloc(bufvec_size));
-    if (buffer_vector == 0)
-        return -ENOMEM;
+            locker.unlock();
 
-    buffer_vector->count = buffers.size();
-    buffer_vector->idx = 0;
-    buffer_vector->off = 0;
+            off_t block_start = block_number * sparsebundle_block_size;
+            size_t to_read = size_t(min(off_t(sparsebundle_block_size),
+                max(off_t(0), band_length - block_start)));
+            ssize_t read = pread(band_file_fd, reading_block.front().data.get(), to_read, block_start);
 
-    copy(buffers.begin(), buffers.end(), buffer_vector->buf);
+            locker.lock();
 
-    syslog(LOG_DEBUG, "returning %zu buffers to fuse", buffer_vector->count);
-    *bufp = buffer_vector;
+            if (read == -1 || cache.blocks.count(key) || cache.generation != generation) {
+                // Failed, another thread was faster, or written to
+                cache.block_count--;
+                if (read == -1) {
+                    syslog(LOG_ERR, "failed to read band: %s", strerror(errno));
+                    return -errno;
+                }
+                continue;
+            }
 
-    return ret;
-}
-#endif
+            reading_block.front().length = read;
+            cache.probationary_blocks.splice(cache.probationary_blocks.begin(), reading_block);
+            iter = cache.blocks.insert(make_pair(key, cache.probationary_blocks.begin())).first;
+        }
 
-static int sparsebundle_release(const char *path, struct fuse_file_info *)
-{
-    sparsebundle_t *sparsebundle = sparsebundle_current();
+        const sparsebundle_block_t &block = *iter->second;
+        if (block.length <= block_offset)
+            break; // Past the end of the band file
 
-    assert(sparsebundle->times_opened);
-    sparsebundle->times_opened--;
-    syslog(LOG_DEBUG, "closed %s%s, now referenced %ju times",
-        sparsebundle->mountpoint, path, uintmax_t(sparsebundle->times_opened));
+        size_t to_copy = min(length - bytes_read, block.length - block_offset);
+        memcpy(buffer + bytes_read, block.data.get() + block_offset, to_copy);
+        bytes_read += to_copy;
 
-    if (sparsebundle->times_opened == 0) {
-        syslog(LOG_DEBUG, "no more references, cleaning up");
-        sparsebundle_close_files();
+        if (block.length < sparsebundle_block_size)
+            break;
     }
 
-    return 0;
+    return bytes_read;
+}
+
+static void sparsebundle_invalidate_cached(sparsebundle_t *sparsebundle, uint64_t band_number,
+    size_t length, off_t offset)
+{
+    sparsebundle_block_cache_t &cache = sparsebundle->mount->block_cache;
+    if (!cache.max_blocks || !length)
+        return;
+
+    lock_guard<mutex> locker(cache.lock);
+    cache.generation++;
+
+    uint64_t last_block = (offset + length - 1) / sparsebundle_block_size;
+    for (uint64_t block_number = offset / sparsebundle_block_size; block_number <= last_block; ++block_number) {
+        auto iter = cache.blocks.find(sparsebundle_block_key(sparsebundle, band_number, block_number));
+        if (iter == cache.blocks.end())
+            continue;
+
+        sparsebundle_blocks_t::iterator block = iter->second;
+        if (block->is_protected)
+            cache.protected_blocks.erase(block);
+        else
+            cache.probationary_blocks.erase(block);
+        cache.blocks.erase(iter);
+        cache.block_count--;
+    }
+}
+
+/*
+    I/O pool
+
+    A read spanning several bands is split into one pread per band,
+    and rather than waiting for each of them in turn, all but the first
+    are handed to a pool of I/O threads, so that the latency of the read
+    is that of the slowest band, not the sum of them. This matters most
+    when the bands live on network storage. Large reads of encrypted
+    bundles are decrypted by the same pool.
+
+    The pool is shared by all reads, and started on first use, after
+    FUSE has daemonized. A thread waiting for its reads helps process
+    queued reads, so a busy pool is never slower than reading serially.
+*/
+
+struct sparsebundle_io_batch_t;
+
+// With crypto set, decrypts the buffer instead of reading into it,
+// and the offset is the number of the first chunk.
+struct sparsebundle_io_t {
+    int fd;
+    char *buffer;
+    size_t length;
+    off_t offset;
+    int error;
+    sparsebundle_io_batch_t *batch;
+    const sparsebundle_crypto_t *crypto;
+};
+
+struct sparsebundle_io_batch_t {
+    size_t pending;
+};
+
+struct sparsebundle_io_pool_t {
+    mutex lock;
+    condition_variable work_available;
+    condition_variable work_done;
+    deque<sparsebundle_io_t *> queue;
+    vector<thread> threads;
+    bool stopping;
+};
+
+static sparsebundle_io_pool_t sparsebundle_io_pool;
+
+static void sparsebundle_do_io(sparsebundle_io_t *io)
+{
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+    if (io->crypto) {
+        io->error = -sparsebundle_decrypt(io->crypto, io->buffer, io->length, uint64_t(io->offset));
+        return;
+    }
+#endif
+
+    size_t bytes_read = 0;
+    while (bytes_read < io->length) {
+        ssize_t read = pread(io->fd, io->buffer + bytes_read,
+            io->length - bytes_read, io->offset + bytes_read);
+        if (read == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "failed to read band: %s", strerror(errno));
+            io->error = errno;
+            return;
+        }
+
+        if (read == 0) {
+            // Band file is shorter than when we looked
+            memset(io->buffer + bytes_read, 0, io->length - bytes_read);
+            break;
+        }
+
+        bytes_read += read;
+    }
+}
+
+// Must be called with the I/O pool lock held, which is dropped
+// while doing the I/O.
+static void sparsebundle_process_queued_io(unique_lock<mutex> &locker)
+{
+    sparsebundle_io_pool_t &pool = sparsebundle_io_pool;
+
+    sparsebundle_io_t *io = pool.queue.front();
+    pool.queue.pop_front();
+
+    locker.unlock();
+    sparsebundle_do_io(io);
+    locker.lock();
+
+    if (!--io->batch->pending)
+        pool.work_done.notify_all();
+}
+
+static void sparsebundle_io_thread()
+{
+    sparsebundle_io_pool_t &pool = sparsebundle_io_pool;
+
+    unique_lock<mutex> locker(pool.lock);
+    while (true) {
+        pool.work_available.wait(locker, [&pool]() {
+            return pool.stopping || !pool.queue.empty();
+        });
+
+        if (pool.queue.empty())
+            return;
+
+        sparsebundle_process_queued_io(locker);
+    }
+}
+
+static void sparsebundle_start_io_threads(unsigned thread_count)
+{
+    sparsebundle_io_pool_t &pool = sparsebundle_io_pool;
+
+    lock_guard<mutex> locker(pool.lock);
+    if (!pool.threads.empty() || pool.stopping)
+        return;
+
+    sparsebundle_debug("starting %u I/O threads", thread_count);
+    for (unsigned i = 0; i < thread_count; ++i)
+        pool.threads.push_back(thread(sparsebundle_io_thread));
+}
+
+static void sparsebundle_stop_io_threads()
+{
+    sparsebundle_io_pool_t &pool = sparsebundle_io_pool;
+
+    {
+        lock_guard<mutex> locker(pool.lock);
+        pool.stopping = true;
+    }
+    pool.work_available.notify_all();
+
+    for (thread &io_thread : pool.threads)
+        io_thread.join();
+    pool.threads.clear();
+}
+
+// Returns 0, or -errno if any of the reads failed
+static int sparsebundle_do_ios(sparsebundle_mount_t *mount, vector<sparsebundle_io_t> &ios)
+{
+    sparsebundle_io_pool_t &pool = sparsebundle_io_pool;
+
+    if (ios.size() > 1 && mount->options.io_threads) {
+        static once_flag io_threads_started;
+        call_once(io_threads_started, sparsebundle_start_io_threads,
+            mount->options.io_threads);
+
+        sparsebundle_io_batch_t batch = { ios.size() - 1 };
+
+        {
+            lock_guard<mutex> locker(pool.lock);
+            for (size_t i = 1; i < ios.size(); ++i) {
+                ios[i].batch = &batch;
+                pool.queue.push_back(&ios[i]);
+            }
+        }
+        pool.work_available.notify_all();
+
+        sparsebundle_do_io(&ios[0]);
+
+        unique_lock<mutex> locker(pool.lock);
+        while (batch.pending) {
+            if (!pool.queue.empty())
+                sparsebundle_process_queued_io(locker);
+            else
+                pool.work_done.wait(locker);
+        }
+    } else {
+        for (sparsebundle_io_t &io : ios)
+            sparsebundle_do_io(&io);
+    }
+
+    for (const sparsebundle_io_t &io : ios) {
+        if (io.error)
+            return -io.error;
+    }
+
+    return 0;
+}
+
+typedef chrono::steady_clock sparsebundle_clock;
+
+static void sparsebundle_record_read(sparsebundle_read_stats_t &stats, int ret,
+    sparsebundle_clock::time_point start)
+{
+    uint64_t microseconds = chrono::duration_cast<chrono::microseconds>(
+        sparsebundle_clock::now() - start).count();
+
+    // Bucket n counts reads that took less than 2^n microseconds
+    unsigned bucket = 0;
+    while (microseconds && bucket < sparsebundle_latency_buckets - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+
+    stats.calls.fetch_add(1, memory_order_relaxed);
+    if (ret > 0)
+        stats.bytes.fetch_add(ret, memory_order_relaxed);
+    stats.latencies[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+static void sparsebundle_format_read_stats(ostream &out, const char *name,
+    const sparsebundle_read_stats_t &stats)
+{
+    out << name << "_calls " << stats.calls.load(memory_order_relaxed) << '\n';
+    out << name << "_bytes " << stats.bytes.load(memory_order_relaxed) << '\n';
+    for (unsigned bucket = 0; bucket < sparsebundle_latency_buckets; ++bucket) {
+        out << name << "_latency_us_";
+        if (bucket < sparsebundle_latency_buckets - 1)
+            out << "lt_" << (uint64_t(1) << bucket);
+        else
+            out << "ge_" << (uint64_t(1) << (bucket - 1));
+        out << ' ' << stats.latencies[bucket].load(memory_order_relaxed) << '\n';
+    }
+}
+
+static string sparsebundle_format_stats(sparsebundle_mount_t *mount)
+{
+    ostringstream out;
+
+    sparsebundle_format_read_stats(out, "read", mount->stats.read);
+    sparsebundle_format_read_stats(out, "read_buf", mount->stats.read_buf);
+    out << "hole_bytes " << mount->stats.hole_bytes.load(memory_order_relaxed) << '\n';
+    out << "bands_touched " << mount->stats.bands_touched.load(memory_order_relaxed) << '\n';
+
+    {
+        lock_guard<mutex> locker(mount->lock);
+        out << "bundles " << mount->bundles.size() << '\n';
+        out << "open_bands " << mount->open_bands << '\n';
+        out << "max_open_bands " << mount->max_open_bands << '\n';
+        out << "band_cache_hits " << mount->band_cache_stats.hits << '\n';
+        out << "band_cache_misses " << mount->band_cache_stats.misses << '\n';
+        out << "band_cache_evictions " << mount->band_cache_stats.evictions << '\n';
+        out << "band_cache_emfile_recoveries " << mount->band_cache_stats.emfile_recoveries << '\n';
+    }
+
+    {
+        lock_guard<mutex> locker(mount->block_cache.lock);
+        out << "block_cache_blocks " << mount->block_cache.block_count << '\n';
+        out << "block_cache_hits " << mount->block_cache.hits << '\n';
+        out << "block_cache_misses " << mount->block_cache.misses << '\n';
+    }
+
+    return out.str();
+}
+
+static int sparsebundle_read_stats(struct fuse_file_info *fi, char *buffer, size_t length, off_t offset)
+{
+    const string &stats = sparsebundle_handle(fi)->stats;
+
+    assert(offset >= 0);
+    if (uint64_t(offset) >= stats.size())
+        return 0;
+
+    length = min(length, size_t(stats.size() - offset));
+    memcpy(buffer, stats.data() + offset, length);
+    return length;
+}
+
+/*
+    Band checksums
+
+    Silent corruption of band files, e.g. by failing storage, otherwise
+    only shows once the file system inside the image fails to mount.
+    Each bundle can therefore have a SHA-256 digest of each of its
+    bands recorded in a sidecar file, made and checked by --scrub, see
+    below. Each digest is recorded along with the length and the
+    modification time of the band when it was hashed, so that a band
+    that has been written to since, e.g. through a read-write mount,
+    is told apart from a corrupt one, which keeps both.
+
+    With -o verify each band is checked against its digest the first
+    time it's read while mounted, and reads from a corrupt band fail
+    with EIO rather than handing out bad data. Bands are hashed in
+    large sequential reads, through OpenSSL when built with it, which
+    uses the SHA extensions or vector instructions of the CPU, and
+    otherwise through a portable implementation.
+*/
+
+static const size_t sparsebundle_digest_size = 32;
+static const size_t sparsebundle_hash_read_size = 1024 * 1024;
+
+struct sparsebundle_checksum_t {
+    off_t length; // -1 if the band has no checksum
+    uint64_t modification_time; // In nanoseconds
+    uint8_t digest[sparsebundle_digest_size];
+};
+
+enum sparsebundle_band_check_t : uint8_t {
+    sparsebundle_band_unchecked, sparsebundle_band_checked, sparsebundle_band_corrupt
+};
+
+struct sparsebundle_checksums_t {
+    vector<sparsebundle_checksum_t> bands;
+    vector<atomic<uint8_t>> band_checks;
+};
+
+static uint64_t sparsebundle_modification_time(const struct stat &file_stat)
+{
+#if defined(__APPLE__)
+    const struct timespec &time = file_stat.st_mtimespec;
+#else
+    const struct timespec &time = file_stat.st_mtim;
+#endif
+    return uint64_t(time.tv_sec) * 1000000000 + uint64_t(time.tv_nsec);
+}
+
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+struct sparsebundle_hash_t {
+    EVP_MD_CTX *context;
+};
+
+static bool sparsebundle_hash_begin(sparsebundle_hash_t *hash)
+{
+    hash->context = EVP_MD_CTX_new();
+    if (hash->context && EVP_DigestInit_ex(hash->context, EVP_sha256(), 0) == 1)
+        return true;
+    EVP_MD_CTX_free(hash->context);
+    return false;
+}
+
+static void sparsebundle_hash_update(sparsebundle_hash_t *hash, const char *data, size_t length)
+{
+    EVP_DigestUpdate(hash->context, data, length);
+}
+
+static void sparsebundle_hash_finish(sparsebundle_hash_t *hash, uint8_t *digest)
+{
+    EVP_DigestFinal_ex(hash->context, digest, 0);
+    EVP_MD_CTX_free(hash->context);
+}
+#else
+static const uint32_t sparsebundle_sha256_round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+struct sparsebundle_hash_t {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+};
+
+static uint32_t sparsebundle_rotate_right(uint32_t value, unsigned bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sparsebundle_sha256_block(uint32_t *state, const uint8_t *block)
+{
+    uint32_t schedule[64];
+    for (unsigned i = 0; i < 16; ++i)
+        schedule[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16
+            | uint32_t(block[4 * i + 2]) << 8 | uint32_t(block[4 * i + 3]);
+    for (unsigned i = 16; i < 64; ++i) {
+        uint32_t s0 = sparsebundle_rotate_right(schedule[i - 15], 7)
+            ^ sparsebundle_rotate_right(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+        uint32_t s1 = sparsebundle_rotate_right(schedule[i - 2], 17)
+            ^ sparsebundle_rotate_right(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+        schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (unsigned i = 0; i < 64; ++i) {
+        uint32_t s1 = sparsebundle_rotate_right(e, 6) ^ sparsebundle_rotate_right(e, 11)
+            ^ sparsebundle_rotate_right(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + sparsebundle_sha256_round_constants[i] + schedule[i];
+        uint32_t s0 = sparsebundle_rotate_right(a, 2) ^ sparsebundle_rotate_right(a, 13)
+            ^ sparsebundle_rotate_right(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + s0 + majority;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static bool sparsebundle_hash_begin(sparsebundle_hash_t *hash)
+{
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(hash->state, initial_state, sizeof(initial_state));
+    hash->length = 0;
+    return true;
+}
+
+static void sparsebundle_hash_update(sparsebundle_hash_t *hash, const char *data, size_t length)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    while (length) {
+        size_t buffered = hash->length % sizeof(hash->block);
+        if (!buffered && length >= sizeof(hash->block)) {
+            sparsebundle_sha256_block(hash->state, bytes);
+            hash->length += sizeof(hash->block);
+            bytes += sizeof(hash->block);
+            length -= sizeof(hash->block);
+            continue;
+        }
+
+        size_t to_copy = min(length, sizeof(hash->block) - buffered);
+        memcpy(hash->block + buffered, bytes, to_copy);
+        hash->length += to_copy;
+        bytes += to_copy;
+        length -= to_copy;
+        if (buffered + to_copy == sizeof(hash->block))
+            sparsebundle_sha256_block(hash->state, hash->block);
+    }
+}
+
+static void sparsebundle_hash_finish(sparsebundle_hash_t *hash, uint8_t *digest)
+{
+    // Pads with a one bit, zeroes, and the length in bits
+    uint64_t bit_length = hash->length * 8;
+    char padding[72] = { char(0x80) };
+    size_t padding_length = (sizeof(hash->block) + 56 - hash->length % sizeof(hash->block) - 1)
+        % sizeof(hash->block) + 1;
+    for (unsigned i = 0; i < 8; ++i)
+        padding[padding_length + i] = char(bit_length >> (56 - 8 * i));
+    sparsebundle_hash_update(hash, padding, padding_length + 8);
+
+    for (unsigned i = 0; i < sparsebundle_digest_size; ++i)
+        digest[i] = uint8_t(hash->state[i / 4] >> (24 - 8 * (i % 4)));
+}
+#endif
+
+/*
+    Throttling
+
+    Bulk reads, such as those of a scrub, can be limited to a number
+    of bytes per second, shared by the threads doing them, by having
+    each read wait for its slot in the budget before going ahead.
+*/
+
+struct sparsebundle_throttle_t {
+    mutex lock;
+    uint64_t bytes_per_second;
+    sparsebundle_clock::time_point next_read;
+};
+
+static void sparsebundle_throttle(sparsebundle_throttle_t *throttle, size_t length)
+{
+    if (!throttle || !throttle->bytes_per_second)
+        return;
+
+    sparsebundle_clock::time_point start;
+    {
+        lock_guard<mutex> locker(throttle->lock);
+        start = max(throttle->next_read, sparsebundle_clock::now());
+        throttle->next_read = start + chrono::duration_cast<sparsebundle_clock::duration>(
+            chrono::duration<double>(double(length) / throttle->bytes_per_second));
+    }
+
+    this_thread::sleep_until(start);
+}
+
+// Hashes the band from the start, returning the number of bytes
+// hashed, or -errno on failure.
+static ssize_t sparsebundle_hash_band(int fd, uint8_t *digest, sparsebundle_throttle_t *throttle = nullptr)
+{
+    // Reused between bands on the same thread
+    static thread_local unique_ptr<char[]> buffer(new char[sparsebundle_hash_read_size]);
+
+    sparsebundle_hash_t hash;
+    if (!sparsebundle_hash_begin(&hash))
+        return -ENOMEM;
+
+    off_t hashed = 0;
+    while (true) {
+        ssize_t read = pread(fd, buffer.get(), sparsebundle_hash_read_size, hashed);
+        if (read == -1 && errno == EINTR)
+            continue;
+        if (read <= 0) {
+            int error = read ? errno : 0;
+            sparsebundle_hash_finish(&hash, digest);
+            return error ? -error : hashed;
+        }
+
+        sparsebundle_hash_update(&hash, buffer.get(), size_t(read));
+        hashed += read;
+
+        // Waits out the time the read takes of the budget
+        sparsebundle_throttle(throttle, size_t(read));
+    }
+}
+
+// Checks the band against its checksum the first time it's read with
+// -o verify, returning 0, or -EIO if it doesn't match. Threads racing
+// to check the same band both hash it, which does no harm.
+static int sparsebundle_verify_band(sparsebundle_t *sparsebundle, uint64_t band_number, int fd)
+{
+    sparsebundle_checksums_t *checksums = sparsebundle->checksums;
+    if (!checksums)
+        return 0;
+
+    atomic<uint8_t> &band_check = checksums->band_checks[band_number];
+    switch (band_check.load(memory_order_acquire)) {
+    case sparsebundle_band_checked:
+        return 0;
+    case sparsebundle_band_corrupt:
+        return -EIO;
+    }
+
+    const sparsebundle_checksum_t &checksum = checksums->bands[band_number];
+
+    struct stat band_stat;
+    if (fstat(fd, &band_stat) == -1)
+        return -errno;
+
+    bool corrupt = false;
+    if (checksum.length == -1) {
+        sparsebundle_debug("band %jx has no checksum, not verifying", uintmax_t(band_number));
+    } else if (checksum.length != band_stat.st_size
+        || checksum.modification_time != sparsebundle_modification_time(band_stat)) {
+        sparsebundle_debug("band %jx was changed since its checksum was made, not verifying",
+            uintmax_t(band_number));
+    } else {
+        uint8_t digest[sparsebundle_digest_size];
+        ssize_t hashed = sparsebundle_hash_band(fd, digest);
+        if (hashed < 0)
+            return int(hashed);
+
+        corrupt = hashed != checksum.length || memcmp(digest, checksum.digest, sizeof(digest)) != 0;
+        if (corrupt)
+            syslog(LOG_ERR, "band %jx of %s doesn't match its checksum", uintmax_t(band_number),
+                sparsebundle->path);
+        else
+            sparsebundle_debug("verified band %jx", uintmax_t(band_number));
+    }
+
+    band_check.store(corrupt ? sparsebundle_band_corrupt : sparsebundle_band_checked, memory_order_release);
+    return corrupt ? -EIO : 0;
+}
+
+struct sparsebundle_read_data_t {
+    char *buffer;
+    vector<sparsebundle_io_t> &ios;
+};
+
+static int sparsebundle_read_process_band(sparsebundle_t *sparsebundle, uint64_t band_number,
+    size_t length, off_t offset, void *read_data)
+{
+    assert(length <= numeric_limits<int>::max());
+
+    ssize_t read = 0;
+
+    sparsebundle_read_data_t *data = static_cast<sparsebundle_read_data_t *>(read_data);
+
+    sparsebundle_trace("reading %zu bytes at offset %ju into %p",
+        length, uintmax_t(offset), static_cast<void *>(data->buffer));
+
+    off_t band_length;
+    int band_file_fd = sparsebundle_open_band(sparsebundle, band_number, &band_length);
+    if (band_file_fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    int ret = sparsebundle_verify_band(sparsebundle, band_number, band_file_fd);
+    if (ret < 0)
+        return ret;
+
+    if (offset >= band_length)
+        return 0;
+
+    if (sparsebundle->mount->block_cache.max_blocks) {
+        read = sparsebundle_read_cached(sparsebundle, band_number, band_file_fd, band_length,
+            data->buffer, length, offset);
+        if (read < 0)
+            return read;
+
+        data->buffer += read;
+        return read;
+    }
+
+    // The actual reading is done once all bands have been processed
+    read = min(off_t(length), band_length - offset);
+    sparsebundle_io_t io = { band_file_fd, data->buffer, size_t(read), offset, 0, 0, 0 };
+    data->ios.push_back(io);
+
+    data->buffer += read;
+
+    return read;
+}
+
+static int sparsebundle_read_pad_with_zeroes(sparsebundle_t *, size_t length, void *read_data)
+{
+    sparsebundle_read_data_t *data = static_cast<sparsebundle_read_data_t *>(read_data);
+
+    sparsebundle_trace("padding %zu bytes of zeroes into %p",
+        length, static_cast<void *>(data->buffer));
+
+    memset(data->buffer, 0, length);
+    data->buffer += length;
+
+    return length;
+}
+
+// Reads from the bands as they are, returning the number of bytes
+// read, or -errno on failure.
+static int sparsebundle_read_bands(sparsebundle_t *sparsebundle, char *buffer, size_t length, off_t offset)
+{
+    // Reused between reads on the same thread
+    static thread_local vector<sparsebundle_io_t> ios;
+    ios.clear();
+
+    sparsebundle_read_data_t read_data = { buffer, ios };
+
+    sparsebundle_read_operations read_ops = {
+        &sparsebundle_read_process_band,
+        sparsebundle_read_pad_with_zeroes,
+        &read_data
+    };
+
+    int ret = sparsebundle_iterate_bands(sparsebundle, length, offset, &read_ops);
+    if (ret > 0 && !ios.empty()) {
+        int io_ret = sparsebundle_do_ios(sparsebundle->mount, ios);
+        if (io_ret < 0)
+            ret = io_ret;
+    }
+
+    return ret;
+}
+
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+// Reads smaller than this are decrypted by the reading thread alone
+static const size_t sparsebundle_decrypt_batch_size = 256 * 1024;
+
+static int sparsebundle_read_encrypted(sparsebundle_t *sparsebundle, char *buffer, size_t length, off_t offset)
+{
+    const sparsebundle_crypto_t *crypto = sparsebundle->crypto;
+    size_t chunk_size = crypto->chunk_size;
+
+    // The image is whole chunks, which was checked when mounting
+    assert(offset >= 0);
+    if (uint64_t(offset) >= sparsebundle->size)
+        return 0;
+    length = size_t(min(uint64_t(length), sparsebundle->size - offset));
+
+    uint64_t first_chunk = offset / chunk_size;
+    off_t chunks_offset = first_chunk * chunk_size;
+    size_t chunks_length = (offset - chunks_offset + length + chunk_size - 1) / chunk_size * chunk_size;
+
+    // Reads of whole chunks are decrypted in place
+    static thread_local vector<char> chunks;
+    char *data = buffer;
+    if (chunks_offset != offset || chunks_length != length) {
+        chunks.resize(chunks_length);
+        data = chunks.data();
+    }
+
+    int ret = sparsebundle_read_bands(sparsebundle, data, chunks_length, chunks_offset);
+    if (ret <= 0)
+        return ret;
+    assert(size_t(ret) == chunks_length);
+
+    static thread_local vector<sparsebundle_io_t> decrypt_ios;
+    decrypt_ios.clear();
+
+    size_t batch_size = max(sparsebundle_decrypt_batch_size / chunk_size, size_t(1)) * chunk_size;
+    for (size_t batched = 0; batched < chunks_length; batched += batch_size) {
+        sparsebundle_io_t io = { -1, data + batched, min(batch_size, chunks_length - batched),
+            off_t(first_chunk + batched / chunk_size), 0, 0, crypto };
+        decrypt_ios.push_back(io);
+    }
+
+    ret = sparsebundle_do_ios(sparsebundle->mount, decrypt_ios);
+    if (ret < 0)
+        return ret;
+
+    if (data != buffer)
+        memcpy(buffer, data + (offset - chunks_offset), length);
+
+    return length;
+}
+#endif
+
+static int sparsebundle_hfs_read_fork(sparsebundle_t *sparsebundle, const sparsebundle_hfs_fork_t &fork,
+    char *buffer, size_t length, off_t offset);
+
+// Reads from the image, decrypting it if need be
+static int sparsebundle_read_image(sparsebundle_t *sparsebundle, char *buffer, size_t length, off_t offset)
+{
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+    if (sparsebundle->crypto)
+        return sparsebundle_read_encrypted(sparsebundle, buffer, length, offset);
+#endif
+    return sparsebundle_read_bands(sparsebundle, buffer, length, offset);
+}
+
+// Reads into the buffer for the read entry point, or for read_buf
+// when it can't do zero-copy, and records the read against it
+static int sparsebundle_read_data(const char *path, char *buffer, size_t length, off_t offset,
+           struct fuse_file_info *fi, bool for_read_buf)
+{
+    if (strcmp(path, stats_path) == 0)
+        return sparsebundle_read_stats(fi, buffer, length, offset);
+
+    sparsebundle_clock::time_point start = sparsebundle_clock::now();
+    sparsebundle_handle_t *handle = sparsebundle_handle(fi);
+    sparsebundle_t *sparsebundle = handle->sparsebundle;
+    sparsebundle_stats_t &stats = sparsebundle->mount->stats;
+
+    sparsebundle_trace("asked to read %zu bytes at offset %ju", length, uintmax_t(offset));
+
+    int ret = 0;
+    if (handle->fork)
+        ret = sparsebundle_hfs_read_fork(sparsebundle, *handle->fork, buffer, length, offset);
+    else
+        ret = sparsebundle_read_image(sparsebundle, buffer, length, offset);
+
+    // Read-ahead goes by offsets in the image
+    if (ret > 0 && !handle->fork)
+        sparsebundle_read_ahead(fi, length, offset);
+
+    sparsebundle_release_files();
+
+    sparsebundle_record_read(for_read_buf ? stats.read_buf : stats.read, ret, start);
+    return ret;
+}
+
+static int sparsebundle_read(const char *path, char *buffer, size_t length, off_t offset,
+           struct fuse_file_info *fi)
+{
+    return sparsebundle_read_data(path, buffer, length, offset, fi, false);
+}
+
+#if FUSE_SUPPORTS_ZERO_COPY
+/*
+    Zero padding in the zero-copy path
+
+    Holes are handed to FUSE as ranges of a file that reads as all
+    zeroes, shared by all reads and opened once when mounting. Where
+    possible this is an empty memory file (memfd), which the kernel can
+    splice zero pages from, and otherwise /dev/zero. We can't hand out
+    a shared zero-filled memory buffer, as FUSE frees memory buffers.
+
+    Adjacent holes are merged into one buffer, using consecutive ranges
+    of the zero file, so a read of a mostly sparse region returns few
+    buffers no matter how many bands it crosses.
+*/
+
+static const off_t sparsebundle_zeroes_size = off_t(1) << 30;
+
+static int sparsebundle_open_zeroes()
+{
+#if defined(MFD_CLOEXEC)
+    int fd = memfd_create("sparsebundlefs-zeroes", MFD_CLOEXEC);
+    if (fd != -1) {
+        if (ftruncate(fd, sparsebundle_zeroes_size) == 0)
+            return fd;
+        close(fd);
+    }
+    sparsebundle_debug("failed to create zero memory file: %s", strerror(errno));
+#endif
+    return open("/dev/zero", O_RDONLY);
+}
+
+/*
+    The buffer vector handed to FUSE is allocated up front, with room
+    for the most buffers a read can need: one for the data and one for
+    the padding of each band, and the zero padding split in pieces of
+    the zero file's size. FUSE frees the vector when it's done with it,
+    so there's one allocation per read, and no copying of buffers.
+
+    Buffers of the same file at consecutive offsets are merged.
+*/
+
+static size_t sparsebundle_max_buffers(sparsebundle_t *sparsebundle, size_t length, off_t offset)
+{
+    uint64_t band_offset = offset % sparsebundle->band_size;
+    uint64_t bands = (band_offset + length + sparsebundle->band_size - 1) / sparsebundle->band_size;
+    return size_t(2 * bands + length / sparsebundle_zeroes_size + 1);
+}
+
+static void sparsebundle_add_buffer(fuse_bufvec *buffers, size_t size, int fd, off_t pos)
+{
+    if (buffers->count) {
+        fuse_buf &previous = buffers->buf[buffers->count - 1];
+        if (previous.fd == fd && previous.pos + off_t(previous.size) == pos) {
+            previous.size += size;
+            return;
+        }
+    }
+
+    fuse_buf &buffer = buffers->buf[buffers->count++];
+    buffer.size = size;
+    buffer.flags = fuse_buf_flags(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buffer.mem = 0;
+    buffer.fd = fd;
+    buffer.pos = pos;
+}
+
+static int sparsebundle_read_buf_process_band(sparsebundle_t *sparsebundle, uint64_t band_number,
+    size_t length, off_t offset, void *read_data)
+{
+    size_t read = 0;
+
+    fuse_bufvec *buffers = static_cast<fuse_bufvec *>(read_data);
+
+    sparsebundle_trace("preparing %zu bytes at offset %ju", length,
+        uintmax_t(offset));
+
+    off_t band_length;
+    int band_file_fd = sparsebundle_open_band(sparsebundle, band_number, &band_length);
+    if (band_file_fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    int ret = sparsebundle_verify_band(sparsebundle, band_number, band_file_fd);
+    if (ret < 0) {
+        sparsebundle_release_last_band();
+        return ret;
+    }
+
+    read += max(off_t(0), min(static_cast<off_t>(length), band_length - offset));
+
+    if (read > 0)
+        sparsebundle_add_buffer(buffers, read, sparsebundle_hand_over_band(band_file_fd), offset);
+    else
+        sparsebundle_release_last_band();
+
+    return read;
+}
+
+static int sparsebundle_read_buf_pad_with_zeroes(sparsebundle_t *sparsebundle, size_t length, void *read_data)
+{
+    int zeroes_fd = sparsebundle->mount->zeroes_fd;
+    fuse_bufvec *buffers = static_cast<fuse_bufvec *>(read_data);
+
+    size_t padded = 0;
+    while (padded < length) {
+        // Continue where the previous zero padding left off, if any
+        off_t zeroes_offset = 0;
+        if (buffers->count && buffers->buf[buffers->count - 1].fd == zeroes_fd) {
+            const fuse_buf &previous = buffers->buf[buffers->count - 1];
+            zeroes_offset = (previous.pos + previous.size) % sparsebundle_zeroes_size;
+        }
+
+        size_t to_pad = size_t(min(off_t(length - padded), sparsebundle_zeroes_size - zeroes_offset));
+        sparsebundle_add_buffer(buffers, to_pad, zeroes_fd, zeroes_offset);
+        padded += to_pad;
+    }
+
+    return length;
+}
+
+// For the stats file, and images that aren't stored in the bands as
+// they are, the data is read into a memory buffer with the read path.
+static int sparsebundle_read_buf_copy(const char *path, struct fuse_bufvec **bufp,
+                        size_t length, off_t offset, struct fuse_file_info *fi)
+{
+    // FUSE frees both the buffer vector and the memory buffer
+    struct fuse_bufvec *buffer_vector = static_cast<fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+    char *buffer = static_cast<char *>(malloc(length));
+    if (buffer_vector == 0 || buffer == 0) {
+        free(buffer_vector);
+        free(buffer);
+        return -ENOMEM;
+    }
+
+    int ret = sparsebundle_read_data(path, buffer, length, offset, fi, true);
+    if (ret < 0) {
+        free(buffer_vector);
+        free(buffer);
+        return ret;
+    }
+
+    buffer_vector->count = 1;
+    buffer_vector->idx = 0;
+    buffer_vector->off = 0;
+    fuse_buf &memory = buffer_vector->buf[0];
+    memory.size = ret;
+    memory.flags = fuse_buf_flags(0);
+    memory.mem = buffer;
+    memory.fd = -1;
+    memory.pos = 0;
+
+    *bufp = buffer_vector;
+    return ret;
+}
+
+static int sparsebundle_hfs_read_buf(sparsebundle_t *sparsebundle, const sparsebundle_hfs_fork_t &fork,
+    struct fuse_bufvec **bufp, size_t length, off_t offset);
+
+static int sparsebundle_read_buf(const char *path, struct fuse_bufvec **bufp,
+                        size_t length, off_t offset, struct fuse_file_info *fi)
+{
+    assert(length <= numeric_limits<int>::max());
+
+    sparsebundle_handle_t *handle = sparsebundle_handle(fi);
+    sparsebundle_t *sparsebundle = handle->sparsebundle;
+    if (!sparsebundle || sparsebundle->crypto)
+        return sparsebundle_read_buf_copy(path, bufp, length, offset, fi);
+
+    sparsebundle_clock::time_point start = sparsebundle_clock::now();
+    sparsebundle_read_stats_t &stats = sparsebundle->mount->stats.read_buf;
+
+    int ret = 0;
+
+    // FUSE is done with the files from this thread's previous
+    // zero-copy read, as it replies before handing us a new one.
+    sparsebundle_release_files();
+
+    if (handle->fork) {
+        ret = sparsebundle_hfs_read_buf(sparsebundle, *handle->fork, bufp, length, offset);
+        sparsebundle_record_read(stats, ret, start);
+        return ret;
+    }
+
+    size_t max_buffers = sparsebundle_max_buffers(sparsebundle, length, offset);
+    size_t bufvec_size = sizeof(struct fuse_bufvec) + (sizeof(struct fuse_buf) * (max_buffers - 1));
+    struct fuse_bufvec *buffer_vector = static_cast<fuse_bufvec *>(malloc(bufvec_size));
+    if (buffer_vector == 0)
+        return -ENOMEM;
+
+    buffer_vector->count = 0;
+    buffer_vector->idx = 0;
+    buffer_vector->off = 0;
+
+    sparsebundle_read_operations read_ops = {
+        &sparsebundle_read_buf_process_band,
+        sparsebundle_read_buf_pad_with_zeroes,
+        buffer_vector
+    };
+
+    sparsebundle_trace("asked to read %zu bytes at offset %ju using zero-copy read",
+        length, uintmax_t(offset));
+
+    ret = sparsebundle_iterate_bands(sparsebundle, length, offset, &read_ops);
+    if (ret < 0) {
+        free(buffer_vector);
+        sparsebundle_record_read(stats, ret, start);
+        return ret;
+    }
+
+    assert(buffer_vector->count <= max_buffers);
+
+    sparsebundle_trace("returning %zu buffers to fuse", buffer_vector->count);
+    *bufp = buffer_vector;
+
+    if (ret > 0)
+        sparsebundle_read_ahead(fi, length, offset);
+
+    // Doesn't include the time FUSE takes to splice the buffers
+    sparsebundle_record_read(stats, ret, start);
+    return ret;
+}
+#endif
+
+#if FUSE_SUPPORTS_LSEEK
+/*
+    Finds the next data or hole at or after offset, for SEEK_DATA and
+    SEEK_HOLE. Missing bands, the part of a band past the end of its
+    file, and holes in the band files themselves are all holes, and
+    there's an implicit hole at the end of the image.
+*/
+static off_t sparsebundle_seek(sparsebundle_t *sparsebundle, off_t offset, int whence)
+{
+    assert(whence == SEEK_DATA || whence == SEEK_HOLE);
+
+    if (offset < 0 || uint64_t(offset) >= sparsebundle->size)
+        return -ENXIO;
+
+    uint64_t band_number = offset / sparsebundle->band_size;
+    off_t band_offset = offset % sparsebundle->band_size;
+    off_t result = -1;
+
+    for (; band_number < sparsebundle->band_count; band_number++, band_offset = 0) {
+        off_t band_start = band_number * sparsebundle->band_size;
+
+        if (!sparsebundle->present_bands[band_number]) {
+            if (whence == SEEK_HOLE) {
+                result = band_start + band_offset;
+                break;
+            }
+            continue;
+        }
+
+        off_t band_length;
+        int band_file_fd = sparsebundle_open_band(sparsebundle, band_number, &band_length);
+        if (band_file_fd == -1) {
+            if (errno != ENOENT)
+                return -errno;
+            band_length = 0;
+        }
+
+        if (band_offset >= band_length) {
+            if (whence == SEEK_HOLE) {
+                result = band_start + band_offset;
+                break;
+            }
+            continue;
+        }
+
+        off_t band_result = lseek(band_file_fd, band_offset, whence);
+        if (band_result == -1) {
+            if (errno == ENXIO) {
+                // No more data in this band file
+                assert(whence == SEEK_DATA);
+                continue;
+            } else if (errno == EINVAL) {
+                // Band file system doesn't know about holes,
+                // so the whole band file is data.
+                band_result = whence == SEEK_DATA ? band_offset : band_length;
+            } else {
+                syslog(LOG_ERR, "failed to seek in band %jx: %s",
+                    uintmax_t(band_number), strerror(errno));
+                return -errno;
+            }
+        }
+
+        if (whence == SEEK_DATA || band_result < off_t(sparsebundle->band_size)) {
+            // Data, or a hole inside the band or after a short band file
+            result = band_start + band_result;
+            break;
+        }
+    }
+
+    if (result == -1 || uint64_t(result) >= sparsebundle->size) {
+        // Ran off the end of the image
+        return whence == SEEK_DATA ? -ENXIO : off_t(sparsebundle->size);
+    }
+
+    return result;
+}
+
+static off_t sparsebundle_lseek(const char *path, off_t offset, int whence, struct fuse_file_info *)
+{
+    sparsebundle_t *sparsebundle = sparsebundle_lookup(sparsebundle_current_mount(), path);
+    if (!sparsebundle)
+        return -ENOENT;
+
+    // The kernel handles the other modes on its own
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return -EINVAL;
+
+    sparsebundle_trace("asked to seek to %s at offset %ju",
+        whence == SEEK_DATA ? "data" : "hole", uintmax_t(offset));
+
+    off_t ret = sparsebundle_seek(sparsebundle, offset, whence);
+    sparsebundle_release_files();
+    return ret;
+}
+#endif
+
+/*
+    Writing
+
+    When mounted read-write, writes are split over the bands the same
+    way as reads, and bands that don't exist yet are created when first
+    written to. Writing only zeroes to a part of a band that holds no
+    data, i.e. a missing band or past the end of a band file, is skipped,
+    as that part already reads as zeroes, so that zeroing an image
+    doesn't allocate every band of it. Band files never grow beyond the
+    band size.
+
+    Writes go straight to the band files, so there's nothing to flush
+    when a file handle is closed, but fsync syncs every band written
+    to since the last fsync, and the bands directory if bands have
+    been created since.
+*/
+
+static int sparsebundle_write_band(sparsebundle_t *sparsebundle, uint64_t band_number,
+    const char *buffer, size_t length, off_t offset)
+{
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+    sparsebundle_band_t &band = mount->bands[sparsebundle->first_band + band_number];
+
+    if (sparsebundle_is_zeroes(buffer, length)) {
+        lock_guard<mutex> locker(mount->lock);
+        if (!sparsebundle->present_bands[band_number]
+            || (band.length != -1 && offset >= band.length)) {
+            sparsebundle_trace("skipping %zu bytes of zeroes in band %jx at offset %ju",
+                length, uintmax_t(band_number), uintmax_t(offset));
+            return length;
+        }
+    }
+
+    sparsebundle_trace("writing %zu bytes to band %jx at offset %ju",
+        length, uintmax_t(band_number), uintmax_t(offset));
+
+    off_t band_length;
+    int band_file_fd = sparsebundle_open_band(sparsebundle, band_number, &band_length, sparsebundle_band_create);
+    if (band_file_fd == -1)
+        return -errno;
+
+    size_t bytes_written = 0;
+    while (bytes_written < length) {
+        ssize_t written = pwrite(band_file_fd, buffer + bytes_written,
+            length - bytes_written, offset + bytes_written);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "failed to write band %jx: %s", uintmax_t(band_number), strerror(errno));
+            return -errno;
+        }
+        bytes_written += written;
+    }
+
+    sparsebundle_invalidate_cached(sparsebundle, band_number, length, offset);
+
+    lock_guard<mutex> locker(mount->lock);
+
+    band.length = max(band.length, off_t(offset + length));
+
+    struct stat band_stat;
+    if (fstat(band_file_fd, &band_stat) == 0) {
+        sparsebundle->allocated_blocks += band_stat.st_blocks - band.blocks;
+        band.blocks = band_stat.st_blocks;
+    }
+
+    if (!band.needs_sync) {
+        band.needs_sync = true;
+        sparsebundle->unsynced_bands.push_back(uint32_t(band_number));
+    }
+
+    return length;
+}
+
+// Writes to the image, returning the number of bytes written,
+// or -errno if nothing could be written.
+static int sparsebundle_write_image(sparsebundle_t *sparsebundle, const char *buffer,
+    size_t length, off_t offset)
+{
+    assert(length <= numeric_limits<int>::max());
+    assert(offset >= 0);
+    if (uint64_t(offset) >= sparsebundle->size)
+        return length ? -ENOSPC : 0;
+
+    if (uint64_t(offset) + length > sparsebundle->size)
+        length = sparsebundle->size - offset;
+
+    sparsebundle_trace("asked to write %zu bytes at offset %ju", length, uintmax_t(offset));
+
+    int ret = 0;
+    size_t bytes_written = 0;
+    while (bytes_written < length) {
+        uint64_t band_number = (offset + bytes_written) / sparsebundle->band_size;
+        uint64_t band_offset = (offset + bytes_written) % sparsebundle->band_size;
+
+        size_t to_write = min(length - bytes_written, size_t(sparsebundle->band_size - band_offset));
+
+        ret = sparsebundle_write_band(sparsebundle, band_number, buffer + bytes_written, to_write, band_offset);
+        if (ret < 0)
+            break;
+
+        bytes_written += to_write;
+    }
+
+    sparsebundle_release_files();
+
+    // Report what was written before an error, if anything
+    return bytes_written ? int(bytes_written) : ret;
+}
+
+static int sparsebundle_write(const char *path, const char *buffer, size_t length, off_t offset,
+           struct fuse_file_info *)
+{
+    sparsebundle_t *sparsebundle = sparsebundle_lookup(sparsebundle_current_mount(), path);
+    if (!sparsebundle)
+        return -ENOENT;
+
+    return sparsebundle_write_image(sparsebundle, buffer, length, offset);
+}
+
+static int sparsebundle_flush(const char *, struct fuse_file_info *)
+{
+    return 0;
+}
+
+static int sparsebundle_sync(sparsebundle_t *sparsebundle, bool datasync)
+{
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+
+    vector<uint32_t> unsynced_bands;
+    bool needs_bands_sync = false;
+    {
+        lock_guard<mutex> locker(mount->lock);
+        unsynced_bands.swap(sparsebundle->unsynced_bands);
+        for (uint32_t band_number : unsynced_bands)
+            mount->bands[sparsebundle->first_band + band_number].needs_sync = false;
+        swap(needs_bands_sync, sparsebundle->needs_bands_sync);
+    }
+
+    sparsebundle_debug("syncing %zu band(s)", unsynced_bands.size());
+
+    int ret = 0;
+    for (uint32_t band_number : unsynced_bands) {
+        if (!sparsebundle->present_bands[band_number])
+            continue; // Deleted since written
+
+        off_t band_length;
+        int band_file_fd = sparsebundle_open_band(sparsebundle, band_number, &band_length);
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+        if (band_file_fd != -1 && (datasync ? fdatasync(band_file_fd) : fsync(band_file_fd)) == 0)
+            continue;
+#else
+        (void)datasync;
+        if (band_file_fd != -1 && fsync(band_file_fd) == 0)
+            continue;
+#endif
+        syslog(LOG_ERR, "failed to sync band %jx: %s", uintmax_t(band_number), strerror(errno));
+        ret = -errno;
+
+        // Try again on the next fsync
+        lock_guard<mutex> locker(mount->lock);
+        sparsebundle_band_t &band = mount->bands[sparsebundle->first_band + band_number];
+        if (!band.needs_sync) {
+            band.needs_sync = true;
+            sparsebundle->unsynced_bands.push_back(band_number);
+        }
+    }
+
+    sparsebundle_release_files();
+
+    if (needs_bands_sync && fsync(sparsebundle->bands_fd) == -1) {
+        syslog(LOG_ERR, "failed to sync bands directory: %s", strerror(errno));
+        ret = -errno;
+        lock_guard<mutex> locker(mount->lock);
+        sparsebundle->needs_bands_sync = true;
+    }
+
+    return ret;
+}
+
+static int sparsebundle_fsync(const char *path, int datasync, struct fuse_file_info *)
+{
+    sparsebundle_t *sparsebundle = sparsebundle_lookup(sparsebundle_current_mount(), path);
+    if (!sparsebundle)
+        return 0;
+
+    return sparsebundle_sync(sparsebundle, datasync);
+}
+
+#if SPARSEBUNDLE_SUPPORTS_DISCARD
+/*
+    Discarding
+
+    Punching a hole in the image, which is how loop devices pass on
+    discards, frees the storage of the bands: bands covered in full are
+    deleted, ranges reaching the end of a band file truncate it, and
+    other ranges are punched out of the band file, or zeroed if its
+    file system can't punch holes. A band that other threads are still
+    reading from is truncated instead of deleted, so that its open file
+    doesn't outlive the band file. Bands are only claimed under the
+    mount lock, and the deleting, truncating and punching happens
+    without it, with threads opening a band being deleted waiting for
+    it to be gone, so that they don't reopen or recreate it mid-way.
+*/
+
+static int sparsebundle_discard_band(sparsebundle_t *sparsebundle, uint64_t band_number,
+    size_t length, off_t offset)
+{
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+    uint32_t band_index = sparsebundle->first_band + uint32_t(band_number);
+    sparsebundle_band_t &band = mount->bands[band_index];
+
+    sparsebundle_trace("discarding %zu bytes of band %jx at offset %ju",
+        length, uintmax_t(band_number), uintmax_t(offset));
+
+    // The band is only claimed under the lock, and deleted without
+    // it, so that a slow file system doesn't hold up other threads.
+    bool deleting = false;
+    {
+        lock_guard<mutex> locker(mount->lock);
+
+        if (offset == 0 && band.length != -1 && off_t(length) >= band.length && !band.references
+            && !band.discarding) {
+            if (band.fd != -1)
+                sparsebundle_close_band(mount, band_index);
+
+            band.discarding = true;
+            sparsebundle->present_bands[band_number] = false;
+            deleting = true;
+        }
+    }
+
+    if (deleting) {
+        char band_name[sizeof(uintmax_t) * 2 + 1];
+        snprintf(band_name, sizeof(band_name), "%jx", uintmax_t(band_number));
+
+        int ret = 0;
+        if (unlinkat(sparsebundle->bands_fd, band_name, 0) == -1) {
+            syslog(LOG_ERR, "failed to delete band %s: %s", band_name, strerror(errno));
+            ret = -errno;
+        } else {
+            sparsebundle_debug("deleted band %s", band_name);
+        }
+
+        {
+            lock_guard<mutex> locker(mount->lock);
+            band.discarding = false;
+            if (ret == 0) {
+                sparsebundle->needs_bands_sync = true;
+                sparsebundle->allocated_blocks -= band.blocks;
+                band.blocks = 0;
+                band.length = -1;
+            } else {
+                sparsebundle->present_bands[band_number] = true;
+            }
+        }
+        mount->band_discarded.notify_all();
+
+        return ret;
+    }
+
+    // The file stays open until we release it, so it's ours to change
+    off_t band_length;
+    int band_file_fd = sparsebundle_open_band(sparsebundle, band_number, &band_length);
+    if (band_file_fd == -1)
+        return errno == ENOENT ? 0 : -errno;
+
+    if (offset >= band_length)
+        return 0;
+
+    bool truncating = offset + off_t(length) >= band_length;
+    if (truncating) {
+        if (ftruncate(band_file_fd, offset) == -1) {
+            syslog(LOG_ERR, "failed to truncate band %jx: %s", uintmax_t(band_number), strerror(errno));
+            return -errno;
+        }
+    } else if (fallocate(band_file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == -1) {
+        if (errno != EOPNOTSUPP) {
+            syslog(LOG_ERR, "failed to punch hole in band %jx: %s", uintmax_t(band_number), strerror(errno));
+            return -errno;
+        }
+
+        static const char zeroes[64 * 1024] = {};
+        for (size_t zeroed = 0; zeroed < length;) {
+            ssize_t written = pwrite(band_file_fd, zeroes,
+                min(length - zeroed, sizeof(zeroes)), offset + zeroed);
+            if (written == -1) {
+                if (errno == EINTR)
+                    continue;
+                syslog(LOG_ERR, "failed to zero band %jx: %s", uintmax_t(band_number), strerror(errno));
+                return -errno;
+            }
+            zeroed += written;
+        }
+    }
+
+    lock_guard<mutex> locker(mount->lock);
+
+    struct stat band_stat;
+    if (fstat(band_file_fd, &band_stat) == 0) {
+        // A write since truncating may have extended the band again
+        if (truncating)
+            band.length = band_stat.st_size;
+        sparsebundle->allocated_blocks += band_stat.st_blocks - band.blocks;
+        band.blocks = band_stat.st_blocks;
+    } else if (truncating) {
+        band.length = offset;
+    }
+
+    if (!band.needs_sync) {
+        band.needs_sync = true;
+        sparsebundle->unsynced_bands.push_back(uint32_t(band_number));
+    }
+
+    return 0;
+}
+
+// Discards the image from offset up to end, leaving it reading as zeroes
+static int sparsebundle_discard(sparsebundle_t *sparsebundle, uint64_t offset, uint64_t end)
+{
+    // Our references from an earlier zero-copy read would keep bands
+    sparsebundle_release_files();
+
+    int ret = 0;
+    for (uint64_t position = offset; position < end;) {
+        uint64_t band_number = position / sparsebundle->band_size;
+        uint64_t band_offset = position % sparsebundle->band_size;
+
+        uint64_t to_discard = min(end - position, sparsebundle->band_size - band_offset);
+
+        if (sparsebundle->present_bands[band_number]) {
+            ret = sparsebundle_discard_band(sparsebundle, band_number, size_t(to_discard), band_offset);
+            sparsebundle_invalidate_cached(sparsebundle, band_number, size_t(to_discard), band_offset);
+            sparsebundle_release_files();
+            if (ret < 0)
+                break;
+        }
+
+        position += to_discard;
+    }
+
+    return ret;
+}
+#endif
+
+#if FUSE_SUPPORTS_FALLOCATE
+static int sparsebundle_fallocate(const char *path, int mode, off_t offset, off_t length,
+           struct fuse_file_info *)
+{
+    sparsebundle_t *sparsebundle = sparsebundle_lookup(sparsebundle_current_mount(), path);
+    if (!sparsebundle)
+        return -ENOENT;
+
+    // The image can't grow, so only discarding makes sense
+    int operation = mode & ~FALLOC_FL_KEEP_SIZE;
+#if defined(FALLOC_FL_ZERO_RANGE)
+    if (operation == FALLOC_FL_ZERO_RANGE)
+        operation = FALLOC_FL_PUNCH_HOLE;
+#endif
+    if (operation != FALLOC_FL_PUNCH_HOLE)
+        return -EOPNOTSUPP;
+
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+
+    if (uint64_t(offset) >= sparsebundle->size)
+        return 0;
+
+    uint64_t end = min(uint64_t(offset) + uint64_t(length), sparsebundle->size);
+
+    sparsebundle_trace("asked to discard %ju bytes at offset %ju",
+        uintmax_t(end - offset), uintmax_t(offset));
+
+    return sparsebundle_discard(sparsebundle, offset, end);
+}
+#endif
+
+static int sparsebundle_hfs_readlink(sparsebundle_t *sparsebundle, const char *path, char *buffer, size_t size);
+
+static int sparsebundle_readlink(const char *path, char *buffer, size_t size)
+{
+    const char *volume_path;
+    if (sparsebundle_t *volume = sparsebundle_hfs_volume(sparsebundle_current_mount(), path, &volume_path))
+        return sparsebundle_hfs_readlink(volume, volume_path, buffer, size);
+    return -EINVAL;
+}
+
+static int sparsebundle_release(const char *path, struct fuse_file_info *fi)
+{
+    sparsebundle_t *sparsebundle = sparsebundle_handle(fi)->sparsebundle;
+    delete sparsebundle_handle(fi);
+
+    if (!sparsebundle)
+        return 0; // The stats file
+
+    // Our own references from an earlier zero-copy read would
+    // otherwise keep the files open until the next read.
+    sparsebundle_release_files();
+
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+    lock_guard<mutex> locker(mount->lock);
+
+    assert(sparsebundle->times_opened);
+    sparsebundle->times_opened--;
+    sparsebundle_debug("closed %s%s, now referenced %ju times",
+        mount->mountpoint, path, uintmax_t(sparsebundle->times_opened));
+
+    if (sparsebundle->times_opened == 0) {
+        sparsebundle_debug("band cache had %ju hits, %ju misses and %ju evictions",
+            uintmax_t(mount->band_cache_stats.hits),
+            uintmax_t(mount->band_cache_stats.misses),
+            uintmax_t(mount->band_cache_stats.evictions));
+
+        if (mount->block_cache.max_blocks) {
+            lock_guard<mutex> cache_locker(mount->block_cache.lock);
+            sparsebundle_debug("block cache had %ju hits and %ju misses",
+                uintmax_t(mount->block_cache.hits),
+                uintmax_t(mount->block_cache.misses));
+        }
+
+        sparsebundle_debug("no more references, cleaning up");
+        sparsebundle_close_files(mount, sparsebundle);
+    }
+
+    return 0;
+}
+
+/*
+    Kernel settings
+
+    Large reads make for fewer round-trips to the kernel, so the kernel
+    is allowed to read ahead as far as it will, and asked to splice the
+    zero-copy buffers into its pipe, moving rather than copying pages
+    where it can. With libfuse 3, which negotiates requests of up to
+    1 MB on its own, attributes and directory entries of a read-only
+    mount are cached for long, as they can't change.
+*/
+
+static const double sparsebundle_read_only_cache_timeout = 3600;
+
+#if FUSE_SUPPORTS_CONFIG
+static void *sparsebundle_init(struct fuse_conn_info *conn, struct fuse_config *config)
+#else
+static void *sparsebundle_init(struct fuse_conn_info *conn)
+#endif
+{
+    sparsebundle_mount_t *mount = sparsebundle_current_mount();
+
+    conn->max_readahead = numeric_limits<decltype(conn->max_readahead)>::max();
+
+#if defined(FUSE_CAP_SPLICE_WRITE) && defined(FUSE_CAP_SPLICE_MOVE)
+    if (!mount->options.noreadbuf)
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+
+#if FUSE_SUPPORTS_CONFIG
+    if (!mount->options.read_write) {
+        config->attr_timeout = sparsebundle_read_only_cache_timeout;
+        config->entry_timeout = sparsebundle_read_only_cache_timeout;
+        config->negative_timeout = sparsebundle_read_only_cache_timeout;
+    }
+#endif
+
+    sparsebundle_debug("kernel reads ahead up to %ju bytes", uintmax_t(conn->max_readahead));
+
+    return mount;
+}
+
+__attribute__((noreturn, format(printf, 1, 2))) static void sparsebundle_fatal_error(const char *message, ...)
+{
+    fprintf(stderr, "sparsebundlefs: ");
+
+    va_list args;
+    va_start(args, message);
+    vfprintf(stderr, message, args);
+    va_end(args);
+
+    if (errno)
+        fprintf(stderr, ": %s", strerror(errno));
+
+    fprintf(stderr, "\n");
+
+    exit(EXIT_FAILURE);
+}
+
+static int sparsebundle_show_usage(char *program_name)
+{
+    fprintf(stderr, "usage: %s [-o options] [-s] [-f] [-D] <sparsebundle>... <mountpoint>\n", program_name);
+    fprintf(stderr, "       %s -o nbd[,options] [-D] <sparsebundle>... <socket>\n", program_name);
+    fprintf(stderr, "       %s --scrub [-o options] [-D] <sparsebundle>...\n", program_name);
+    fprintf(stderr, "       %s --export [-o options] [-D] <sparsebundle> <image>\n", program_name);
+    return 1;
+}
+
+enum {
+    SPARSEBUNDLE_OPT_HANDLED = 0, SPARSEBUNDLE_OPT_IGNORED = 1,
+    SPARSEBUNDLE_OPT_DEBUG, SPARSEBUNDLE_OPT_ALLOW_OTHER, SPARSEBUNDLE_OPT_ALLOW_ROOT,
+    SPARSEBUNDLE_OPT_NOREADBUF, SPARSEBUNDLE_OPT_ALWAYS_CLOSE, SPARSEBUNDLE_OPT_MAX_OPEN_BANDS,
+    SPARSEBUNDLE_OPT_READ_AHEAD, SPARSEBUNDLE_OPT_CACHE_SIZE, SPARSEBUNDLE_OPT_IO_THREADS,
+    SPARSEBUNDLE_OPT_READ_WRITE, SPARSEBUNDLE_OPT_PASSPHRASE_FILE, SPARSEBUNDLE_OPT_KEY_FILE,
+    SPARSEBUNDLE_OPT_NBD, SPARSEBUNDLE_OPT_NBD_QUEUE_DEPTH, SPARSEBUNDLE_OPT_HFS,
+    SPARSEBUNDLE_OPT_SCRUB, SPARSEBUNDLE_OPT_SCRUB_THREADS, SPARSEBUNDLE_OPT_SCRUB_RATE,
+    SPARSEBUNDLE_OPT_VERIFY, SPARSEBUNDLE_OPT_EXPORT, SPARSEBUNDLE_OPT_FORMAT
+};
+
+struct fuse_opt sparsebundle_options[] = {
+    FUSE_OPT_KEY("-D",  SPARSEBUNDLE_OPT_DEBUG),
+    FUSE_OPT_KEY("allow_other", SPARSEBUNDLE_OPT_ALLOW_OTHER),
+    FUSE_OPT_KEY("allow_root", SPARSEBUNDLE_OPT_ALLOW_ROOT),
+    FUSE_OPT_KEY("noreadbuf", SPARSEBUNDLE_OPT_NOREADBUF),
+    FUSE_OPT_KEY("always_close", SPARSEBUNDLE_OPT_ALWAYS_CLOSE),
+    FUSE_OPT_KEY("max_open_bands=", SPARSEBUNDLE_OPT_MAX_OPEN_BANDS),
+    FUSE_OPT_KEY("readahead=", SPARSEBUNDLE_OPT_READ_AHEAD),
+    FUSE_OPT_KEY("cache_size=", SPARSEBUNDLE_OPT_CACHE_SIZE),
+    FUSE_OPT_KEY("io_threads=", SPARSEBUNDLE_OPT_IO_THREADS),
+    FUSE_OPT_KEY("rw", SPARSEBUNDLE_OPT_READ_WRITE),
+    FUSE_OPT_KEY("passphrase_file=", SPARSEBUNDLE_OPT_PASSPHRASE_FILE),
+    FUSE_OPT_KEY("key_file=", SPARSEBUNDLE_OPT_KEY_FILE),
+    FUSE_OPT_KEY("nbd", SPARSEBUNDLE_OPT_NBD),
+    FUSE_OPT_KEY("nbd_queue_depth=", SPARSEBUNDLE_OPT_NBD_QUEUE_DEPTH),
+    FUSE_OPT_KEY("hfs", SPARSEBUNDLE_OPT_HFS),
+    FUSE_OPT_KEY("--scrub", SPARSEBUNDLE_OPT_SCRUB),
+    FUSE_OPT_KEY("scrub_threads=", SPARSEBUNDLE_OPT_SCRUB_THREADS),
+    FUSE_OPT_KEY("scrub_rate=", SPARSEBUNDLE_OPT_SCRUB_RATE),
+    FUSE_OPT_KEY("verify", SPARSEBUNDLE_OPT_VERIFY),
+    FUSE_OPT_KEY("--export", SPARSEBUNDLE_OPT_EXPORT),
+    FUSE_OPT_KEY("format=", SPARSEBUNDLE_OPT_FORMAT),
+    FUSE_OPT_END
+};
+
+// Parses a number of bytes, optionally in K, M or G
+static bool sparsebundle_parse_size(const char *value, uint64_t *size)
+{
+    char *end = 0;
+    errno = 0;
+    uintmax_t number = strtoumax(value, &end, 10);
+    uintmax_t unit = 1;
+    switch (*end) {
+    case 'G': unit <<= 10; // Fall through
+    case 'M': unit <<= 10; // Fall through
+    case 'K': unit <<= 10; ++end;
+    }
+    if (!*value || *end || errno == ERANGE || number > numeric_limits<uint64_t>::max() / unit)
+        return false;
+    *size = number * unit;
+    return true;
+}
+
+static int sparsebundle_opt_proc(void *data, const char *arg, int key, struct fuse_args *)
+{
+    sparsebundle_mount_t *mount = static_cast<sparsebundle_mount_t *>(data);
+
+    switch (key) {
+    case SPARSEBUNDLE_OPT_DEBUG:
+        setlogmask(LOG_UPTO(LOG_DEBUG));
+        sparsebundle_debug_enabled = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_ALLOW_OTHER:
+        mount->options.allow_other = true;
+        return SPARSEBUNDLE_OPT_IGNORED;
+
+    case SPARSEBUNDLE_OPT_ALLOW_ROOT:
+        mount->options.allow_root = true;
+        return SPARSEBUNDLE_OPT_IGNORED;
+
+    case SPARSEBUNDLE_OPT_NOREADBUF:
+        mount->options.noreadbuf = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_ALWAYS_CLOSE:
+        mount->options.always_close = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_MAX_OPEN_BANDS: {
+        const char *value = strchr(arg, '=') + 1;
+        char *end = 0;
+        unsigned long max_open_bands = strtoul(value, &end, 10);
+        if (!*value || *end || !max_open_bands)
+            sparsebundle_fatal_error("invalid max_open_bands `%s'", value);
+        mount->options.max_open_bands = max_open_bands;
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case SPARSEBUNDLE_OPT_READ_AHEAD: {
+        const char *value = strchr(arg, '=') + 1;
+        char *end = 0;
+        unsigned long read_ahead = strtoul(value, &end, 10);
+        if (!*value || *end || read_ahead > numeric_limits<unsigned>::max())
+            sparsebundle_fatal_error("invalid readahead `%s'", value);
+        mount->options.read_ahead = read_ahead;
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case SPARSEBUNDLE_OPT_CACHE_SIZE: {
+        const char *value = strchr(arg, '=') + 1;
+        if (!sparsebundle_parse_size(value, &mount->options.cache_size))
+            sparsebundle_fatal_error("invalid cache_size `%s'", value);
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case SPARSEBUNDLE_OPT_IO_THREADS: {
+        const char *value = strchr(arg, '=') + 1;
+        char *end = 0;
+        unsigned long io_threads = strtoul(value, &end, 10);
+        if (!*value || *end || io_threads > 1024)
+            sparsebundle_fatal_error("invalid io_threads `%s'", value);
+        mount->options.io_threads = io_threads;
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case SPARSEBUNDLE_OPT_READ_WRITE:
+        mount->options.read_write = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_PASSPHRASE_FILE:
+        mount->options.passphrase_file = strdup(strchr(arg, '=') + 1);
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_KEY_FILE:
+        mount->options.key_file = strdup(strchr(arg, '=') + 1);
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_NBD:
+        mount->options.nbd = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_NBD_QUEUE_DEPTH: {
+        const char *value = strchr(arg, '=') + 1;
+        char *end = 0;
+        unsigned long queue_depth = strtoul(value, &end, 10);
+        if (!*value || *end || !queue_depth || queue_depth > 1024)
+            sparsebundle_fatal_error("invalid nbd_queue_depth `%s'", value);
+        mount->options.nbd_queue_depth = queue_depth;
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case SPARSEBUNDLE_OPT_HFS:
+        mount->options.hfs = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_SCRUB:
+        mount->options.scrub = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_SCRUB_THREADS: {
+        const char *value = strchr(arg, '=') + 1;
+        char *end = 0;
+        unsigned long scrub_threads = strtoul(value, &end, 10);
+        if (!*value || *end || !scrub_threads || scrub_threads > 1024)
+            sparsebundle_fatal_error("invalid scrub_threads `%s'", value);
+        mount->options.scrub_threads = scrub_threads;
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case SPARSEBUNDLE_OPT_SCRUB_RATE: {
+        const char *value = strchr(arg, '=') + 1;
+        if (!sparsebundle_parse_size(value, &mount->options.scrub_rate) || !mount->options.scrub_rate)
+            sparsebundle_fatal_error("invalid scrub_rate `%s'", value);
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case SPARSEBUNDLE_OPT_VERIFY:
+        mount->options.verify = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_EXPORT:
+        mount->options.export_image = true;
+        return SPARSEBUNDLE_OPT_HANDLED;
+
+    case SPARSEBUNDLE_OPT_FORMAT: {
+        const char *value = strchr(arg, '=') + 1;
+        if (strcmp(value, "raw") != 0 && strcmp(value, "qcow2") != 0)
+            sparsebundle_fatal_error("invalid format `%s'", value);
+        mount->options.format = strdup(value);
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    case FUSE_OPT_KEY_NONOPT:
+        // The last one is the mount point, which we only know at the end
+        mount->options.arguments.push_back(strdup(arg));
+        return SPARSEBUNDLE_OPT_HANDLED;
+    }
+
+    return SPARSEBUNDLE_OPT_IGNORED;
+}
+
+/*
+    Info.plist
+
+    The properties of a bundle are read from its Info.plist, which may
+    be an XML or a binary property list. Either is parsed in a single
+    pass over the file, without building a tree of it, looking only at
+    the keys of the top-level dictionary that we know about, so layout,
+    comments and other keys don't matter. The parsers don't exit on
+    errors, but describe what's wrong, and only depend on the data
+    given, so that they can be fed any data, e.g. by a fuzzer.
+*/
+
+static const char sparsebundle_bundle_type[] = "com.apple.diskimage.sparsebundle";
+static const uint64_t sparsebundle_max_bundle_version = 2;
+
+struct sparsebundle_info_t {
+    uint64_t band_size = 0;
+    uint64_t size = 0;
+    uint64_t version = 0;
+    string bundle_type;
+};
+
+enum sparsebundle_plist_key_t {
+    sparsebundle_key_unknown,
+    sparsebundle_key_band_size,
+    sparsebundle_key_size,
+    sparsebundle_key_version,
+    sparsebundle_key_bundle_type
+};
+
+static sparsebundle_plist_key_t sparsebundle_plist_key(const char *name, size_t length)
+{
+    static const struct {
+        const char *name;
+        sparsebundle_plist_key_t key;
+    } keys[] = {
+        { "band-size", sparsebundle_key_band_size },
+        { "size", sparsebundle_key_size },
+        { "bundle-backingstore-version", sparsebundle_key_version },
+        { "diskimage-bundle-type", sparsebundle_key_bundle_type }
+    };
+
+    for (const auto &known : keys) {
+        if (strlen(known.name) == length && memcmp(known.name, name, length) == 0)
+            return known.key;
+    }
+    return sparsebundle_key_unknown;
+}
+
+static const char *sparsebundle_plist_key_name(sparsebundle_plist_key_t key)
+{
+    switch (key) {
+    case sparsebundle_key_band_size: return "band-size";
+    case sparsebundle_key_size: return "size";
+    case sparsebundle_key_version: return "bundle-backingstore-version";
+    case sparsebundle_key_bundle_type: return "diskimage-bundle-type";
+    default: return "unknown";
+    }
+}
+
+static bool sparsebundle_plist_set_integer(sparsebundle_info_t *info, sparsebundle_plist_key_t key,
+    uint64_t value, string *error)
+{
+    switch (key) {
+    case sparsebundle_key_band_size: info->band_size = value; return true;
+    case sparsebundle_key_size: info->size = value; return true;
+    case sparsebundle_key_version: info->version = value; return true;
+    default:
+        *error = string(sparsebundle_plist_key_name(key)) + " is not a string";
+        return false;
+    }
+}
+
+static bool sparsebundle_plist_set_string(sparsebundle_info_t *info, sparsebundle_plist_key_t key,
+    const char *value, size_t length, string *error)
+{
+    if (key != sparsebundle_key_bundle_type) {
+        *error = string(sparsebundle_plist_key_name(key)) + " is not an integer";
+        return false;
+    }
+
+    info->bundle_type.assign(value, length);
+    return true;
+}
+
+static bool sparsebundle_xml_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+struct sparsebundle_xml_tag_t {
+    const char *name;
+    size_t name_length;
+    bool is_end;
+    bool is_empty;
+
+    bool is(const char *other, size_t other_length) const
+    {
+        return other_length == name_length && memcmp(other, name, name_length) == 0;
+    }
+
+    bool is(const char *other) const { return is(other, strlen(other)); }
+};
+
+// Moves past the next tag, skipping text, comments, declarations and
+// processing instructions on the way. Returns false at the end of the
+// data, with error set if the data ended in the middle of something.
+static bool sparsebundle_xml_next_tag(const char *&position, const char *end,
+    sparsebundle_xml_tag_t *tag, string *error)
+{
+    while (true) {
+        const char *start = static_cast<const char *>(memchr(position, '<', end - position));
+        if (!start) {
+            position = end;
+            return false;
+        }
+
+        const char *terminator = ">";
+        if (end - start >= 4 && memcmp(start, "<!--", 4) == 0)
+            terminator = "-->";
+        else if (end - start >= 2 && start[1] == '?')
+            terminator = "?>";
+
+        const char *tag_end = search(start + 1, end, terminator, terminator + strlen(terminator));
+        if (tag_end == end) {
+            *error = "unterminated tag";
+            return false;
+        }
+        position = tag_end + strlen(terminator);
+
+        if (start[1] == '!' || start[1] == '?')
+            continue;
+
+        const char *name = start + 1;
+        tag->is_end = *name == '/';
+        if (tag->is_end)
+            name++;
+        tag->is_empty = !tag->is_end && tag_end[-1] == '/' && tag_end - 1 > name;
+
+        const char *name_end = name;
+        while (name_end < tag_end && !sparsebundle_xml_is_space(*name_end) && *name_end != '/')
+            name_end++;
+        if (name_end == name) {
+            *error = "tag without a name";
+            return false;
+        }
+
+        tag->name = name;
+        tag->name_length = name_end - name;
+        return true;
+    }
+}
+
+// Reads the text of a scalar element up to its end tag, trimmed
+static bool sparsebundle_xml_element_text(const char *&position, const char *end,
+    const sparsebundle_xml_tag_t &tag, const char **text, size_t *length, string *error)
+{
+    if (tag.is_empty) {
+        *text = position;
+        *length = 0;
+        return true;
+    }
+
+    const char *text_start = position;
+    const char *text_end = static_cast<const char *>(memchr(position, '<', end - position));
+    if (!text_end)
+        text_end = end;
+
+    sparsebundle_xml_tag_t end_tag;
+    position = text_end;
+    if (!sparsebundle_xml_next_tag(position, end, &end_tag, error) || !end_tag.is_end
+        || !end_tag.is(tag.name, tag.name_length)) {
+        if (error->empty())
+            *error = "unterminated <" + string(tag.name, tag.name_length) + ">";
+        return false;
+    }
+
+    while (text_start < text_end && sparsebundle_xml_is_space(*text_start))
+        text_start++;
+    while (text_end > text_start && sparsebundle_xml_is_space(text_end[-1]))
+        text_end--;
+
+    *text = text_start;
+    *length = text_end - text_start;
+    return true;
+}
+
+static bool sparsebundle_parse_xml_integer(const char *text, size_t length, uint64_t *value)
+{
+    if (!length)
+        return false;
+
+    uint64_t result = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (text[i] < '0' || text[i] > '9')
+            return false;
+        unsigned digit = text[i] - '0';
+        if (result > (numeric_limits<uint64_t>::max() - digit) / 10)
+            return false;
+        result = result * 10 + digit;
+    }
+
+    *value = result;
+    return true;
+}
+
+static bool sparsebundle_parse_xml_plist(const char *data, size_t length,
+    sparsebundle_info_t *info, string *error)
+{
+    const char *position = data;
+    const char *end = data + length;
+
+    // Nesting of plist, dict and array elements, where the keys
+    // we're after are those of the dictionary at depth 2.
+    static const unsigned max_depth = 64;
+    sparsebundle_xml_tag_t containers[max_depth];
+    unsigned depth = 0;
+    bool seen_dictionary = false;
+
+    sparsebundle_plist_key_t key = sparsebundle_key_unknown;
+    bool has_key = false;
+
+    sparsebundle_xml_tag_t tag;
+    while (sparsebundle_xml_next_tag(position, end, &tag, error)) {
+        if (tag.is_end) {
+            if (!depth || !containers[depth - 1].is(tag.name, tag.name_length)) {
+                *error = "unexpected </" + string(tag.name, tag.name_length) + ">";
+                return false;
+            }
+            depth--;
+            continue;
+        }
+
+        if (depth == 0 && !tag.is("plist")) {
+            *error = "not a property list";
+            return false;
+        }
+
+        if (depth == 1 && (seen_dictionary || !tag.is("dict"))) {
+            *error = "top-level object is not a dictionary";
+            return false;
+        }
+
+        bool is_container = tag.is("plist") || tag.is("dict") || tag.is("array");
+        bool is_top_level = depth == 2 && containers[0].is("plist") && containers[1].is("dict");
+
+        if (is_top_level && tag.is("key")) {
+            const char *name;
+            size_t name_length;
+            if (!sparsebundle_xml_element_text(position, end, tag, &name, &name_length, error))
+                return false;
+            if (has_key) {
+                *error = "key without a value";
+                return false;
+            }
+            key = sparsebundle_plist_key(name, name_length);
+            has_key = true;
+            continue;
+        }
+
+        if (is_top_level) {
+            if (!has_key) {
+                *error = "value without a key";
+                return false;
+            }
+            has_key = false;
+
+            if (key != sparsebundle_key_unknown) {
+                const char *text;
+                size_t text_length;
+                if (tag.is("integer")) {
+                    uint64_t value;
+                    if (!sparsebundle_xml_element_text(position, end, tag, &text, &text_length, error))
+                        return false;
+                    if (!sparsebundle_parse_xml_integer(text, text_length, &value)) {
+                        *error = string("invalid ") + sparsebundle_plist_key_name(key)
+                            + " `" + string(text, text_length) + "'";
+                        return false;
+                    }
+                    if (!sparsebundle_plist_set_integer(info, key, value, error))
+                        return false;
+                } else if (tag.is("string")) {
+                    if (!sparsebundle_xml_element_text(position, end, tag, &text, &text_length, error))
+                        return false;
+                    if (!sparsebundle_plist_set_string(info, key, text, text_length, error))
+                        return false;
+                } else {
+                    *error = string("unexpected type of ") + sparsebundle_plist_key_name(key);
+                    return false;
+                }
+                continue;
+            }
+        }
+
+        if (is_container) {
+            if (depth == 1)
+                seen_dictionary = true;
+            if (tag.is_empty)
+                continue;
+            if (depth == max_depth) {
+                *error = "nested too deeply";
+                return false;
+            }
+            containers[depth++] = tag;
+        } else if (!tag.is_empty) {
+            // Values we're not interested in
+            const char *text;
+            size_t text_length;
+            if (!sparsebundle_xml_element_text(position, end, tag, &text, &text_length, error))
+                return false;
+        }
+    }
+
+    if (!error->empty())
+        return false;
+
+    if (depth || !seen_dictionary) {
+        *error = "truncated property list";
+        return false;
+    }
+
+    if (has_key) {
+        *error = "key without a value";
+        return false;
+    }
+
+    return true;
+}
+
+/*
+    Binary property lists end in a trailer, giving the size of object
+    references and of the entries of the offset table, which in turn
+    gives the position of each object. Objects start with a marker byte,
+    with the type in the high nibble and the size, or 0xf followed by
+    an integer object for larger sizes, in the low nibble.
+*/
+
+static const char sparsebundle_bplist_magic[] = "bplist00";
+static const size_t sparsebundle_bplist_trailer_size = 32;
+
+struct sparsebundle_bplist_t {
+    const uint8_t *data;
+    size_t objects_end;
+    unsigned offset_size;
+    unsigned reference_size;
+    uint64_t object_count;
+    uint64_t offset_table;
+};
+
+static uint64_t sparsebundle_read_big_endian(const uint8_t *data, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+static void sparsebundle_append_big_endian(string &data, uint64_t value, size_t size)
+{
+    for (size_t i = size; i-- > 0;)
+        data.push_back(char(value >> (i * 8)));
+}
+
+// Finds the start of the object with the given reference
+static bool sparsebundle_bplist_object(const sparsebundle_bplist_t &plist, uint64_t reference,
+    size_t *offset)
+{
+    if (reference >= plist.object_count)
+        return false;
+
+    uint64_t object_offset = sparsebundle_read_big_endian(
+        plist.data + plist.offset_table + reference * plist.offset_size, plist.offset_size);
+    if (object_offset < sizeof(sparsebundle_bplist_magic) - 1 || object_offset >= plist.objects_end)
+        return false;
+
+    *offset = size_t(object_offset);
+    return true;
+}
+
+// Reads the marker of an object, and moves past it and its size
+static bool sparsebundle_bplist_marker(const sparsebundle_bplist_t &plist, size_t *offset,
+    unsigned *type, uint64_t *size)
+{
+    uint8_t marker = plist.data[(*offset)++];
+    *type = marker >> 4;
+    *size = marker & 0xf;
+
+    // Integers and reals give their size as a power of two
+    if (*type == 0x1 || *type == 0x2 || *size != 0xf)
+        return true;
+
+    if (*offset >= plist.objects_end || (plist.data[*offset] >> 4) != 0x1)
+        return false;
+
+    unsigned size_size = 1 << (plist.data[(*offset)++] & 0xf);
+    if (size_size > 8 || plist.objects_end - *offset < size_size)
+        return false;
+
+    *size = sparsebundle_read_big_endian(plist.data + *offset, size_size);
+    *offset += size_size;
+    return true;
+}
+
+static bool sparsebundle_parse_binary_plist(const char *data, size_t length,
+    sparsebundle_info_t *info, string *error)
+{
+    size_t magic_size = sizeof(sparsebundle_bplist_magic) - 1;
+    if (length < magic_size + sparsebundle_bplist_trailer_size) {
+        *error = "truncated property list";
+        return false;
+    }
+
+    sparsebundle_bplist_t plist;
+    plist.data = reinterpret_cast<const uint8_t *>(data);
+    plist.objects_end = length - sparsebundle_bplist_trailer_size;
+
+    const uint8_t *trailer = plist.data + plist.objects_end;
+    plist.offset_size = trailer[6];
+    plist.reference_size = trailer[7];
+    plist.object_count = sparsebundle_read_big_endian(trailer + 8, 8);
+    uint64_t top_object = sparsebundle_read_big_endian(trailer + 16, 8);
+    plist.offset_table = sparsebundle_read_big_endian(trailer + 24, 8);
+
+    if (plist.offset_size < 1 || plist.offset_size > 8
+        || plist.reference_size < 1 || plist.reference_size > 8
+        || plist.offset_table < magic_size || plist.offset_table > plist.objects_end
+        || plist.object_count > (plist.objects_end - plist.offset_table) / plist.offset_size) {
+        *error = "invalid binary property list trailer";
+        return false;
+    }
+
+    // Objects come before the offset table
+    plist.objects_end = size_t(plist.offset_table);
+
+    size_t offset;
+    unsigned type;
+    uint64_t count;
+    if (!sparsebundle_bplist_object(plist, top_object, &offset)
+        || !sparsebundle_bplist_marker(plist, &offset, &type, &count)) {
+        *error = "invalid top-level object";
+        return false;
+    }
+
+    if (type != 0xd) {
+        *error = "top-level object is not a dictionary";
+        return false;
+    }
+
+    if (count > (plist.objects_end - offset) / plist.reference_size / 2) {
+        *error = "truncated dictionary";
+        return false;
+    }
+
+    const uint8_t *keys = plist.data + offset;
+    const uint8_t *values = keys + count * plist.reference_size;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        size_t key_offset;
+        unsigned key_type;
+        uint64_t key_length;
+        uint64_t key_reference = sparsebundle_read_big_endian(keys + i * plist.reference_size, plist.reference_size);
+        if (!sparsebundle_bplist_object(plist, key_reference, &key_offset)
+            || !sparsebundle_bplist_marker(plist, &key_offset, &key_type, &key_length)) {
+            *error = "invalid dictionary key";
+            return false;
+        }
+
+        // Keys we know about are ASCII, so other keys are skipped
+        if (key_type != 0x5)
+            continue;
+        if (key_length > plist.objects_end - key_offset) {
+            *error = "truncated dictionary key";
+            return false;
+        }
+
+        sparsebundle_plist_key_t key = sparsebundle_plist_key(data + key_offset, size_t(key_length));
+        if (key == sparsebundle_key_unknown)
+            continue;
+
+        size_t value_offset;
+        unsigned value_type;
+        uint64_t value_size;
+        uint64_t value_reference = sparsebundle_read_big_endian(values + i * plist.reference_size, plist.reference_size);
+        if (!sparsebundle_bplist_object(plist, value_reference, &value_offset)
+            || !sparsebundle_bplist_marker(plist, &value_offset, &value_type, &value_size)) {
+            *error = string("invalid value of ") + sparsebundle_plist_key_name(key);
+            return false;
+        }
+
+        if (value_type == 0x1) {
+            // 1, 2 and 4 byte integers are unsigned, 8 byte ones signed
+            size_t integer_size = size_t(1) << value_size;
+            if (integer_size > 8 || plist.objects_end - value_offset < integer_size) {
+                *error = string("invalid ") + sparsebundle_plist_key_name(key);
+                return false;
+            }
+            uint64_t value = sparsebundle_read_big_endian(plist.data + value_offset, integer_size);
+            if (integer_size == 8 && value >> 63) {
+                *error = string("negative ") + sparsebundle_plist_key_name(key);
+                return false;
+            }
+            if (!sparsebundle_plist_set_integer(info, key, value, error))
+                return false;
+        } else if (value_type == 0x5) {
+            if (value_size > plist.objects_end - value_offset) {
+                *error = string("truncated ") + sparsebundle_plist_key_name(key);
+                return false;
+            }
+            if (!sparsebundle_plist_set_string(info, key, data + value_offset, size_t(value_size), error))
+                return false;
+        } else {
+            *error = string("unexpected type of ") + sparsebundle_plist_key_name(key);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Parses an Info.plist, and checks that it describes a sparse-bundle
+// we can read. Returns false with error set otherwise.
+static bool sparsebundle_parse_plist(const char *data, size_t length,
+    sparsebundle_info_t *info, string *error)
+{
+    size_t magic_size = sizeof(sparsebundle_bplist_magic) - 1;
+    bool is_binary = length >= magic_size && memcmp(data, sparsebundle_bplist_magic, magic_size) == 0;
+    if (!(is_binary ? sparsebundle_parse_binary_plist : sparsebundle_parse_xml_plist)(data, length, info, error))
+        return false;
+
+    if (!info->bundle_type.empty() && info->bundle_type != sparsebundle_bundle_type) {
+        *error = "unsupported bundle type `" + info->bundle_type + "'";
+        return false;
+    }
+
+    if (info->version > sparsebundle_max_bundle_version) {
+        *error = "unsupported bundle version " + to_string(info->version);
+        return false;
+    }
+
+    if (!info->band_size || !info->size) {
+        *error = info->band_size ? "missing or zero size" : "missing or zero band-size";
+        return false;
+    }
+
+    return true;
+}
+
+// Reads a small file in one go. Returns false if it can't be opened.
+static bool sparsebundle_read_file(const char *path, string *data)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1)
+        sparsebundle_fatal_error("failed to stat %s", path);
+
+    // Any real Info.plist or token is a fraction of this
+    static const off_t max_file_size = 1 << 20;
+    if (file_stat.st_size > max_file_size) {
+        errno = 0;
+        sparsebundle_fatal_error("%s is too large (%ju bytes)", path, uintmax_t(file_stat.st_size));
+    }
+
+    data->assign(size_t(file_stat.st_size), '\0');
+    size_t bytes_read = 0;
+    while (bytes_read < data->size()) {
+        ssize_t read_size = read(fd, &(*data)[bytes_read], data->size() - bytes_read);
+        if (read_size == -1 && errno == EINTR)
+            continue;
+        if (read_size == -1)
+            sparsebundle_fatal_error("failed to read %s", path);
+        if (read_size == 0)
+            break;
+        bytes_read += read_size;
+    }
+    data->resize(bytes_read);
+
+    close(fd);
+    return true;
+}
+
+static void sparsebundle_read_plist(sparsebundle_t *sparsebundle)
+{
+    char *plist_path;
+    if (asprintf(&plist_path, "%s/Info.plist", sparsebundle->path) == -1)
+        sparsebundle_fatal_error("could not resolve Info.plist path");
+
+    string plist_data;
+    if (!sparsebundle_read_file(plist_path, &plist_data))
+        sparsebundle_fatal_error("failed to open %s", plist_path);
+
+    sparsebundle_info_t info;
+    string error;
+    if (!sparsebundle_parse_plist(plist_data.data(), plist_data.size(), &info, &error)) {
+        errno = 0;
+        sparsebundle_fatal_error("%s: %s", plist_path, error.c_str());
+    }
+    free(plist_path);
+
+    sparsebundle->band_size = info.band_size;
+    sparsebundle->size = info.size;
+
+    sparsebundle_debug("bundle has version %ju, band size %ju and total size %ju",
+        uintmax_t(info.version), uintmax_t(sparsebundle->band_size), uintmax_t(sparsebundle->size));
+}
+
+/*
+    Encrypted bundles have an encrcdsa header in their token file, which
+    is otherwise empty. The header is big-endian, and lists the blobs the
+    key of the image is wrapped in, of which we can unwrap the one that's
+    wrapped with a passphrase: with 3DES, keyed by PBKDF2 of the passphrase.
+    Unwrapped, it's the AES key followed by the HMAC-SHA1 key for the IVs.
+    Like the Info.plist, the header is parsed without side effects.
+*/
+
+static const char sparsebundle_encrcdsa_magic[] = "encrcdsa";
+
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+struct sparsebundle_encrcdsa_t {
+    unsigned key_bits;
+    uint64_t chunk_size;
+    uint64_t data_size;
+    uint32_t iterations;
+    string salt;
+    string blob_iv;
+    string blob;
+};
+
+static bool sparsebundle_parse_encrcdsa(const char *data, size_t length,
+    sparsebundle_encrcdsa_t *header, string *error)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    auto read_be = [bytes](size_t offset, size_t size) {
+        return sparsebundle_read_big_endian(bytes + offset, size);
+    };
+
+    static const size_t header_size = 76;
+    static const size_t key_pointer_size = 20;
+    if (length < header_size) {
+        *error = "truncated encryption header";
+        return false;
+    }
+
+    if (read_be(8, 4) != 2) {
+        *error = "unsupported encryption header version " + to_string(read_be(8, 4));
+        return false;
+    }
+
+    header->key_bits = unsigned(read_be(24, 4));
+    header->chunk_size = read_be(52, 4);
+    header->data_size = read_be(56, 8);
+    if (header->key_bits != 128 && header->key_bits != 256) {
+        *error = "unsupported key size of " + to_string(header->key_bits) + " bits";
+        return false;
+    }
+    if (!header->chunk_size || header->chunk_size % 16 || header->chunk_size > (1 << 20)) {
+        *error = "invalid chunk size " + to_string(header->chunk_size);
+        return false;
+    }
+
+    uint64_t key_count = read_be(72, 4);
+    if (key_count > (length - header_size) / key_pointer_size) {
+        *error = "truncated key list";
+        return false;
+    }
+
+    for (uint64_t i = 0; i < key_count; ++i) {
+        size_t pointer = header_size + size_t(i) * key_pointer_size;
+        if (read_be(pointer, 4) != 1)
+            continue; // Not wrapped with a passphrase
+
+        // Passphrase-wrapped key: KDF parameters, then the blob
+        static const size_t fixed_size = 104;
+        uint64_t offset = read_be(pointer + 4, 8);
+        if (offset > length || length - offset < fixed_size) {
+            *error = "truncated passphrase-wrapped key";
+            return false;
+        }
+
+        size_t key = size_t(offset);
+        header->iterations = uint32_t(read_be(key + 8, 4));
+        uint64_t salt_size = read_be(key + 12, 4);
+        uint64_t iv_size = read_be(key + 48, 4);
+        uint64_t blob_size = read_be(key + 100, 4);
+        if (!header->iterations || salt_size > 32 || iv_size < 8 || iv_size > 32
+            || !blob_size || blob_size % 8 || blob_size > length - key - fixed_size) {
+            *error = "invalid passphrase-wrapped key";
+            return false;
+        }
+
+        header->salt.assign(data + key + 16, size_t(salt_size));
+        header->blob_iv.assign(data + key + 52, 8);
+        header->blob.assign(data + key + fixed_size, size_t(blob_size));
+        return true;
+    }
+
+    *error = "no passphrase-wrapped key, which is the only kind supported";
+    return false;
+}
+
+static bool sparsebundle_set_key(const sparsebundle_encrcdsa_t &header, const string &key_data,
+    sparsebundle_crypto_t *crypto, string *error)
+{
+    size_t key_size = header.key_bits / 8;
+    if (key_data.size() < key_size + sparsebundle_hmac_key_size) {
+        *error = "key too short";
+        return false;
+    }
+
+    crypto->cipher = header.key_bits == 128 ? EVP_aes_128_cbc() : EVP_aes_256_cbc();
+    memcpy(crypto->key, key_data.data(), key_size);
+    memcpy(crypto->hmac_key, key_data.data() + key_size, sparsebundle_hmac_key_size);
+    crypto->chunk_size = size_t(header.chunk_size);
+    return true;
+}
+
+static bool sparsebundle_unwrap_key(const sparsebundle_encrcdsa_t &header, const string &passphrase,
+    sparsebundle_crypto_t *crypto, string *error)
+{
+    unsigned char wrapping_key[24];
+    if (PKCS5_PBKDF2_HMAC_SHA1(passphrase.data(), int(passphrase.size()),
+            reinterpret_cast<const unsigned char *>(header.salt.data()), int(header.salt.size()),
+            int(header.iterations), sizeof(wrapping_key), wrapping_key) != 1) {
+        *error = "failed to derive key from passphrase";
+        return false;
+    }
+
+    string key_data(header.blob.size(), '\0');
+    unsigned char *key_bytes = reinterpret_cast<unsigned char *>(&key_data[0]);
+    int update_length = 0;
+    int final_length = 0;
+
+    EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+    bool unwrapped = context
+        && EVP_DecryptInit_ex(context, EVP_des_ede3_cbc(), 0, wrapping_key,
+            reinterpret_cast<const unsigned char *>(header.blob_iv.data())) == 1
+        && EVP_DecryptUpdate(context, key_bytes, &update_length,
+            reinterpret_cast<const unsigned char *>(header.blob.data()), int(header.blob.size())) == 1
+        && EVP_DecryptFinal_ex(context, key_bytes + update_length, &final_length) == 1;
+    EVP_CIPHER_CTX_free(context);
+    OPENSSL_cleanse(wrapping_key, sizeof(wrapping_key));
+
+    // Bad padding is how a wrong passphrase shows
+    key_data.resize(unwrapped ? size_t(update_length + final_length) : 0);
+    bool ret = unwrapped && sparsebundle_set_key(header, key_data, crypto, error);
+    if (!ret)
+        *error = "wrong passphrase";
+
+    OPENSSL_cleanse(&key_data[0], key_data.size());
+    return ret;
+}
+#endif
+
+static void sparsebundle_read_token(sparsebundle_t *sparsebundle)
+{
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+
+    char *token_path;
+    if (asprintf(&token_path, "%s/token", sparsebundle->path) == -1)
+        sparsebundle_fatal_error("could not resolve token path");
+
+    string token;
+    size_t magic_size = sizeof(sparsebundle_encrcdsa_magic) - 1;
+    if (!sparsebundle_read_file(token_path, &token)
+        || token.compare(0, magic_size, sparsebundle_encrcdsa_magic) != 0) {
+        free(token_path);
+        return;
+    }
+
+    errno = 0;
+
+#if defined(SPARSEBUNDLEFS_ENCRYPTION)
+    if (mount->options.read_write)
+        sparsebundle_fatal_error("%s is encrypted, and can only be mounted read-only", sparsebundle->path);
+
+    sparsebundle_encrcdsa_t header;
+    string error;
+    if (!sparsebundle_parse_encrcdsa(token.data(), token.size(), &header, &error))
+        sparsebundle_fatal_error("%s: %s", token_path, error.c_str());
+
+    unique_ptr<sparsebundle_crypto_t> crypto(new sparsebundle_crypto_t());
+    string key_data;
+    if (mount->options.key_file) {
+        if (!sparsebundle_read_file(mount->options.key_file, &key_data))
+            sparsebundle_fatal_error("failed to open %s", mount->options.key_file);
+        if (!sparsebundle_set_key(header, key_data, crypto.get(), &error))
+            sparsebundle_fatal_error("%s: %s", mount->options.key_file, error.c_str());
+    } else if (mount->options.passphrase_file) {
+        if (!sparsebundle_read_file(mount->options.passphrase_file, &key_data))
+            sparsebundle_fatal_error("failed to open %s", mount->options.passphrase_file);
+        while (!key_data.empty() && (key_data.back() == '\n' || key_data.back() == '\r'))
+            key_data.pop_back();
+        if (!sparsebundle_unwrap_key(header, key_data, crypto.get(), &error))
+            sparsebundle_fatal_error("%s: %s", sparsebundle->path, error.c_str());
+    } else {
+        sparsebundle_fatal_error("%s is encrypted, pass -o passphrase_file or -o key_file",
+            sparsebundle->path);
+    }
+    if (!key_data.empty())
+        OPENSSL_cleanse(&key_data[0], key_data.size());
+
+    // The chunks of the image make up the band files
+    uint64_t size = min(sparsebundle->size, header.data_size);
+    if (size % header.chunk_size || sparsebundle->band_size % header.chunk_size)
+        sparsebundle_fatal_error("%s: image and band sizes aren't whole chunks of %ju bytes",
+            token_path, uintmax_t(header.chunk_size));
+    sparsebundle->size = size;
+
+    sparsebundle->crypto = crypto.release();
+    sparsebundle_debug("bundle is encrypted with %u-bit AES in chunks of %zu bytes",
+        header.key_bits, sparsebundle->crypto->chunk_size);
+#else
+    (void)mount;
+    sparsebundle_fatal_error("%s is encrypted, which this build doesn't support", sparsebundle->path);
+#endif
+
+    free(token_path);
+}
+
+static void sparsebundle_scan_bands(sparsebundle_t *sparsebundle, const char *bands_path)
+{
+    DIR *bands_dir = opendir(bands_path);
+    if (!bands_dir)
+        sparsebundle_fatal_error("failed to open %s", bands_path);
+
+    sparsebundle_band_t *bands = &sparsebundle->mount->bands[sparsebundle->first_band];
+    sparsebundle->present_bands = vector<atomic<bool>>(sparsebundle->band_count);
+
+    size_t present_bands = 0;
+    while (struct dirent *entry = readdir(bands_dir)) {
+        if (!isxdigit(entry->d_name[0]))
+            continue;
+
+        char *end = 0;
+        errno = 0;
+        uintmax_t band_number = strtoumax(entry->d_name, &end, 16);
+        if (*end || errno == ERANGE)
+            continue;
+
+        if (band_number >= sparsebundle->band_count) {
+            errno = 0;
+            sparsebundle_fatal_error("band %s of %s is beyond the end of the image, "
+                "which has %ju bands", entry->d_name, sparsebundle->path,
+                uintmax_t(sparsebundle->band_count));
+        }
+
+        sparsebundle->present_bands[band_number] = true;
+        present_bands++;
+
+        struct stat band_stat;
+        if (fstatat(dirfd(bands_dir), entry->d_name, &band_stat, 0) == -1) {
+            sparsebundle_debug("failed to stat band %s: %s", entry->d_name, strerror(errno));
+            continue;
+        }
+
+        if (uint64_t(band_stat.st_size) > sparsebundle->band_size) {
+            errno = 0;
+            sparsebundle_fatal_error("band %s of %s is larger than the band size (%ju > %ju bytes)",
+                entry->d_name, sparsebundle->path, uintmax_t(band_stat.st_size),
+                uintmax_t(sparsebundle->band_size));
+        }
+
+        bands[band_number].length = band_stat.st_size;
+        bands[band_number].blocks = band_stat.st_blocks;
+        sparsebundle->allocated_blocks += band_stat.st_blocks;
+    }
+
+    closedir(bands_dir);
+
+    sparsebundle_debug("bundle has %zu of %ju bands present, using %ju blocks",
+        present_bands, uintmax_t(sparsebundle->band_count),
+        uintmax_t(sparsebundle->allocated_blocks));
+}
+
+// Reads the Info.plist and scans the bands of the bundle, appending
+// its bands to the band table of the mount.
+static void sparsebundle_load(sparsebundle_t *sparsebundle)
+{
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+
+    sparsebundle_debug("loading `%s'", sparsebundle->path);
+
+    if (stat(sparsebundle->path, &sparsebundle->bundle_stat) == -1)
+        sparsebundle_fatal_error("failed to stat %s", sparsebundle->path);
+
+    char *last_dot = strrchr(sparsebundle->path, '.');
+    if (!last_dot || strcmp(last_dot, ".sparsebundle") != 0)
+        sparsebundle_fatal_error("%s is not a sparse bundle (wrong extension)",
+            sparsebundle->path);
+
+    sparsebundle_read_plist(sparsebundle);
+
+    // Scrubbing checks the band files as they are, needing no key
+    if (!mount->options.scrub)
+        sparsebundle_read_token(sparsebundle);
+
+    // The bands of all bundles share one table
+    uint64_t band_count = sparsebundle->size / sparsebundle->band_size
+        + (sparsebundle->size % sparsebundle->band_size ? 1 : 0);
+    uint64_t total_band_count = mount->bands.size() + band_count;
+    if (total_band_count >= sparsebundle_no_band || total_band_count > mount->bands.max_size())
+        sparsebundle_fatal_error("too many bands (%ju)", uintmax_t(total_band_count));
+
+    sparsebundle->first_band = uint32_t(mount->bands.size());
+    sparsebundle->band_count = uint32_t(band_count);
+
+    sparsebundle_band_t closed_band = { -1, 0, -1, 0, sparsebundle_no_band, sparsebundle_no_band, false, false };
+    mount->bands.resize(size_t(total_band_count), closed_band);
+
+    char *bands_path;
+    if (asprintf(&bands_path, "%s/bands", sparsebundle->path) == -1)
+        sparsebundle_fatal_error("could not resolve bands path");
+
+    if ((sparsebundle->bands_fd = open(bands_path, O_RDONLY | O_DIRECTORY)) == -1)
+        sparsebundle_fatal_error("failed to open %s", bands_path);
+
+    if (mount->options.read_write && access(bands_path, W_OK) == -1)
+        sparsebundle_fatal_error("%s is not writable", bands_path);
+
+    sparsebundle_scan_bands(sparsebundle, bands_path);
+    free(bands_path);
+}
+
+// A lone bundle is served as sparsebundle.dmg, and otherwise
+// each image is named after its bundle, e.g. foo.sparsebundle
+// is served as foo.dmg.
+static string sparsebundle_image_path(sparsebundle_mount_t *mount, sparsebundle_t *sparsebundle)
+{
+    if (mount->options.arguments.size() == 2)
+        return single_image_path;
+
+    // Names that are all extension, or have none, are kept whole
+    string name = strrchr(sparsebundle->path, '/') + 1;
+    size_t last_dot = name.rfind('.');
+    if (last_dot != string::npos && last_dot > 0)
+        name.erase(last_dot);
+    return "/" + name + ".dmg";
+}
+
+/*
+    HFS+ volumes
+
+    With -o hfs the HFS+ volume inside each image is served as well, as
+    a directory next to the image, named after it without the extension,
+    so that files can be read out of e.g. Time Machine backups without
+    stacking another FUSE file system, and another copy of the data in
+    the page cache, on top of the image. The volume is found at the
+    start of the image, or through its GUID partition table.
+
+    Paths are looked up in the catalog B-tree of the volume, with the
+    entries found kept in a cache, and file contents are read through
+    the extents of the file, which map straight to ranges of the image,
+    and thereby of the bands, so that reads of files are zero-copy like
+    reads of the image. File and directory hard links, the latter being
+    what Time Machine backups are made of, are followed to what they
+    link to. The journal isn't replayed, so a volume that wasn't cleanly
+    unmounted is served as of its last checkpoint. Files compressed by
+    the file system, whose data lives in an attribute or the resource
+    fork rather than the data fork, can't be opened, instead of being
+    served as the empty data fork.
+*/
+
+static const uint16_t sparsebundle_hfs_plus_signature = 0x482b; // H+
+static const uint16_t sparsebundle_hfsx_signature = 0x4858; // HX
+static const off_t sparsebundle_hfs_header_offset = 1024;
+static const size_t sparsebundle_hfs_header_size = 512;
+static const size_t sparsebundle_hfs_sector_size = 512;
+
+// Seconds from the HFS+ epoch, 1904, to the Unix epoch
+static const int64_t sparsebundle_hfs_epoch_offset = 2082844800;
+
+static const uint32_t sparsebundle_hfs_root_cnid = 2;
+static const uint32_t sparsebundle_hfs_extents_cnid = 3;
+static const uint32_t sparsebundle_hfs_catalog_cnid = 4;
+
+static const uint8_t sparsebundle_hfs_compressed_flag = 0x20; // UF_COMPRESSED
+
+static const size_t sparsebundle_hfs_max_entries = 64 * 1024;
+static const unsigned sparsebundle_hfs_max_depth = 16;
+
+enum {
+    sparsebundle_hfs_leaf_node = -1,
+    sparsebundle_hfs_index_node = 0,
+    sparsebundle_hfs_header_node = 1
+};
+
+enum {
+    sparsebundle_hfs_folder_record = 1,
+    sparsebundle_hfs_file_record = 2
+};
+
+struct sparsebundle_hfs_extent_t {
+    uint32_t start_block;
+    uint32_t block_count;
+};
+
+struct sparsebundle_hfs_fork_t {
+    uint64_t size;
+    uint32_t total_blocks;
+    vector<sparsebundle_hfs_extent_t> extents;
+};
+
+struct sparsebundle_hfs_btree_t {
+    sparsebundle_hfs_fork_t fork;
+    uint32_t node_size;
+    uint32_t root_node;
+    uint16_t max_key_length;
+    bool variable_index_keys;
+    uint8_t key_compare_type;
+};
+
+struct sparsebundle_hfs_entry_t {
+    uint32_t cnid;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    nlink_t link_count;
+    dev_t device;
+    time_t access_time;
+    time_t modification_time;
+    time_t change_time;
+    uint64_t blocks;
+    bool compressed;
+    shared_ptr<const sparsebundle_hfs_fork_t> data;
+};
+
+struct sparsebundle_hfs_t {
+    string path;
+    uint64_t offset;
+    uint32_t block_size;
+    bool case_sensitive;
+    sparsebundle_hfs_btree_t extents;
+    sparsebundle_hfs_btree_t catalog;
+    uint32_t file_links_cnid;
+    uint32_t directory_links_cnid;
+    mutex lock;
+    unordered_map<string, sparsebundle_hfs_entry_t> entries;
+};
+
+// Maps a range of a fork to ranges of the image, returning the
+// length of the range within the fork, or -EIO if the extents
+// don't cover it.
+static int sparsebundle_hfs_map_fork(sparsebundle_t *sparsebundle, const sparsebundle_hfs_fork_t &fork,
+    size_t length, off_t offset, vector<pair<uint64_t, size_t>> &ranges)
+{
+    assert(length <= numeric_limits<int>::max());
+    const sparsebundle_hfs_t *hfs = sparsebundle->hfs;
+
+    ranges.clear();
+    if (uint64_t(offset) >= fork.size)
+        return 0;
+    length = size_t(min(uint64_t(length), fork.size - offset));
+
+    uint64_t extent_offset = 0;
+    uint64_t position = offset;
+    uint64_t end = offset + length;
+    for (const sparsebundle_hfs_extent_t &extent : fork.extents) {
+        uint64_t extent_length = uint64_t(extent.block_count) * hfs->block_size;
+        if (position < extent_offset + extent_length) {
+            uint64_t image_offset = hfs->offset + uint64_t(extent.start_block) * hfs->block_size
+                + (position - extent_offset);
+            size_t to_map = size_t(min(end, extent_offset + extent_length) - position);
+            if (image_offset + to_map > sparsebundle->size)
+                return -EIO;
+            ranges.push_back(make_pair(image_offset, to_map));
+            position += to_map;
+            if (position == end)
+                return int(length);
+        }
+        extent_offset += extent_length;
+    }
+
+    return -EIO;
+}
+
+// Reads from a fork, returning the number of bytes read, or -errno
+static int sparsebundle_hfs_read_fork(sparsebundle_t *sparsebundle, const sparsebundle_hfs_fork_t &fork,
+    char *buffer, size_t length, off_t offset)
+{
+    static thread_local vector<pair<uint64_t, size_t>> ranges;
+    int ret = sparsebundle_hfs_map_fork(sparsebundle, fork, length, offset, ranges);
+    if (ret <= 0)
+        return ret;
+
+    for (const pair<uint64_t, size_t> &range : ranges) {
+        int read = sparsebundle_read_image(sparsebundle, buffer, range.second, range.first);
+        if (read < 0)
+            return read;
+        if (size_t(read) != range.second)
+            return -EIO;
+        buffer += read;
+    }
+
+    return ret;
+}
+
+static void sparsebundle_hfs_parse_extents(const uint8_t *data, sparsebundle_hfs_fork_t *fork)
+{
+    for (unsigned i = 0; i < 8; ++i) {
+        sparsebundle_hfs_extent_t extent = {
+            uint32_t(sparsebundle_read_big_endian(data + i * 8, 4)),
+            uint32_t(sparsebundle_read_big_endian(data + i * 8 + 4, 4))
+        };
+        if (extent.block_count)
+            fork->extents.push_back(extent);
+    }
+}
+
+static void sparsebundle_hfs_parse_fork(const uint8_t *data, sparsebundle_hfs_fork_t *fork)
+{
+    fork->size = sparsebundle_read_big_endian(data, 8);
+    fork->total_blocks = uint32_t(sparsebundle_read_big_endian(data + 12, 4));
+    fork->extents.clear();
+    sparsebundle_hfs_parse_extents(data + 16, fork);
+}
+
+/*
+    B-tree nodes start with a descriptor, and end with the offsets of
+    their records, in reverse. Records of both trees start with a key
+    prefixed by its length, and index records follow their key with
+    the number of the child node.
+*/
+
+struct sparsebundle_hfs_cursor_t {
+    vector<char> node;
+    uint32_t node_number;
+    unsigned record;
+};
+
+static bool sparsebundle_hfs_read_node(sparsebundle_t *sparsebundle, const sparsebundle_hfs_btree_t &tree,
+    uint32_t node_number, vector<char> &node)
+{
+    node.resize(tree.node_size);
+    if (sparsebundle_hfs_read_fork(sparsebundle, tree.fork, node.data(), tree.node_size,
+            off_t(node_number) * tree.node_size) != int(tree.node_size)) {
+        syslog(LOG_ERR, "failed to read B-tree node %u", node_number);
+        return false;
+    }
+
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(node.data());
+    size_t record_count = size_t(sparsebundle_read_big_endian(data + 10, 2));
+    if (2 * (record_count + 1) > tree.node_size - 14) {
+        syslog(LOG_ERR, "corrupt B-tree node %u", node_number);
+        return false;
+    }
+    size_t offsets = tree.node_size - 2 * (record_count + 1);
+
+    // The offsets, including that of the free space, must ascend
+    size_t previous = 14;
+    for (size_t i = 0; i <= record_count; ++i) {
+        size_t offset = size_t(sparsebundle_read_big_endian(data + tree.node_size - 2 * (i + 1), 2));
+        if (offset < previous || offset > offsets) {
+            syslog(LOG_ERR, "corrupt B-tree node %u", node_number);
+            return false;
+        }
+        previous = offset;
+    }
+
+    return true;
+}
+
+static int sparsebundle_hfs_node_kind(const vector<char> &node)
+{
+    return int8_t(node[8]);
+}
+
+static unsigned sparsebundle_hfs_record_count(const vector<char> &node)
+{
+    return unsigned(sparsebundle_read_big_endian(reinterpret_cast<const uint8_t *>(node.data()) + 10, 2));
+}
+
+// Finds the key and data of a record, returning false if they
+// don't fit in the record.
+static bool sparsebundle_hfs_record(const sparsebundle_hfs_btree_t &tree, const vector<char> &node,
+    unsigned index, const uint8_t **key, size_t *key_length, const uint8_t **data, size_t *data_length)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(node.data());
+    size_t start = size_t(sparsebundle_read_big_endian(bytes + tree.node_size - 2 * (index + 1), 2));
+    size_t end = size_t(sparsebundle_read_big_endian(bytes + tree.node_size - 2 * (index + 2), 2));
+    if (end - start < 2)
+        return false;
+
+    *key_length = size_t(sparsebundle_read_big_endian(bytes + start, 2));
+    *key = bytes + start + 2;
+
+    size_t key_size = 2 + *key_length;
+    if (sparsebundle_hfs_node_kind(node) == sparsebundle_hfs_index_node && !tree.variable_index_keys)
+        key_size = 2 + tree.max_key_length;
+    if (key_size > end - start)
+        return false;
+
+    *data = bytes + start + key_size;
+    *data_length = end - start - key_size;
+    return true;
+}
+
+typedef int (*sparsebundle_hfs_compare_t)(const uint8_t *key, size_t key_length, const void *target);
+
+// Positions the cursor at the first leaf record not ordered before
+// the target, or past the last record, with node_number 0, if there's
+// no such record. Returns false if the tree is corrupt.
+static bool sparsebundle_hfs_find(sparsebundle_t *sparsebundle, const sparsebundle_hfs_btree_t &tree,
+    sparsebundle_hfs_compare_t compare, const void *target, sparsebundle_hfs_cursor_t *cursor)
+{
+    cursor->node_number = tree.root_node;
+    cursor->record = 0;
+    if (!cursor->node_number)
+        return true; // Empty tree
+
+    for (unsigned depth = 0; depth < sparsebundle_hfs_max_depth; ++depth) {
+        if (!sparsebundle_hfs_read_node(sparsebundle, tree, cursor->node_number, cursor->node))
+            return false;
+
+        const uint8_t *key;
+        const uint8_t *data;
+        size_t key_length;
+        size_t data_length;
+
+        unsigned record_count = sparsebundle_hfs_record_count(cursor->node);
+        int kind = sparsebundle_hfs_node_kind(cursor->node);
+        if (kind == sparsebundle_hfs_leaf_node) {
+            for (cursor->record = 0; cursor->record < record_count; ++cursor->record) {
+                if (!sparsebundle_hfs_record(tree, cursor->node, cursor->record, &key, &key_length, &data, &data_length))
+                    return false;
+                if (compare(key, key_length, target) >= 0)
+                    return true;
+            }
+
+            // Every record of this leaf comes before the target
+            cursor->node_number = uint32_t(sparsebundle_read_big_endian(
+                reinterpret_cast<const uint8_t *>(cursor->node.data()), 4));
+            cursor->record = 0;
+            return !cursor->node_number
+                || sparsebundle_hfs_read_node(sparsebundle, tree, cursor->node_number, cursor->node);
+        }
+
+        if (kind != sparsebundle_hfs_index_node || !record_count)
+            return false;
+
+        // Descend into the last child whose first key isn't after the target
+        uint32_t child = 0;
+        for (unsigned i = 0; i < record_count; ++i) {
+            if (!sparsebundle_hfs_record(tree, cursor->node, i, &key, &key_length, &data, &data_length)
+                || data_length < 4)
+                return false;
+            if (i && compare(key, key_length, target) > 0)
+                break;
+            child = uint32_t(sparsebundle_read_big_endian(data, 4));
+        }
+        cursor->node_number = child;
+    }
+
+    return false;
+}
+
+// Gets the record at the cursor, moving on to the next leaf once
+// past the last record of a leaf. Returns false at the end of the
+// tree, or if it's corrupt.
+static bool sparsebundle_hfs_cursor_record(sparsebundle_t *sparsebundle, const sparsebundle_hfs_btree_t &tree,
+    sparsebundle_hfs_cursor_t *cursor, const uint8_t **key, size_t *key_length,
+    const uint8_t **data, size_t *data_length)
+{
+    for (unsigned leaves = 0; cursor->node_number; ++leaves) {
+        if (sparsebundle_hfs_node_kind(cursor->node) != sparsebundle_hfs_leaf_node)
+            return false;
+        if (cursor->record < sparsebundle_hfs_record_count(cursor->node))
+            return sparsebundle_hfs_record(tree, cursor->node, cursor->record, key, key_length, data, data_length);
+
+        // Guards against cycles of empty leaves
+        if (leaves > tree.fork.size / tree.node_size)
+            return false;
+
+        cursor->node_number = uint32_t(sparsebundle_read_big_endian(
+            reinterpret_cast<const uint8_t *>(cursor->node.data()), 4));
+        cursor->record = 0;
+        if (cursor->node_number
+            && !sparsebundle_hfs_read_node(sparsebundle, tree, cursor->node_number, cursor->node))
+            return false;
+    }
+    return false;
+}
+
+struct sparsebundle_hfs_extent_key_t {
+    uint32_t file_id;
+    uint32_t start_block;
+};
+
+// Orders extent records by fork type, file ID and start block, only
+// looking for those of data forks.
+static int sparsebundle_hfs_compare_extents(const uint8_t *key, size_t key_length, const void *target)
+{
+    const sparsebundle_hfs_extent_key_t *extent = static_cast<const sparsebundle_hfs_extent_key_t *>(target);
+    if (key_length < 10)
+        return -1;
+    if (key[0])
+        return 1; // Resource forks go after data forks
+
+    uint32_t file_id = uint32_t(sparsebundle_read_big_endian(key + 2, 4));
+    uint32_t start_block = uint32_t(sparsebundle_read_big_endian(key + 6, 4));
+    if (file_id != extent->file_id)
+        return file_id < extent->file_id ? -1 : 1;
+    if (start_block != extent->start_block)
+        return start_block < extent->start_block ? -1 : 1;
+    return 0;
+}
+
+// Adds the extents beyond the first eight of a data fork, from the
+// extents overflow file.
+static bool sparsebundle_hfs_load_extents(sparsebundle_t *sparsebundle, uint32_t file_id,
+    sparsebundle_hfs_fork_t *fork)
+{
+    const sparsebundle_hfs_btree_t &tree = sparsebundle->hfs->extents;
+
+    for (;;) {
+        uint64_t blocks = 0;
+        for (const sparsebundle_hfs_extent_t &extent : fork->extents)
+            blocks += extent.block_count;
+        if (blocks >= fork->total_blocks)
+            return true;
+
+        sparsebundle_hfs_extent_key_t target = { file_id, uint32_t(blocks) };
+        sparsebundle_hfs_cursor_t cursor;
+        const uint8_t *key;
+        const uint8_t *data;
+        size_t key_length;
+        size_t data_length;
+        if (!sparsebundle_hfs_find(sparsebundle, tree, sparsebundle_hfs_compare_extents, &target, &cursor)
+            || !sparsebundle_hfs_cursor_record(sparsebundle, tree, &cursor, &key, &key_length, &data, &data_length)
+            || sparsebundle_hfs_compare_extents(key, key_length, &target) != 0 || data_length < 64) {
+            syslog(LOG_ERR, "missing extents of file %u at block %ju", file_id, uintmax_t(blocks));
+            return false;
+        }
+
+        size_t extent_count = fork->extents.size();
+        sparsebundle_hfs_parse_extents(data, fork);
+        if (fork->extents.size() == extent_count)
+            return false;
+    }
+}
+
+/*
+    Catalog keys are ordered by parent ID, and then by name, which is
+    compared as is on case-sensitive HFSX volumes, and otherwise case-
+    insensitively, using Apple's case folding of Unicode. Only ASCII is
+    folded here, which orders names that are all ASCII correctly against
+    any other name, as the folding keeps other characters outside of
+    ASCII, while other names are looked up by going through the parent.
+*/
+
+struct sparsebundle_hfs_catalog_key_t {
+    uint32_t parent;
+    const vector<uint16_t> *name;
+    bool case_sensitive;
+};
+
+static bool sparsebundle_hfs_is_ignorable(uint16_t c)
+{
+    return (c >= 0x200c && c <= 0x200f) || (c >= 0x202a && c <= 0x202e)
+        || (c >= 0x206a && c <= 0x206f) || c == 0xfeff;
+}
+
+static uint16_t sparsebundle_hfs_fold(uint16_t c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c + ('a' - 'A');
+    return c ? c : 0xffff; // So that the private data directory goes last
+}
+
+static int sparsebundle_hfs_compare_names(const uint8_t *key_name, size_t key_name_length,
+    const vector<uint16_t> &name, bool case_sensitive)
+{
+    if (case_sensitive) {
+        for (size_t i = 0; i < min(key_name_length, name.size()); ++i) {
+            uint16_t c = uint16_t(sparsebundle_read_big_endian(key_name + 2 * i, 2));
+            if (c != name[i])
+                return c < name[i] ? -1 : 1;
+        }
+        return key_name_length == name.size() ? 0 : key_name_length < name.size() ? -1 : 1;
+    }
+
+    // Folded characters are never 0, which marks the end here
+    size_t i = 0;
+    size_t j = 0;
+    for (;;) {
+        uint16_t a = 0;
+        uint16_t b = 0;
+        while (!a && i < key_name_length) {
+            a = uint16_t(sparsebundle_read_big_endian(key_name + 2 * i++, 2));
+            a = sparsebundle_hfs_is_ignorable(a) ? 0 : sparsebundle_hfs_fold(a);
+        }
+        while (!b && j < name.size()) {
+            b = name[j++];
+            b = sparsebundle_hfs_is_ignorable(b) ? 0 : sparsebundle_hfs_fold(b);
+        }
+        if (a != b)
+            return a < b ? -1 : 1;
+        if (!a)
+            return 0;
+    }
+}
+
+static int sparsebundle_hfs_compare_catalog(const uint8_t *key, size_t key_length, const void *target)
+{
+    const sparsebundle_hfs_catalog_key_t *catalog = static_cast<const sparsebundle_hfs_catalog_key_t *>(target);
+    if (key_length < 6)
+        return -1;
+
+    uint32_t parent = uint32_t(sparsebundle_read_big_endian(key, 4));
+    if (parent != catalog->parent)
+        return parent < catalog->parent ? -1 : 1;
+
+    size_t name_length = size_t(sparsebundle_read_big_endian(key + 4, 2));
+    if (6 + 2 * name_length > key_length)
+        return -1;
+    return sparsebundle_hfs_compare_names(key + 6, name_length, *catalog->name, catalog->case_sensitive);
+}
+
+static bool sparsebundle_hfs_name_equals(const uint8_t *key, size_t key_length, const vector<uint16_t> &name)
+{
+    if (key_length < 6 + 2 * name.size() || sparsebundle_read_big_endian(key + 4, 2) != name.size())
+        return false;
+    for (size_t i = 0; i < name.size(); ++i) {
+        if (sparsebundle_read_big_endian(key + 6 + 2 * i, 2) != name[i])
+            return false;
+    }
+    return true;
+}
+
+// Looks up the catalog record of name in the directory parent,
+// returning 0, -ENOENT, or -EIO.
+static int sparsebundle_hfs_lookup_record(sparsebundle_t *sparsebundle, uint32_t parent,
+    const vector<uint16_t> &name, string *record)
+{
+    const sparsebundle_hfs_t *hfs = sparsebundle->hfs;
+    const sparsebundle_hfs_btree_t &tree = hfs->catalog;
+
+    bool ascii = all_of(name.begin(), name.end(), [](uint16_t c) { return c < 0x80; });
+    bool seek_name = ascii || hfs->case_sensitive;
+
+    static const vector<uint16_t> no_name;
+    sparsebundle_hfs_catalog_key_t target = { parent, seek_name ? &name : &no_name, hfs->case_sensitive };
+
+    sparsebundle_hfs_cursor_t cursor;
+    if (!sparsebundle_hfs_find(sparsebundle, tree, sparsebundle_hfs_compare_catalog, &target, &cursor))
+        return -EIO;
+
+    const uint8_t *key;
+    const uint8_t *data;
+    size_t key_length;
+    size_t data_length;
+    for (; sparsebundle_hfs_cursor_record(sparsebundle, tree, &cursor, &key, &key_length, &data, &data_length);
+         ++cursor.record) {
+        if (key_length < 6 || sparsebundle_read_big_endian(key, 4) != parent)
+            break;
+
+        bool found = seek_name ? sparsebundle_hfs_compare_catalog(key, key_length, &target) == 0
+            : sparsebundle_hfs_name_equals(key, key_length, name);
+        if (found) {
+            record->assign(reinterpret_cast<const char *>(data), data_length);
+            return 0;
+        }
+
+        if (seek_name)
+            break;
+    }
+
+    return -ENOENT;
+}
+
+// Looks up the catalog record of a file or directory by its ID,
+// through its thread record.
+static int sparsebundle_hfs_lookup_cnid(sparsebundle_t *sparsebundle, uint32_t cnid, string *record)
+{
+    string thread;
+    static const vector<uint16_t> no_name;
+    int ret = sparsebundle_hfs_lookup_record(sparsebundle, cnid, no_name, &thread);
+    if (ret < 0)
+        return ret;
+
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(thread.data());
+    if (thread.size() < 10)
+        return -EIO;
+    size_t name_length = size_t(sparsebundle_read_big_endian(data + 8, 2));
+    if (thread.size() < 10 + 2 * name_length)
+        return -EIO;
+
+    vector<uint16_t> name(name_length);
+    for (size_t i = 0; i < name_length; ++i)
+        name[i] = uint16_t(sparsebundle_read_big_endian(data + 10 + 2 * i, 2));
+
+    return sparsebundle_hfs_lookup_record(sparsebundle, uint32_t(sparsebundle_read_big_endian(data + 4, 4)),
+        name, record);
+}
+
+static vector<uint16_t> sparsebundle_hfs_ascii_name(const char *name, size_t length)
+{
+    return vector<uint16_t>(name, name + length);
+}
+
+// Decodes a name given in UTF-8, with slashes shown as colons,
+// returning false if it's not valid UTF-8.
+static bool sparsebundle_hfs_decode_name(const char *name, size_t length, vector<uint16_t> *decoded)
+{
+    decoded->clear();
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(name);
+    for (size_t i = 0; i < length;) {
+        uint32_t c = bytes[i];
+        size_t continuation = 0;
+        if (c >= 0xc2 && c < 0xe0)
+            continuation = 1;
+        else if (c >= 0xe0 && c < 0xf0)
+            continuation = 2;
+        else if (c >= 0xf0 && c < 0xf5)
+            continuation = 3;
+        else if (c >= 0x80)
+            return false;
+        if (length - i <= continuation)
+            return false;
+
+        c &= 0x7f >> (continuation ? continuation + 1 : 0);
+        for (size_t j = 1; j <= continuation; ++j) {
+            if ((bytes[i + j] & 0xc0) != 0x80)
+                return false;
+            c = (c << 6) | (bytes[i + j] & 0x3f);
+        }
+        i += continuation + 1;
+
+        if (c > 0x10ffff)
+            return false;
+        if (c == ':')
+            c = '/';
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            decoded->push_back(uint16_t(0xd800 + (c >> 10)));
+            decoded->push_back(uint16_t(0xdc00 + (c & 0x3ff)));
+        } else {
+            decoded->push_back(uint16_t(c));
+        }
+    }
+    return decoded->size() <= 255;
+}
+
+static string sparsebundle_hfs_encode_name(const uint8_t *name, size_t length)
+{
+    string encoded;
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t c = uint32_t(sparsebundle_read_big_endian(name + 2 * i, 2));
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < length) {
+            uint32_t low = uint32_t(sparsebundle_read_big_endian(name + 2 * (i + 1), 2));
+            if (low >= 0xdc00 && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                ++i;
+            }
+        }
+
+        if (c == '/')
+            c = ':';
+        if (c < 0x80) {
+            encoded += char(c);
+        } else if (c < 0x800) {
+            encoded += char(0xc0 | (c >> 6));
+            encoded += char(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            encoded += char(0xe0 | (c >> 12));
+            encoded += char(0x80 | ((c >> 6) & 0x3f));
+            encoded += char(0x80 | (c & 0x3f));
+        } else {
+            encoded += char(0xf0 | (c >> 18));
+            encoded += char(0x80 | ((c >> 12) & 0x3f));
+            encoded += char(0x80 | ((c >> 6) & 0x3f));
+            encoded += char(0x80 | (c & 0x3f));
+        }
+    }
+    return encoded;
+}
+
+static time_t sparsebundle_hfs_time(const uint8_t *data)
+{
+    return time_t(int64_t(sparsebundle_read_big_endian(data, 4)) - sparsebundle_hfs_epoch_offset);
+}
+
+// Makes an entry of a file or folder record, following hard links
+static int sparsebundle_hfs_make_entry(sparsebundle_t *sparsebundle, const string &record,
+    sparsebundle_hfs_entry_t *entry, bool follow_links = true)
+{
+    const sparsebundle_hfs_t *hfs = sparsebundle->hfs;
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(record.data());
+    if (record.size() < 2)
+        return -EIO;
+
+    unsigned type = unsigned(sparsebundle_read_big_endian(data, 2));
+    if ((type != sparsebundle_hfs_folder_record || record.size() < 88)
+        && (type != sparsebundle_hfs_file_record || record.size() < 248))
+        return -EIO;
+
+    if (type == sparsebundle_hfs_file_record && follow_links) {
+        uint32_t file_type = uint32_t(sparsebundle_read_big_endian(data + 48, 4));
+        uint32_t creator = uint32_t(sparsebundle_read_big_endian(data + 52, 4));
+        uint32_t link = uint32_t(sparsebundle_read_big_endian(data + 44, 4));
+
+        char name[32];
+        uint32_t links_cnid = 0;
+        if (file_type == 0x686c6e6b && creator == 0x6866732b) { // hlnk, hfs+
+            snprintf(name, sizeof(name), "iNode%u", link);
+            links_cnid = hfs->file_links_cnid;
+        } else if (file_type == 0x66647270 && creator == 0x4d414353) { // fdrp, MACS
+            snprintf(name, sizeof(name), "dir_%u", link);
+            links_cnid = hfs->directory_links_cnid;
+        }
+
+        if (links_cnid) {
+            string target;
+            int ret = sparsebundle_hfs_lookup_record(sparsebundle, links_cnid,
+                sparsebundle_hfs_ascii_name(name, strlen(name)), &target);
+            if (ret < 0) {
+                syslog(LOG_ERR, "failed to follow hard link to %s", name);
+                return ret == -ENOENT ? -EIO : ret;
+            }
+            return sparsebundle_hfs_make_entry(sparsebundle, target, entry, false);
+        }
+    }
+
+    bool is_folder = type == sparsebundle_hfs_folder_record;
+    entry->cnid = uint32_t(sparsebundle_read_big_endian(data + 8, 4));
+    entry->uid = uid_t(sparsebundle_read_big_endian(data + 32, 4));
+    entry->gid = gid_t(sparsebundle_read_big_endian(data + 36, 4));
+    entry->mode = mode_t(sparsebundle_read_big_endian(data + 42, 2));
+    if (!(entry->mode & S_IFMT))
+        entry->mode = is_folder ? S_IFDIR | 0755 : S_IFREG | 0644;
+    entry->mode &= ~mode_t(0222); // Served read-only
+    entry->modification_time = sparsebundle_hfs_time(data + 16);
+    entry->change_time = sparsebundle_hfs_time(data + 20);
+    entry->access_time = sparsebundle_hfs_time(data + 24);
+
+    uint32_t special = uint32_t(sparsebundle_read_big_endian(data + 44, 4));
+    entry->device = S_ISBLK(entry->mode) || S_ISCHR(entry->mode) ? dev_t(special) : 0;
+
+    // The owner flags, following the admin flags
+    entry->compressed = !is_folder && (data[41] & sparsebundle_hfs_compressed_flag);
+
+    if (is_folder) {
+        entry->link_count = 2;
+        entry->blocks = 0;
+        entry->data.reset();
+        return 0;
+    }
+
+    // Followed links have their link count there instead
+    entry->link_count = !follow_links && special ? nlink_t(special) : 1;
+
+    shared_ptr<sparsebundle_hfs_fork_t> fork(new sparsebundle_hfs_fork_t());
+    sparsebundle_hfs_parse_fork(data + 88, fork.get());
+    if (!sparsebundle_hfs_load_extents(sparsebundle, entry->cnid, fork.get()))
+        return -EIO;
+    entry->blocks = uint64_t(fork->total_blocks) * hfs->block_size / 512;
+    entry->data = fork;
+    return 0;
+}
+
+// Resolves a path within the volume, starting with a slash
+static int sparsebundle_hfs_resolve(sparsebundle_t *sparsebundle, const char *path, sparsebundle_hfs_entry_t *entry)
+{
+    sparsebundle_hfs_t *hfs = sparsebundle->hfs;
+
+    {
+        lock_guard<mutex> locker(hfs->lock);
+        auto iter = hfs->entries.find(path);
+        if (iter != hfs->entries.end()) {
+            *entry = iter->second;
+            return 0;
+        }
+    }
+
+    int ret = 0;
+    string record;
+    const char *last_slash = strrchr(path, '/');
+    if (!last_slash[1]) {
+        // The root, whose name is that of the volume
+        if (last_slash != path)
+            return -ENOENT;
+        ret = sparsebundle_hfs_lookup_cnid(sparsebundle, sparsebundle_hfs_root_cnid, &record);
+    } else {
+        sparsebundle_hfs_entry_t parent;
+        string parent_path(path, max(last_slash, path + 1));
+        ret = sparsebundle_hfs_resolve(sparsebundle, parent_path.c_str(), &parent);
+        if (ret < 0)
+            return ret;
+        if (!S_ISDIR(parent.mode))
+            return -ENOTDIR;
+
+        vector<uint16_t> name;
+        if (!sparsebundle_hfs_decode_name(last_slash + 1, strlen(last_slash + 1), &name))
+            return -ENOENT;
+
+        ret = sparsebundle_hfs_lookup_record(sparsebundle, parent.cnid, name, &record);
+
+        // The private directories of hard links are hidden
+        if (ret == 0 && record.size() >= 12) {
+            uint32_t cnid = uint32_t(sparsebundle_read_big_endian(
+                reinterpret_cast<const uint8_t *>(record.data()) + 8, 4));
+            if (cnid == hfs->file_links_cnid || cnid == hfs->directory_links_cnid)
+                return -ENOENT;
+        }
+    }
+    if (ret < 0)
+        return ret;
+
+    ret = sparsebundle_hfs_make_entry(sparsebundle, record, entry);
+    if (ret < 0)
+        return ret;
+
+    lock_guard<mutex> locker(hfs->lock);
+    if (hfs->entries.size() >= sparsebundle_hfs_max_entries)
+        hfs->entries.clear();
+    hfs->entries[path] = *entry;
+
+    return 0;
+}
+
+static sparsebundle_t *sparsebundle_hfs_volume(sparsebundle_mount_t *mount, const char *path,
+    const char **volume_path)
+{
+    if (mount->volumes.empty())
+        return nullptr;
+
+    const char *slash = strchr(path + 1, '/');
+    auto iter = mount->volumes.find(slash ? string(path, slash) : string(path));
+    if (iter == mount->volumes.end())
+        return nullptr;
+
+    *volume_path = slash ? slash : "/";
+    return iter->second;
+}
+
+static int sparsebundle_hfs_getattr(sparsebundle_t *sparsebundle, const char *path, struct stat *stbuf)
+{
+    sparsebundle_hfs_entry_t entry;
+    int ret = sparsebundle_hfs_resolve(sparsebundle, path, &entry);
+    sparsebundle_release_files();
+    if (ret < 0)
+        return ret;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = entry.cnid;
+    stbuf->st_mode = entry.mode;
+    stbuf->st_nlink = entry.link_count;
+    stbuf->st_uid = entry.uid;
+    stbuf->st_gid = entry.gid;
+    stbuf->st_rdev = entry.device;
+    stbuf->st_size = entry.data ? off_t(entry.data->size) : 0;
+    stbuf->st_blocks = blkcnt_t(entry.blocks);
+    stbuf->st_blksize = blksize_t(sparsebundle->hfs->block_size);
+    stbuf->st_atime = entry.access_time;
+    stbuf->st_mtime = entry.modification_time;
+    stbuf->st_ctime = entry.change_time;
+
+    return 0;
+}
+
+static int sparsebundle_hfs_readdir(sparsebundle_t *sparsebundle, const char *path,
+    void *buf, fuse_fill_dir_t filler)
+{
+    const sparsebundle_hfs_t *hfs = sparsebundle->hfs;
+
+    sparsebundle_hfs_entry_t entry;
+    int ret = sparsebundle_hfs_resolve(sparsebundle, path, &entry);
+    if (ret < 0 || !S_ISDIR(entry.mode)) {
+        sparsebundle_release_files();
+        return ret < 0 ? ret : -ENOTDIR;
+    }
+
+    sparsebundle_fill_dir(filler, buf, ".", 0);
+    sparsebundle_fill_dir(filler, buf, "..", 0);
+
+    static const vector<uint16_t> no_name;
+    sparsebundle_hfs_catalog_key_t target = { entry.cnid, &no_name, hfs->case_sensitive };
+
+    sparsebundle_hfs_cursor_t cursor;
+    if (!sparsebundle_hfs_find(sparsebundle, hfs->catalog, sparsebundle_hfs_compare_catalog, &target, &cursor))
+        ret = -EIO;
+
+    const uint8_t *key;
+    const uint8_t *data;
+    size_t key_length;
+    size_t data_length;
+    for (; !ret && sparsebundle_hfs_cursor_record(sparsebundle, hfs->catalog, &cursor,
+             &key, &key_length, &data, &data_length); ++cursor.record) {
+        if (key_length < 6 || sparsebundle_read_big_endian(key, 4) != entry.cnid)
+            break;
+
+        size_t name_length = size_t(sparsebundle_read_big_endian(key + 4, 2));
+        if (data_length < 12 || 6 + 2 * name_length > key_length)
+            continue;
+
+        unsigned type = unsigned(sparsebundle_read_big_endian(data, 2));
+        if (type != sparsebundle_hfs_folder_record && type != sparsebundle_hfs_file_record)
+            continue; // The thread record
+
+        uint32_t cnid = uint32_t(sparsebundle_read_big_endian(data + 8, 4));
+        if (cnid == hfs->file_links_cnid || cnid == hfs->directory_links_cnid)
+            continue;
+
+        string name = sparsebundle_hfs_encode_name(key + 6, name_length);
+        sparsebundle_fill_dir(filler, buf, name.c_str(), 0);
+    }
+
+    sparsebundle_release_files();
+    return ret;
+}
+
+static int sparsebundle_hfs_open(sparsebundle_t *sparsebundle, const char *path,
+    shared_ptr<const sparsebundle_hfs_fork_t> *fork)
+{
+    sparsebundle_hfs_entry_t entry;
+    int ret = sparsebundle_hfs_resolve(sparsebundle, path, &entry);
+    sparsebundle_release_files();
+    if (ret < 0)
+        return ret;
+    if (S_ISDIR(entry.mode))
+        return -EISDIR;
+    if (!entry.data)
+        return -EACCES;
+    if (entry.compressed) {
+        syslog(LOG_ERR, "can't open %s%s, as compressed files aren't supported",
+            sparsebundle->hfs->path.c_str(), path);
+        return -ENOTSUP;
+    }
+
+    *fork = entry.data;
+    return 0;
+}
+
+static int sparsebundle_hfs_readlink(sparsebundle_t *sparsebundle, const char *path, char *buffer, size_t size)
+{
+    sparsebundle_hfs_entry_t entry;
+    int ret = sparsebundle_hfs_resolve(sparsebundle, path, &entry);
+    if (ret == 0 && !S_ISLNK(entry.mode))
+        ret = -EINVAL;
+    if (ret == 0 && size) {
+        size_t length = size_t(min(entry.data->size, uint64_t(size - 1)));
+        ret = sparsebundle_hfs_read_fork(sparsebundle, *entry.data, buffer, length, 0);
+        if (ret >= 0) {
+            buffer[ret] = '\0';
+            ret = 0;
+        }
+    }
+
+    sparsebundle_release_files();
+    return ret;
+}
+
+#if FUSE_SUPPORTS_ZERO_COPY
+static int sparsebundle_hfs_read_buf(sparsebundle_t *sparsebundle, const sparsebundle_hfs_fork_t &fork,
+    struct fuse_bufvec **bufp, size_t length, off_t offset)
+{
+    static thread_local vector<pair<uint64_t, size_t>> ranges;
+    int ret = sparsebundle_hfs_map_fork(sparsebundle, fork, length, offset, ranges);
+    if (ret < 0)
+        return ret;
+
+    size_t max_buffers = 1;
+    for (const pair<uint64_t, size_t> &range : ranges)
+        max_buffers += sparsebundle_max_buffers(sparsebundle, range.second, range.first);
+
+    size_t bufvec_size = sizeof(struct fuse_bufvec) + (sizeof(struct fuse_buf) * (max_buffers - 1));
+    struct fuse_bufvec *buffer_vector = static_cast<fuse_bufvec *>(malloc(bufvec_size));
+    if (buffer_vector == 0)
+        return -ENOMEM;
+
+    buffer_vector->count = 0;
+    buffer_vector->idx = 0;
+    buffer_vector->off = 0;
+
+    sparsebundle_read_operations read_ops = {
+        &sparsebundle_read_buf_process_band,
+        sparsebundle_read_buf_pad_with_zeroes,
+        buffer_vector
+    };
+
+    for (const pair<uint64_t, size_t> &range : ranges) {
+        int read = sparsebundle_iterate_bands(sparsebundle, range.second, range.first, &read_ops);
+        if (read < 0 || size_t(read) != range.second) {
+            free(buffer_vector);
+            return read < 0 ? read : -EIO;
+        }
+    }
+
+    assert(buffer_vector->count <= max_buffers);
+
+    *bufp = buffer_vector;
+    return ret;
+}
+#endif
+
+static bool sparsebundle_hfs_load_btree(sparsebundle_t *sparsebundle, const uint8_t *fork_data,
+    uint32_t file_id, sparsebundle_hfs_btree_t *tree)
+{
+    sparsebundle_hfs_parse_fork(fork_data, &tree->fork);
+    if (file_id != sparsebundle_hfs_extents_cnid
+        && !sparsebundle_hfs_load_extents(sparsebundle, file_id, &tree->fork))
+        return false;
+
+    // The header record follows the node descriptor of the first node
+    uint8_t header[14 + 106];
+    if (sparsebundle_hfs_read_fork(sparsebundle, tree->fork, reinterpret_cast<char *>(header),
+            sizeof(header), 0) != int(sizeof(header)))
+        return false;
+    if (int8_t(header[8]) != sparsebundle_hfs_header_node)
+        return false;
+
+    const uint8_t *record = header + 14;
+    tree->root_node = uint32_t(sparsebundle_read_big_endian(record + 2, 4));
+    tree->node_size = uint32_t(sparsebundle_read_big_endian(record + 18, 2));
+    tree->max_key_length = uint16_t(sparsebundle_read_big_endian(record + 20, 2));
+    uint32_t attributes = uint32_t(sparsebundle_read_big_endian(record + 38, 4));
+    tree->variable_index_keys = attributes & (1 << 2);
+    tree->key_compare_type = record[37];
+
+    // Node sizes are powers of two from 512 bytes to 32 KB
+    return tree->node_size >= 512 && tree->node_size <= 32768
+        && !(tree->node_size & (tree->node_size - 1))
+        && tree->root_node < tree->fork.size / tree->node_size;
+}
+
+// Finds the volume at the start of the image, or in the first HFS+
+// partition of its GUID partition table, returning its offset.
+static bool sparsebundle_hfs_find_volume(sparsebundle_t *sparsebundle, uint64_t *offset, uint8_t *header)
+{
+    auto read_header = [&](uint64_t volume_offset) {
+        if (sparsebundle_read_image(sparsebundle, reinterpret_cast<char *>(header), sparsebundle_hfs_header_size,
+                volume_offset + sparsebundle_hfs_header_offset) != int(sparsebundle_hfs_header_size))
+            return false;
+        uint16_t signature = uint16_t(sparsebundle_read_big_endian(header, 2));
+        *offset = volume_offset;
+        return signature == sparsebundle_hfs_plus_signature || signature == sparsebundle_hfsx_signature;
+    };
+
+    if (read_header(0))
+        return true;
+
+    uint8_t gpt[92];
+    if (sparsebundle_read_image(sparsebundle, reinterpret_cast<char *>(gpt), sizeof(gpt),
+            sparsebundle_hfs_sector_size) != int(sizeof(gpt)) || memcmp(gpt, "EFI PART", 8) != 0)
+        return false;
+
+    auto little_endian = [](const uint8_t *data, size_t size) {
+        uint64_t value = 0;
+        for (size_t i = size; i-- > 0;)
+            value = (value << 8) | data[i];
+        return value;
+    };
+
+    uint64_t entries_lba = little_endian(gpt + 72, 8);
+    uint64_t entry_count = min(little_endian(gpt + 80, 4), uint64_t(1024));
+    uint64_t entry_size = little_endian(gpt + 84, 4);
+    if (entry_size < 128 || entry_size > 4096)
+        return false;
+
+    // 48465300-0000-11AA-AA11-00306543ECAC, as laid out on disk
+    static const uint8_t hfs_plus_type[16] = {
+        0x00, 0x53, 0x46, 0x48, 0x00, 0x00, 0xaa, 0x11,
+        0xaa, 0x11, 0x00, 0x30, 0x65, 0x43, 0xec, 0xac
+    };
+
+    vector<char> entry(entry_size);
+    for (uint64_t i = 0; i < entry_count; ++i) {
+        uint64_t entry_offset = entries_lba * sparsebundle_hfs_sector_size + i * entry_size;
+        if (sparsebundle_read_image(sparsebundle, entry.data(), entry_size, entry_offset) != int(entry_size))
+            return false;
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(entry.data());
+        if (memcmp(bytes, hfs_plus_type, sizeof(hfs_plus_type)) == 0)
+            return read_header(little_endian(bytes + 32, 8) * sparsebundle_hfs_sector_size);
+    }
+
+    return false;
+}
+
+// Reads the volume header, and the headers of the B-trees, of the
+// volume of the image, returning false if there's no such volume.
+static bool sparsebundle_hfs_mount(sparsebundle_t *sparsebundle)
+{
+    sparsebundle_hfs_t *hfs = sparsebundle->hfs;
+
+    uint8_t header[sparsebundle_hfs_header_size];
+    if (!sparsebundle_hfs_find_volume(sparsebundle, &hfs->offset, header))
+        return false;
+
+    hfs->block_size = uint32_t(sparsebundle_read_big_endian(header + 40, 4));
+    if (hfs->block_size < 512 || (hfs->block_size & (hfs->block_size - 1)))
+        return false;
+
+    if (!sparsebundle_hfs_load_btree(sparsebundle, header + 192, sparsebundle_hfs_extents_cnid, &hfs->extents)
+        || !sparsebundle_hfs_load_btree(sparsebundle, header + 272, sparsebundle_hfs_catalog_cnid, &hfs->catalog))
+        return false;
+
+    // HFSX volumes may compare names in binary, i.e. case-sensitively
+    hfs->case_sensitive = sparsebundle_read_big_endian(header, 2) == sparsebundle_hfsx_signature
+        && hfs->catalog.key_compare_type == 0xbc;
+
+    static const char file_links[] = "\0\0\0\0HFS+ Private Data";
+    static const char directory_links[] = ".HFS+ Private Directory Data\r";
+    string record;
+    sparsebundle_hfs_entry_t entry;
+    if (sparsebundle_hfs_lookup_record(sparsebundle, sparsebundle_hfs_root_cnid,
+            sparsebundle_hfs_ascii_name(file_links, sizeof(file_links) - 1), &record) == 0
+        && sparsebundle_hfs_make_entry(sparsebundle, record, &entry) == 0)
+        hfs->file_links_cnid = entry.cnid;
+    if (sparsebundle_hfs_lookup_record(sparsebundle, sparsebundle_hfs_root_cnid,
+            sparsebundle_hfs_ascii_name(directory_links, sizeof(directory_links) - 1), &record) == 0
+        && sparsebundle_hfs_make_entry(sparsebundle, record, &entry) == 0)
+        hfs->directory_links_cnid = entry.cnid;
+
+    bool mounted = sparsebundle_hfs_resolve(sparsebundle, "/", &entry) == 0 && S_ISDIR(entry.mode);
+    sparsebundle_release_files();
+
+    sparsebundle_debug("found %s volume at offset %ju, with blocks of %u bytes",
+        hfs->case_sensitive ? "case-sensitive HFSX" : "HFS+", uintmax_t(hfs->offset), hfs->block_size);
+
+    return mounted;
+}
+
+/*
+    Scrubbing
+
+    With --scrub the bundles are checked against their checksums, see
+    Band checksums above, instead of being mounted. Bands that have no
+    checksum yet, or have been written to since it was made, are
+    hashed and have their checksum recorded, so that a first scrub of
+    a bundle makes its checksums. Bands that are gone are dropped, as
+    discarding parts of the image deletes bands legitimately.
+
+    The bands of all bundles are spread over scrub_threads threads,
+    taking a band of each bundle in turn, so that bundles on different
+    disks are read in parallel. Each band is read from the start in
+    large sequential reads, and dropped from the page cache before and
+    after, so that its data comes from the disk, and a scrub doesn't
+    push the working set of other processes out of the cache. With
+    scrub_rate the reads of all threads together are throttled to that
+    many bytes per second.
+*/
+
+static const char sparsebundle_checksums_name[] = "sparsebundlefs.checksums";
+static const char sparsebundle_checksums_header[] = "# band length modification-time-ns sha256";
+
+static bool sparsebundle_parse_digest(const char *hex, uint8_t *digest)
+{
+    for (size_t i = 0; i < sparsebundle_digest_size; ++i) {
+        unsigned value;
+        if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1]) || sscanf(hex + 2 * i, "%2x", &value) != 1)
+            return false;
+        digest[i] = uint8_t(value);
+    }
+    return hex[2 * sparsebundle_digest_size] == '\0';
+}
+
+// Reads the checksums of the bundle, returning false if it has none
+static bool sparsebundle_read_checksums(sparsebundle_t *sparsebundle, sparsebundle_checksums_t *checksums)
+{
+    sparsebundle_checksum_t no_checksum = { -1, 0, {} };
+    checksums->bands.assign(sparsebundle->band_count, no_checksum);
+
+    string checksums_path = string(sparsebundle->path) + "/" + sparsebundle_checksums_name;
+    FILE *file = fopen(checksums_path.c_str(), "r");
+    if (!file) {
+        if (errno != ENOENT)
+            sparsebundle_fatal_error("failed to open %s", checksums_path.c_str());
+        return false;
+    }
+
+    char line[256];
+    for (size_t line_number = 1; fgets(line, sizeof(line), file); ++line_number) {
+        if (line[0] == '#')
+            continue;
+
+        uintmax_t band_number;
+        intmax_t length;
+        uintmax_t modification_time;
+        char hex[2 * sparsebundle_digest_size + 2];
+        uint8_t digest[sparsebundle_digest_size];
+        if (sscanf(line, "%jx %jd %ju %65s", &band_number, &length, &modification_time, hex) != 4
+            || band_number >= sparsebundle->band_count || length < 0
+            || uintmax_t(length) > sparsebundle->band_size || !sparsebundle_parse_digest(hex, digest)) {
+            errno = 0;
+            sparsebundle_fatal_error("%s: malformed checksum on line %zu", checksums_path.c_str(), line_number);
+        }
+
+        sparsebundle_checksum_t &checksum = checksums->bands[band_number];
+        checksum.length = off_t(length);
+        checksum.modification_time = uint64_t(modification_time);
+        memcpy(checksum.digest, digest, sizeof(digest));
+    }
+
+    if (ferror(file))
+        sparsebundle_fatal_error("failed to read %s", checksums_path.c_str());
+    fclose(file);
+
+    return true;
+}
+
+// Replaces the checksums of the bundle through a temporary file,
+// so that they're never left half written.
+static bool sparsebundle_write_checksums(sparsebundle_t *sparsebundle, const sparsebundle_checksums_t &checksums)
+{
+    string checksums_path = string(sparsebundle->path) + "/" + sparsebundle_checksums_name;
+    string temporary_path = checksums_path + ".tmp";
+
+    FILE *file = fopen(temporary_path.c_str(), "w");
+    if (!file) {
+        syslog(LOG_ERR, "failed to create %s: %s", temporary_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "%s\n", sparsebundle_checksums_header);
+    for (size_t band_number = 0; band_number < checksums.bands.size(); ++band_number) {
+        const sparsebundle_checksum_t &checksum = checksums.bands[band_number];
+        if (checksum.length == -1)
+            continue;
+
+        fprintf(file, "%jx %jd %ju ", uintmax_t(band_number), intmax_t(checksum.length),
+            uintmax_t(checksum.modification_time));
+        for (uint8_t byte : checksum.digest)
+            fprintf(file, "%02x", byte);
+        fprintf(file, "\n");
+    }
+
+    bool written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temporary_path.c_str(), checksums_path.c_str()) == -1) {
+        syslog(LOG_ERR, "failed to write %s: %s", checksums_path.c_str(), strerror(errno));
+        unlink(temporary_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+struct sparsebundle_scrub_bundle_t {
+    sparsebundle_t *sparsebundle;
+    sparsebundle_checksums_t checksums;
+    sparsebundle_checksums_t scrubbed;
+    atomic<uint64_t> verified;
+    atomic<uint64_t> added;
+    atomic<uint64_t> updated;
+    atomic<uint64_t> removed;
+    atomic<uint64_t> skipped;
+    atomic<uint64_t> corrupt;
+    atomic<uint64_t> failed;
+};
+
+struct sparsebundle_scrub_t {
+    vector<unique_ptr<sparsebundle_scrub_bundle_t>> bundles;
+    vector<pair<sparsebundle_scrub_bundle_t *, uint32_t>> bands;
+    atomic<size_t> next_band;
+    atomic<uint64_t> bytes;
+    sparsebundle_throttle_t throttle;
+};
+
+static void sparsebundle_scrub_band(sparsebundle_scrub_t *scrub, sparsebundle_scrub_bundle_t *bundle,
+    uint32_t band_number)
+{
+    sparsebundle_t *sparsebundle = bundle->sparsebundle;
+    const sparsebundle_checksum_t &checksum = bundle->checksums.bands[band_number];
+
+    char band_name[sizeof(uintmax_t) * 2 + 1];
+    snprintf(band_name, sizeof(band_name), "%jx", uintmax_t(band_number));
+
+    int fd = openat(sparsebundle->bands_fd, band_name, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            // Deleted since the bands were scanned
+            bundle->scrubbed.bands[band_number].length = -1;
+            if (checksum.length != -1)
+                bundle->removed++;
+            return;
+        }
+        syslog(LOG_ERR, "failed to open band %s of %s: %s", band_name, sparsebundle->path, strerror(errno));
+        bundle->failed++;
+        return;
+    }
+
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    struct stat band_stat;
+    struct stat hashed_stat;
+    uint8_t digest[sparsebundle_digest_size];
+    ssize_t hashed = fstat(fd, &band_stat) == -1 ? -errno : sparsebundle_hash_band(fd, digest, &scrub->throttle);
+    if (hashed >= 0 && fstat(fd, &hashed_stat) == -1)
+        hashed = -errno;
+
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+
+    if (hashed < 0) {
+        syslog(LOG_ERR, "failed to read band %s of %s: %s", band_name, sparsebundle->path, strerror(int(-hashed)));
+        bundle->failed++;
+        return;
+    }
+
+    scrub->bytes += uint64_t(hashed);
+
+    uint64_t modification_time = sparsebundle_modification_time(band_stat);
+    if (hashed != band_stat.st_size || hashed_stat.st_size != band_stat.st_size
+        || sparsebundle_modification_time(hashed_stat) != modification_time) {
+        sparsebundle_debug("band %s of %s was written to while being hashed, skipping it",
+            band_name, sparsebundle->path);
+        bundle->skipped++;
+        return;
+    }
+
+    bool unchanged = checksum.length == band_stat.st_size && checksum.modification_time == modification_time;
+    if (unchanged && memcmp(digest, checksum.digest, sizeof(digest)) != 0) {
+        // Keeps the checksum, so that later scrubs report the band too
+        syslog(LOG_ERR, "band %s of %s doesn't match its checksum", band_name, sparsebundle->path);
+        bundle->corrupt++;
+        return;
+    }
+
+    if (unchanged)
+        bundle->verified++;
+    else if (checksum.length == -1)
+        bundle->added++;
+    else
+        bundle->updated++;
+
+    sparsebundle_checksum_t &scrubbed = bundle->scrubbed.bands[band_number];
+    scrubbed.length = band_stat.st_size;
+    scrubbed.modification_time = modification_time;
+    memcpy(scrubbed.digest, digest, sizeof(digest));
+}
+
+static void sparsebundle_scrub_thread(sparsebundle_scrub_t *scrub)
+{
+    for (size_t i; (i = scrub->next_band++) < scrub->bands.size();)
+        sparsebundle_scrub_band(scrub, scrub->bands[i].first, scrub->bands[i].second);
+}
+
+// Scrubs the bundles, returning the exit code
+static int sparsebundle_scrub(sparsebundle_mount_t *mount)
+{
+    sparsebundle_scrub_t scrub;
+    scrub.next_band = 0;
+    scrub.bytes = 0;
+    scrub.throttle.bytes_per_second = mount->options.scrub_rate;
+
+    uint32_t max_band_count = 0;
+    for (auto &sparsebundle : mount->bundles) {
+        unique_ptr<sparsebundle_scrub_bundle_t> bundle(new sparsebundle_scrub_bundle_t());
+        bundle->sparsebundle = sparsebundle.get();
+        if (!sparsebundle_read_checksums(sparsebundle.get(), &bundle->checksums))
+            sparsebundle_debug("%s has no checksums yet", sparsebundle->path);
+        bundle->scrubbed.bands = bundle->checksums.bands;
+
+        for (uint32_t band_number = 0; band_number < sparsebundle->band_count; ++band_number) {
+            if (!sparsebundle->present_bands[band_number] && bundle->checksums.bands[band_number].length != -1) {
+                bundle->scrubbed.bands[band_number].length = -1;
+                bundle->removed++;
+            }
+        }
+
+        max_band_count = max(max_band_count, sparsebundle->band_count);
+        scrub.bundles.push_back(move(bundle));
+    }
+
+    for (uint32_t band_number = 0; band_number < max_band_count; ++band_number) {
+        for (auto &bundle : scrub.bundles) {
+            sparsebundle_t *sparsebundle = bundle->sparsebundle;
+            if (band_number < sparsebundle->band_count && sparsebundle->present_bands[band_number])
+                scrub.bands.push_back(make_pair(bundle.get(), band_number));
+        }
+    }
+
+    unsigned thread_count = mount->options.scrub_threads;
+    if (!thread_count)
+        thread_count = max(1u, thread::hardware_concurrency());
+    thread_count = unsigned(min(size_t(thread_count), scrub.bands.size()));
+
+    sparsebundle_debug("scrubbing %zu bands with %u threads", scrub.bands.size(), thread_count);
+
+    sparsebundle_clock::time_point start = sparsebundle_clock::now();
+    vector<thread> threads;
+    for (unsigned i = 0; i < thread_count; ++i)
+        threads.push_back(thread(sparsebundle_scrub_thread, &scrub));
+    for (thread &scrub_thread : threads)
+        scrub_thread.join();
+
+    double seconds = chrono::duration<double>(sparsebundle_clock::now() - start).count();
+    sparsebundle_debug("scrubbed %ju bytes in %.1f seconds", uintmax_t(scrub.bytes.load()), seconds);
+
+    int ret = 0;
+    for (auto &bundle : scrub.bundles) {
+        if (bundle->added || bundle->updated || bundle->removed) {
+            if (!sparsebundle_write_checksums(bundle->sparsebundle, bundle->scrubbed))
+                ret = 1;
+        }
+        if (bundle->corrupt || bundle->failed)
+            ret = 1;
+
+        printf("%s: %ju verified, %ju added, %ju updated, %ju removed, %ju skipped, %ju corrupt, %ju unreadable\n",
+            bundle->sparsebundle->path, uintmax_t(bundle->verified.load()), uintmax_t(bundle->added.load()),
+            uintmax_t(bundle->updated.load()), uintmax_t(bundle->removed.load()),
+            uintmax_t(bundle->skipped.load()), uintmax_t(bundle->corrupt.load()),
+            uintmax_t(bundle->failed.load()));
+    }
+
+    return ret;
 }
 
-__attribute__((noreturn, format(printf, 1, 2))) static void sparsebundle_fatal_error(const char *message, ...)
+/*
+    Exporting
+
+    With --export a bundle is converted to a flat image file, as raw
+    data or as qcow2, instead of being mounted. Only the bands that
+    exist are copied, spread over io_threads threads, and the rest of
+    the image is left as holes, so that an export takes time in
+    proportion to the data in the bundle rather than to its size. The
+    image is only ever written to a regular file outside the bundle,
+    and is removed again if the export created it and then failed.
+
+    On Linux bands are copied with copy_file_range, which shares the
+    data between the band and the image when both are on a file system
+    with reflinks, e.g. Btrfs or XFS, and otherwise copies it within
+    the kernel, skipping the holes of each band. Where that isn't
+    available, or the bundle is encrypted, bands are read through the
+    read path, and blocks of zeroes are left as holes as well.
+
+    A qcow2 image is laid out up front, with the header, the L1 table,
+    the refcount table and blocks, and the L2 tables, followed by the
+    clusters of each band in turn, so that the bands are copied in
+    parallel to where they go, just as for a raw image. Clusters that
+    are never written read as zeroes from the holes of the image file.
+*/
+
+static const size_t sparsebundle_export_read_size = 1024 * 1024;
+
+static const uint32_t sparsebundle_qcow2_magic = 0x514649fb; // QFI\xfb
+static const unsigned sparsebundle_qcow2_max_cluster_bits = 16;
+static const unsigned sparsebundle_qcow2_min_cluster_bits = 9;
+static const unsigned sparsebundle_qcow2_header_size = 104;
+static const uint64_t sparsebundle_qcow2_copied = uint64_t(1) << 63;
+
+struct sparsebundle_export_t {
+    sparsebundle_t *sparsebundle;
+    const char *image_path;
+    int image_fd;
+    vector<uint32_t> bands;
+    vector<uint64_t> band_offsets; // Where each band goes in the image file
+    atomic<size_t> next_band;
+    atomic<bool> failed;
+    atomic<bool> can_copy_file_range;
+    atomic<uint64_t> copied_bytes;
+};
+
+static bool sparsebundle_write_all(int fd, const char *data, size_t length, off_t offset)
 {
-    fprintf(stderr, "sparsebundlefs: ");
+    size_t bytes_written = 0;
+    while (bytes_written < length) {
+        ssize_t written = pwrite(fd, data + bytes_written, length - bytes_written, offset + bytes_written);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written == -1)
+            return false;
+        bytes_written += written;
+    }
+    return true;
+}
 
-    va_list args;
-    va_start(args, message);
-    vfprintf(stderr, message, args);
-    va_end(args);
+#if defined(SYS_copy_file_range)
+// Copies the data of the band file, skipping its holes, returning 0,
+// -errno on failure, or -EXDEV if copy_file_range can't be used.
+static int sparsebundle_export_copy_band(sparsebundle_export_t *exporter, int band_fd, uint64_t image_offset)
+{
+    struct stat band_stat;
+    if (fstat(band_fd, &band_stat) == -1)
+        return -errno;
 
-    if (errno)
-        fprintf(stderr, ": %s", strerror(errno));
+    off_t data = 0;
+    while (data < band_stat.st_size) {
+        data = lseek(band_fd, data, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break; // Only holes left
+        off_t hole = data == -1 ? band_stat.st_size : lseek(band_fd, data, SEEK_HOLE);
+        if (data == -1 || hole == -1) {
+            // Copies the whole band if SEEK_DATA isn't supported
+            if (errno != EINVAL)
+                return -errno;
+            data = 0;
+            hole = band_stat.st_size;
+        }
 
-    fprintf(stderr, "\n");
+        // Called through syscall(), as older C libraries have no wrapper
+        loff_t in_offset = data;
+        loff_t out_offset = loff_t(image_offset) + data;
+        while (in_offset < hole) {
+            ssize_t copied = syscall(SYS_copy_file_range, band_fd, &in_offset, exporter->image_fd,
+                &out_offset, size_t(hole - in_offset), 0u);
+            if (copied == -1 && errno == EINTR)
+                continue;
+            if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+                return -EXDEV;
+            if (copied == -1)
+                return -errno;
+            if (copied == 0)
+                break; // Band file is shorter than when we looked
+            exporter->copied_bytes += uint64_t(copied);
+        }
 
-    exit(EXIT_FAILURE);
+        data = hole;
+    }
+
+    return 0;
 }
+#endif
 
-static int sparsebundle_show_usage(char *program_name)
+// Copies the band by reading it, which also decrypts it, writing
+// only the blocks that aren't all zeroes. Returns 0 or -errno.
+static int sparsebundle_export_read_band(sparsebundle_export_t *exporter, uint32_t band_number,
+    uint64_t image_offset)
 {
-    fprintf(stderr, "usage: %s [-o options] [-s] [-f] [-D] <sparsebundle> <mountpoint>\n", program_name);
-    return 1;
+    sparsebundle_t *sparsebundle = exporter->sparsebundle;
+
+    // Reused between bands on the same thread
+    static thread_local unique_ptr<char[]> buffer(new char[sparsebundle_export_read_size]);
+
+    uint64_t band_start = uint64_t(band_number) * sparsebundle->band_size;
+    uint64_t band_end = min(band_start + sparsebundle->band_size, sparsebundle->size);
+    for (uint64_t offset = band_start; offset < band_end;) {
+        size_t length = size_t(min(uint64_t(sparsebundle_export_read_size), band_end - offset));
+        int read = sparsebundle_read_image(sparsebundle, buffer.get(), length, off_t(offset));
+        if (read <= 0)
+            return read < 0 ? read : -EIO;
+
+        // Writes each run of blocks with data in one go
+        size_t run_start = 0;
+        for (size_t block = 0;; block += sparsebundle_block_size) {
+            bool at_end = block >= size_t(read);
+            if (!at_end && !sparsebundle_is_zeroes(buffer.get() + block,
+                    min(sparsebundle_block_size, size_t(read) - block)))
+                continue;
+
+            size_t run_end = min(block, size_t(read));
+            if (run_end > run_start) {
+                if (!sparsebundle_write_all(exporter->image_fd, buffer.get() + run_start, run_end - run_start,
+                        off_t(image_offset + (offset - band_start) + run_start)))
+                    return -errno;
+                exporter->copied_bytes += run_end - run_start;
+            }
+            if (at_end)
+                break;
+            run_start = block + sparsebundle_block_size;
+        }
+
+        offset += uint64_t(read);
+    }
+
+    return 0;
+}
+
+static void sparsebundle_export_thread(sparsebundle_export_t *exporter)
+{
+    sparsebundle_t *sparsebundle = exporter->sparsebundle;
+
+    for (size_t i; !exporter->failed && (i = exporter->next_band++) < exporter->bands.size();) {
+        uint32_t band_number = exporter->bands[i];
+        uint64_t image_offset = exporter->band_offsets[band_number];
+
+        int ret = -EXDEV;
+#if defined(SYS_copy_file_range)
+        // Encrypted bands need decrypting, and verified ones checking
+        if (!sparsebundle->crypto && !sparsebundle->checksums && exporter->can_copy_file_range) {
+            char band_name[sizeof(uintmax_t) * 2 + 1];
+            snprintf(band_name, sizeof(band_name), "%jx", uintmax_t(band_number));
+
+            int band_fd = openat(sparsebundle->bands_fd, band_name, O_RDONLY);
+            ret = band_fd == -1 ? -errno : sparsebundle_export_copy_band(exporter, band_fd, image_offset);
+            if (band_fd != -1)
+                close(band_fd);
+
+            if (ret == -ENOENT) {
+                ret = 0; // Deleted since the bands were scanned
+            } else if (ret == -EXDEV) {
+                sparsebundle_debug("can't use copy_file_range, copying by reading instead");
+                exporter->can_copy_file_range = false;
+            }
+        }
+#endif
+        if (ret == -EXDEV) {
+            ret = sparsebundle_export_read_band(exporter, band_number, image_offset);
+            sparsebundle_release_files();
+        }
+
+        if (ret < 0) {
+            syslog(LOG_ERR, "failed to export band %jx of %s: %s", uintmax_t(band_number),
+                sparsebundle->path, strerror(-ret));
+            exporter->failed = true;
+        }
+    }
+}
+
+// Lays out a qcow2 image with the bands after the metadata, placing
+// each band, and writes the metadata. Returns the size of the image
+// file, or 0 on failure.
+static uint64_t sparsebundle_export_qcow2(sparsebundle_export_t *exporter)
+{
+    sparsebundle_t *sparsebundle = exporter->sparsebundle;
+    int fd = exporter->image_fd;
+
+    // The largest clusters, up to 64 KB, that bands are made up of
+    unsigned cluster_bits = sparsebundle_qcow2_max_cluster_bits;
+    while (sparsebundle->band_size % (uint64_t(1) << cluster_bits))
+        cluster_bits--;
+    assert(cluster_bits >= sparsebundle_qcow2_min_cluster_bits);
+
+    uint64_t cluster_size = uint64_t(1) << cluster_bits;
+    uint64_t clusters_per_band = sparsebundle->band_size / cluster_size;
+    uint64_t l2_entries = cluster_size / 8;
+    uint64_t image_clusters = (sparsebundle->size + cluster_size - 1) / cluster_size;
+    uint64_t l1_size = (image_clusters + l2_entries - 1) / l2_entries;
+    uint64_t l1_clusters = max(uint64_t(1), (l1_size * 8 + cluster_size - 1) / cluster_size);
+
+    // Clusters of each band, and which L2 tables they need. Bands get
+    // all of their clusters, the ones past the end of the band file
+    // staying holes in the image file like the zero clusters.
+    vector<uint64_t> band_clusters(sparsebundle->band_count);
+    vector<uint64_t> l2_offsets(l1_size);
+    uint64_t data_clusters = 0;
+    uint64_t l2_tables = 0;
+    for (uint32_t band_number : exporter->bands) {
+        uint64_t band_start = band_number * clusters_per_band;
+        uint64_t clusters = min(clusters_per_band, image_clusters - band_start);
+        band_clusters[band_number] = clusters;
+        data_clusters += clusters;
+        uint64_t last_l1_index = (band_start + clusters - 1) / l2_entries;
+        for (uint64_t l1_index = band_start / l2_entries; l1_index <= last_l1_index; ++l1_index) {
+            if (!l2_offsets[l1_index]) {
+                l2_offsets[l1_index] = 1; // Placed below
+                l2_tables++;
+            }
+        }
+    }
+
+    // The refcounts, of 16 bits, cover every cluster of the file, their own included
+    uint64_t refcounts_per_block = cluster_size / 2;
+    uint64_t refcount_blocks = 0;
+    uint64_t refcount_table_clusters = 0;
+    uint64_t file_clusters = 0;
+    while (true) {
+        file_clusters = 1 + l1_clusters + refcount_table_clusters + refcount_blocks + l2_tables + data_clusters;
+        uint64_t blocks = (file_clusters + refcounts_per_block - 1) / refcounts_per_block;
+        uint64_t table_clusters = (blocks * 8 + cluster_size - 1) / cluster_size;
+        if (blocks == refcount_blocks && table_clusters == refcount_table_clusters)
+            break;
+        refcount_blocks = blocks;
+        refcount_table_clusters = table_clusters;
+    }
+
+    uint64_t l1_offset = cluster_size;
+    uint64_t refcount_table_offset = l1_offset + l1_clusters * cluster_size;
+    uint64_t refcount_blocks_offset = refcount_table_offset + refcount_table_clusters * cluster_size;
+    uint64_t next_offset = refcount_blocks_offset + refcount_blocks * cluster_size;
+    for (uint64_t &l2_offset : l2_offsets) {
+        if (l2_offset) {
+            l2_offset = next_offset;
+            next_offset += cluster_size;
+        }
+    }
+    for (uint32_t band_number : exporter->bands) {
+        exporter->band_offsets[band_number] = next_offset;
+        next_offset += band_clusters[band_number] * cluster_size;
+    }
+    assert(next_offset == file_clusters * cluster_size);
+
+    string header;
+    sparsebundle_append_big_endian(header, sparsebundle_qcow2_magic, 4);
+    sparsebundle_append_big_endian(header, 3, 4); // Version
+    sparsebundle_append_big_endian(header, 0, 8); // Backing file offset
+    sparsebundle_append_big_endian(header, 0, 4); // Backing file size
+    sparsebundle_append_big_endian(header, cluster_bits, 4);
+    sparsebundle_append_big_endian(header, sparsebundle->size, 8);
+    sparsebundle_append_big_endian(header, 0, 4); // No encryption
+    sparsebundle_append_big_endian(header, l1_size, 4);
+    sparsebundle_append_big_endian(header, l1_offset, 8);
+    sparsebundle_append_big_endian(header, refcount_table_offset, 8);
+    sparsebundle_append_big_endian(header, refcount_table_clusters, 4);
+    sparsebundle_append_big_endian(header, 0, 4); // No snapshots
+    sparsebundle_append_big_endian(header, 0, 8); // Snapshots offset
+    sparsebundle_append_big_endian(header, 0, 8); // Incompatible features
+    sparsebundle_append_big_endian(header, 0, 8); // Compatible features
+    sparsebundle_append_big_endian(header, 0, 8); // Auto-clear features
+    sparsebundle_append_big_endian(header, 4, 4); // Refcount order, for 16 bits
+    sparsebundle_append_big_endian(header, sparsebundle_qcow2_header_size, 4);
+    sparsebundle_append_big_endian(header, 0, 8); // End of header extensions
+    assert(header.size() == sparsebundle_qcow2_header_size + 8);
+
+    string l1_table;
+    for (uint64_t l2_offset : l2_offsets)
+        sparsebundle_append_big_endian(l1_table, l2_offset ? l2_offset | sparsebundle_qcow2_copied : 0, 8);
+
+    string refcount_table;
+    for (uint64_t i = 0; i < refcount_blocks; ++i)
+        sparsebundle_append_big_endian(refcount_table, refcount_blocks_offset + i * cluster_size, 8);
+
+    if (ftruncate(fd, off_t(file_clusters * cluster_size)) == -1
+        || !sparsebundle_write_all(fd, header.data(), header.size(), 0)
+        || !sparsebundle_write_all(fd, l1_table.data(), l1_table.size(), off_t(l1_offset))
+        || !sparsebundle_write_all(fd, refcount_table.data(), refcount_table.size(),
+            off_t(refcount_table_offset)))
+        return 0;
+
+    // Every cluster of the file is used once
+    string refcount_block;
+    for (uint64_t i = 0; i < refcount_blocks; ++i) {
+        refcount_block.clear();
+        uint64_t block_end = min(file_clusters, (i + 1) * refcounts_per_block);
+        for (uint64_t cluster = i * refcounts_per_block; cluster < block_end; ++cluster)
+            sparsebundle_append_big_endian(refcount_block, 1, 2);
+        if (!sparsebundle_write_all(fd, refcount_block.data(), refcount_block.size(),
+                off_t(refcount_blocks_offset + i * cluster_size)))
+            return 0;
+    }
+
+    string l2_table;
+    for (uint64_t l1_index = 0; l1_index < l1_size; ++l1_index) {
+        if (!l2_offsets[l1_index])
+            continue;
+
+        l2_table.clear();
+        for (uint64_t cluster = l1_index * l2_entries; cluster < (l1_index + 1) * l2_entries; ++cluster) {
+            uint64_t band_number = cluster / clusters_per_band;
+            uint64_t band_cluster = cluster % clusters_per_band;
+            uint64_t entry = 0;
+            if (band_number < sparsebundle->band_count && band_cluster < band_clusters[band_number]) {
+                entry = exporter->band_offsets[band_number] + band_cluster * cluster_size;
+                entry |= sparsebundle_qcow2_copied;
+            }
+            sparsebundle_append_big_endian(l2_table, entry, 8);
+        }
+        if (!sparsebundle_write_all(fd, l2_table.data(), l2_table.size(), off_t(l2_offsets[l1_index])))
+            return 0;
+    }
+
+    sparsebundle_debug("laid out qcow2 image with clusters of %ju bytes, %ju of them holding data",
+        uintmax_t(cluster_size), uintmax_t(data_clusters));
+
+    return file_clusters * cluster_size;
+}
+
+// Exports the bundle to the image, returning the exit code
+static int sparsebundle_export(sparsebundle_t *sparsebundle, const char *image_path)
+{
+    sparsebundle_mount_t *mount = sparsebundle->mount;
+
+    sparsebundle_export_t exporter;
+    exporter.sparsebundle = sparsebundle;
+    exporter.image_path = image_path;
+    exporter.band_offsets.resize(sparsebundle->band_count);
+    exporter.next_band = 0;
+    exporter.failed = false;
+    exporter.can_copy_file_range = true;
+    exporter.copied_bytes = 0;
+
+    for (uint32_t band_number = 0; band_number < sparsebundle->band_count; ++band_number) {
+        if (sparsebundle->present_bands[band_number]) {
+            exporter.bands.push_back(band_number);
+            exporter.band_offsets[band_number] = uint64_t(band_number) * sparsebundle->band_size;
+        }
+    }
+
+    bool qcow2 = mount->options.format && strcmp(mount->options.format, "qcow2") == 0;
+    if (qcow2 && sparsebundle->band_size % (uint64_t(1) << sparsebundle_qcow2_min_cluster_bits)) {
+        errno = 0;
+        sparsebundle_fatal_error("band size of %s doesn't fit qcow2 clusters", sparsebundle->path);
+    }
+
+    // Only ever overwrite a regular file, and never one of the bundle
+    struct stat image_stat;
+    bool created = stat(image_path, &image_stat) == -1;
+    if (created && errno != ENOENT)
+        sparsebundle_fatal_error("failed to stat %s", image_path);
+    if (!created && !S_ISREG(image_stat.st_mode)) {
+        errno = 0;
+        sparsebundle_fatal_error("%s is not a regular file", image_path);
+    }
+
+    // A new file is resolved through its directory, an existing one
+    // through any symlink to it.
+    string image_dir = image_path;
+    size_t last_slash = image_dir.rfind('/');
+    image_dir = last_slash == string::npos ? "." : image_dir.substr(0, last_slash + 1);
+    char *resolved_path = realpath(created ? image_dir.c_str() : image_path, 0);
+    if (!resolved_path)
+        sparsebundle_fatal_error("failed to resolve %s", image_path);
+    string resolved = string(resolved_path) + "/";
+    free(resolved_path);
+    if (resolved.compare(0, strlen(sparsebundle->path) + 1, string(sparsebundle->path) + "/") == 0) {
+        errno = 0;
+        sparsebundle_fatal_error("%s is inside %s", image_path, sparsebundle->path);
+    }
+
+    // Without O_TRUNC, and non-blocking, in case the file was swapped
+    // for e.g. a FIFO since, which fstat then turns away.
+    exporter.image_fd = open(image_path, O_WRONLY | O_CREAT | O_NONBLOCK, 0644);
+    if (exporter.image_fd == -1)
+        sparsebundle_fatal_error("failed to create %s", image_path);
+    if (fstat(exporter.image_fd, &image_stat) == -1)
+        sparsebundle_fatal_error("failed to stat %s", image_path);
+    if (!S_ISREG(image_stat.st_mode)) {
+        errno = 0;
+        sparsebundle_fatal_error("%s is not a regular file", image_path);
+    }
+
+    if (ftruncate(exporter.image_fd, 0) == -1 || (qcow2 ? !sparsebundle_export_qcow2(&exporter)
+        : ftruncate(exporter.image_fd, off_t(sparsebundle->size)) == -1)) {
+        int error = errno;
+        if (created)
+            unlink(image_path);
+        errno = error;
+        sparsebundle_fatal_error("failed to write %s", image_path);
+    }
+
+    unsigned thread_count = unsigned(min(size_t(max(1u, mount->options.io_threads)), exporter.bands.size()));
+    sparsebundle_debug("exporting %zu bands of `%s' to `%s' as %s, with %u threads", exporter.bands.size(),
+        sparsebundle->path, image_path, qcow2 ? "qcow2" : "raw", thread_count);
+
+    sparsebundle_clock::time_point start = sparsebundle_clock::now();
+    vector<thread> threads;
+    for (unsigned i = 0; i < thread_count; ++i)
+        threads.push_back(thread(sparsebundle_export_thread, &exporter));
+    for (thread &export_thread : threads)
+        export_thread.join();
+
+    if (!exporter.failed && fsync(exporter.image_fd) == -1) {
+        syslog(LOG_ERR, "failed to sync %s: %s", image_path, strerror(errno));
+        exporter.failed = true;
+    }
+    close(exporter.image_fd);
+
+    // A partial image is no use to anyone, unless it was there already
+    if (exporter.failed && created)
+        unlink(image_path);
+
+    double seconds = chrono::duration<double>(sparsebundle_clock::now() - start).count();
+    sparsebundle_debug("copied %ju bytes in %.1f seconds", uintmax_t(exporter.copied_bytes.load()), seconds);
+
+    return exporter.failed ? 1 : 0;
 }
 
+/*
+    Network block device
+
+    With -o nbd the images are exported as block devices over the NBD
+    protocol, on a Unix socket given in place of the mount point, for
+    e.g. nbd-client or qemu to attach to. Each block request then goes
+    straight to the bands, instead of through FUSE and a loop device.
+    Exports are named after the images, e.g. sparsebundle.dmg, and a
+    lone image is also the default export.
+
+    Clients may open several connections to an export, e.g. one for
+    each queue of the kernel's block device, and each connection is
+    served by nbd_queue_depth threads, taking turns at receiving
+    requests, so that that many requests of a connection are in flight
+    at once, with the replies sent in the order the requests complete.
+*/
+
+static const uint64_t sparsebundle_nbd_magic = 0x4e42444d41474943; // NBDMAGIC
+static const uint64_t sparsebundle_nbd_option_magic = 0x49484156454f5054; // IHAVEOPT
+static const uint64_t sparsebundle_nbd_option_reply_magic = 0x3e889045565a9;
+static const uint32_t sparsebundle_nbd_request_magic = 0x25609513;
+static const uint32_t sparsebundle_nbd_reply_magic = 0x67446698;
+
+// Writes and reads larger than this are refused, as per the protocol
+static const uint32_t sparsebundle_nbd_max_payload = 32 * 1024 * 1024;
+static const uint32_t sparsebundle_nbd_max_option_length = 4096;
+
 enum {
-    SPARSEBUNDLE_OPT_HANDLED = 0, SPARSEBUNDLE_OPT_IGNORED = 1,
-    SPARSEBUNDLE_OPT_DEBUG, SPARSEBUNDLE_OPT_ALLOW_OTHER, SPARSEBUNDLE_OPT_ALLOW_ROOT,
-    SPARSEBUNDLE_OPT_NOREADBUF, SPARSEBUNDLE_OPT_ALWAYS_CLOSE
+    NBD_FLAG_FIXED_NEWSTYLE = 1 << 0, NBD_FLAG_NO_ZEROES = 1 << 1,
+    NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0, NBD_FLAG_C_NO_ZEROES = 1 << 1,
+
+    NBD_OPT_EXPORT_NAME = 1, NBD_OPT_ABORT = 2, NBD_OPT_LIST = 3,
+    NBD_OPT_INFO = 6, NBD_OPT_GO = 7,
+
+    NBD_REP_ACK = 1, NBD_REP_SERVER = 2, NBD_REP_INFO = 3,
+    NBD_REP_ERR_UNSUP = (1u << 31) + 1, NBD_REP_ERR_INVALID = (1u << 31) + 3,
+    NBD_REP_ERR_UNKNOWN = (1u << 31) + 6,
+
+    NBD_INFO_EXPORT = 0,
+
+    NBD_FLAG_HAS_FLAGS = 1 << 0, NBD_FLAG_READ_ONLY = 1 << 1, NBD_FLAG_SEND_FLUSH = 1 << 2,
+    NBD_FLAG_SEND_FUA = 1 << 3, NBD_FLAG_SEND_TRIM = 1 << 5, NBD_FLAG_SEND_WRITE_ZEROES = 1 << 6,
+    NBD_FLAG_CAN_MULTI_CONN = 1 << 8,
+
+    NBD_CMD_READ = 0, NBD_CMD_WRITE = 1, NBD_CMD_DISC = 2, NBD_CMD_FLUSH = 3,
+    NBD_CMD_TRIM = 4, NBD_CMD_WRITE_ZEROES = 6,
+    NBD_CMD_FLAG_FUA = 1 << 0, NBD_CMD_FLAG_NO_HOLE = 1 << 1,
+
+    NBD_EPERM = 1, NBD_EIO = 5, NBD_ENOMEM = 12, NBD_EINVAL = 22, NBD_ENOSPC = 28,
+    NBD_EOVERFLOW = 75, NBD_ENOTSUP = 95
 };
 
-struct fuse_opt sparsebundle_options[] = {
-    FUSE_OPT_KEY("-D",  SPARSEBUNDLE_OPT_DEBUG),
-    FUSE_OPT_KEY("allow_other", SPARSEBUNDLE_OPT_ALLOW_OTHER),
-    FUSE_OPT_KEY("allow_root", SPARSEBUNDLE_OPT_ALLOW_ROOT),
-    FUSE_OPT_KEY("noreadbuf", SPARSEBUNDLE_OPT_NOREADBUF),
-    FUSE_OPT_KEY("always_close", SPARSEBUNDLE_OPT_ALWAYS_CLOSE),
-    FUSE_OPT_END
+struct sparsebundle_nbd_connection_t {
+    sparsebundle_mount_t *mount;
+    int fd;
+    sparsebundle_t *sparsebundle;
+    mutex receive_lock;
+    mutex send_lock;
+    bool disconnected;
+    atomic<bool> finished;
+    thread connection_thread;
 };
 
-static int sparsebundle_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+struct sparsebundle_nbd_request_t {
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t length;
+};
+
+static bool sparsebundle_nbd_receive(int fd, void *data, size_t length)
 {
-    sparsebundle_t *sparsebundle = static_cast<sparsebundle_t *>(data);
+    for (size_t received = 0; received < length;) {
+        ssize_t ret = recv(fd, static_cast<char *>(data) + received, length - received, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        received += ret;
+    }
+    return true;
+}
 
-    switch (key) {
-    case SPARSEBUNDLE_OPT_DEBUG:
-        setlogmask(LOG_UPTO(LOG_DEBUG));
-        return SPARSEBUNDLE_OPT_HANDLED;
+static bool sparsebundle_nbd_send(int fd, const void *data, size_t length)
+{
+    for (size_t sent = 0; sent < length;) {
+        ssize_t ret = send(fd, static_cast<const char *>(data) + sent, length - sent, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        sent += ret;
+    }
+    return true;
+}
 
-    case SPARSEBUNDLE_OPT_ALLOW_OTHER:
-        sparsebundle->options.allow_other = true;
-        return SPARSEBUNDLE_OPT_IGNORED;
+static bool sparsebundle_nbd_send_option_reply(int fd, uint32_t option, uint32_t type,
+    const string &data = string())
+{
+    string reply;
+    sparsebundle_append_big_endian(reply, sparsebundle_nbd_option_reply_magic, 8);
+    sparsebundle_append_big_endian(reply, option, 4);
+    sparsebundle_append_big_endian(reply, type, 4);
+    sparsebundle_append_big_endian(reply, data.size(), 4);
+    reply += data;
+    return sparsebundle_nbd_send(fd, reply.data(), reply.size());
+}
 
-    case SPARSEBUNDLE_OPT_ALLOW_ROOT:
-        sparsebundle->options.allow_root = true;
-        return SPARSEBUNDLE_OPT_IGNORED;
+static sparsebundle_t *sparsebundle_nbd_lookup(sparsebundle_mount_t *mount, const string &name)
+{
+    if (name.empty())
+        return mount->bundles.size() == 1 ? mount->bundles.front().get() : nullptr;
+    return sparsebundle_lookup(mount, ("/" + name).c_str());
+}
 
-    case SPARSEBUNDLE_OPT_NOREADBUF:
-        sparsebundle->options.noreadbuf = true;
-        return SPARSEBUNDLE_OPT_HANDLED;
+static uint16_t sparsebundle_nbd_export_flags(sparsebundle_t *sparsebundle)
+{
+    // Syncing syncs what was written through every connection
+    uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+    if (!sparsebundle->mount->options.read_write)
+        return flags | NBD_FLAG_READ_ONLY;
+
+    flags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_WRITE_ZEROES;
+#if SPARSEBUNDLE_SUPPORTS_DISCARD
+    flags |= NBD_FLAG_SEND_TRIM;
+#endif
+    return flags;
+}
 
-    case SPARSEBUNDLE_OPT_ALWAYS_CLOSE:
-        sparsebundle->options.always_close = true;
-        return SPARSEBUNDLE_OPT_HANDLED;
+// Haggles over options until the client picks an export, returning
+// false if the client went away or aborted instead.
+static bool sparsebundle_nbd_negotiate(sparsebundle_nbd_connection_t *connection)
+{
+    int fd = connection->fd;
+
+    string greeting;
+    sparsebundle_append_big_endian(greeting, sparsebundle_nbd_magic, 8);
+    sparsebundle_append_big_endian(greeting, sparsebundle_nbd_option_magic, 8);
+    sparsebundle_append_big_endian(greeting, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES, 2);
+    if (!sparsebundle_nbd_send(fd, greeting.data(), greeting.size()))
+        return false;
+
+    uint8_t client_flags[4];
+    if (!sparsebundle_nbd_receive(fd, client_flags, sizeof(client_flags)))
+        return false;
+    uint64_t flags = sparsebundle_read_big_endian(client_flags, sizeof(client_flags));
+    if (flags & ~uint64_t(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES))
+        return false;
+
+    for (;;) {
+        uint8_t header[16];
+        if (!sparsebundle_nbd_receive(fd, header, sizeof(header)))
+            return false;
+        if (sparsebundle_read_big_endian(header, 8) != sparsebundle_nbd_option_magic)
+            return false;
+        uint32_t option = uint32_t(sparsebundle_read_big_endian(header + 8, 4));
+        uint32_t length = uint32_t(sparsebundle_read_big_endian(header + 12, 4));
+        if (length > sparsebundle_nbd_max_option_length)
+            return false;
+
+        string data(length, '\0');
+        if (!sparsebundle_nbd_receive(fd, &data[0], length))
+            return false;
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data.data());
+
+        switch (option) {
+        case NBD_OPT_EXPORT_NAME: {
+            // Has no way of reporting errors but hanging up
+            connection->sparsebundle = sparsebundle_nbd_lookup(connection->mount, data);
+            if (!connection->sparsebundle)
+                return false;
+
+            string reply;
+            sparsebundle_append_big_endian(reply, connection->sparsebundle->size, 8);
+            sparsebundle_append_big_endian(reply, sparsebundle_nbd_export_flags(connection->sparsebundle), 2);
+            if (!(flags & NBD_FLAG_C_NO_ZEROES))
+                reply.append(124, '\0');
+            return sparsebundle_nbd_send(fd, reply.data(), reply.size());
+        }
 
-    case FUSE_OPT_KEY_NONOPT:
-        if (!sparsebundle->path) {
-            sparsebundle->path = realpath(arg, 0);
-            if (!sparsebundle->path)
-                sparsebundle_fatal_error("bad sparse-bundle `%s'", arg);
-            return SPARSEBUNDLE_OPT_HANDLED;
-        } else if (!sparsebundle->mountpoint) {
-            sparsebundle->mountpoint = realpath(arg, 0);
-            if (!sparsebundle->mountpoint)
-                sparsebundle_fatal_error("bad mount point `%s'", arg);
-            fuse_opt_add_arg(outargs, sparsebundle->mountpoint);
-            return SPARSEBUNDLE_OPT_HANDLED;
+        case NBD_OPT_ABORT:
+            sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_ACK);
+            return false;
+
+        case NBD_OPT_LIST:
+            if (length) {
+                if (!sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_ERR_INVALID))
+                    return false;
+                break;
+            }
+            for (auto &sparsebundle : connection->mount->bundles) {
+                string name = sparsebundle->image_path.substr(1);
+                string server;
+                sparsebundle_append_big_endian(server, name.size(), 4);
+                server += name;
+                if (!sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_SERVER, server))
+                    return false;
+            }
+            if (!sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_ACK))
+                return false;
+            break;
+
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO: {
+            uint64_t name_length = length >= 4 ? sparsebundle_read_big_endian(bytes, 4) : length;
+            if (length < 6 || name_length > length - 6
+                || length != 6 + name_length + 2 * sparsebundle_read_big_endian(bytes + 4 + name_length, 2)) {
+                if (!sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_ERR_INVALID))
+                    return false;
+                break;
+            }
+
+            sparsebundle_t *sparsebundle = sparsebundle_nbd_lookup(connection->mount, data.substr(4, name_length));
+            if (!sparsebundle) {
+                if (!sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_ERR_UNKNOWN))
+                    return false;
+                break;
+            }
+
+            string info;
+            sparsebundle_append_big_endian(info, NBD_INFO_EXPORT, 2);
+            sparsebundle_append_big_endian(info, sparsebundle->size, 8);
+            sparsebundle_append_big_endian(info, sparsebundle_nbd_export_flags(sparsebundle), 2);
+            if (!sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_INFO, info)
+                || !sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_ACK))
+                return false;
+
+            if (option == NBD_OPT_GO) {
+                connection->sparsebundle = sparsebundle;
+                return true;
+            }
+            break;
         }
 
-        return SPARSEBUNDLE_OPT_IGNORED;
+        default:
+            if (!sparsebundle_nbd_send_option_reply(fd, option, NBD_REP_ERR_UNSUP))
+                return false;
+        }
     }
+}
 
-    return SPARSEBUNDLE_OPT_IGNORED;
+static uint32_t sparsebundle_nbd_error(int error)
+{
+    switch (error) {
+    case EPERM:
+    case EROFS:
+        return NBD_EPERM;
+    case ENOMEM:
+        return NBD_ENOMEM;
+    case EINVAL:
+        return NBD_EINVAL;
+    case ENOSPC:
+        return NBD_ENOSPC;
+    case EOVERFLOW:
+        return NBD_EOVERFLOW;
+    case ENOTSUP:
+#if EOPNOTSUPP != ENOTSUP
+    case EOPNOTSUPP:
+#endif
+        return NBD_ENOTSUP;
+    default:
+        return NBD_EIO;
+    }
 }
 
-static uint64_t read_size(const string &str)
+// Returns 0, or -errno on failure
+static int sparsebundle_nbd_write(sparsebundle_t *sparsebundle, const char *buffer,
+    size_t length, off_t offset)
 {
-    uintmax_t value = strtoumax(str.c_str(), 0, 10);
-    if (errno == ERANGE || value > numeric_limits<uint64_t>::max())
-        sparsebundle_fatal_error("disk image too large (%s bytes)", str.c_str());
+    int ret = sparsebundle_write_image(sparsebundle, buffer, length, offset);
+    if (ret < 0)
+        return ret;
+    return size_t(ret) == length ? 0 : -EIO;
+}
 
-    return value;
+// Returns 0, or an NBD error
+static uint32_t sparsebundle_nbd_handle_request(sparsebundle_nbd_connection_t *connection,
+    const sparsebundle_nbd_request_t &request, vector<char> &data)
+{
+    sparsebundle_t *sparsebundle = connection->sparsebundle;
+    bool read_only = !connection->mount->options.read_write;
+
+    if (request.offset > sparsebundle->size || request.length > sparsebundle->size - request.offset)
+        return request.type == NBD_CMD_READ ? NBD_EINVAL : NBD_ENOSPC;
+
+    if (read_only && request.type != NBD_CMD_READ && request.type != NBD_CMD_FLUSH)
+        return NBD_EPERM;
+
+    int ret = 0;
+    switch (request.type) {
+    case NBD_CMD_READ:
+        if (request.length > sparsebundle_nbd_max_payload)
+            return NBD_EOVERFLOW;
+        data.resize(request.length);
+        ret = sparsebundle_read_image(sparsebundle, data.data(), request.length, request.offset);
+        if (ret >= 0)
+            memset(data.data() + ret, 0, request.length - ret);
+        break;
+
+    case NBD_CMD_WRITE:
+        ret = sparsebundle_nbd_write(sparsebundle, data.data(), request.length, request.offset);
+        break;
+
+    case NBD_CMD_FLUSH:
+        if (!read_only)
+            ret = sparsebundle_sync(sparsebundle, true);
+        break;
+
+#if SPARSEBUNDLE_SUPPORTS_DISCARD
+    case NBD_CMD_TRIM:
+        ret = sparsebundle_discard(sparsebundle, request.offset, request.offset + request.length);
+        break;
+#endif
+
+    case NBD_CMD_WRITE_ZEROES:
+#if SPARSEBUNDLE_SUPPORTS_DISCARD
+        // Discarded ranges read as zeroes
+        if (!(request.flags & NBD_CMD_FLAG_NO_HOLE)) {
+            ret = sparsebundle_discard(sparsebundle, request.offset, request.offset + request.length);
+            break;
+        }
+#endif
+        {
+            // Zeroes are only written to bands that hold data there
+            static const char zeroes[64 * 1024] = {};
+            for (uint32_t zeroed = 0; zeroed < request.length && ret >= 0; zeroed += sizeof(zeroes)) {
+                ret = sparsebundle_nbd_write(sparsebundle, zeroes,
+                    min(size_t(request.length - zeroed), sizeof(zeroes)), request.offset + zeroed);
+            }
+        }
+        break;
+
+    default:
+        return NBD_EINVAL;
+    }
+
+    if (ret >= 0 && (request.flags & NBD_CMD_FLAG_FUA) && request.type != NBD_CMD_READ)
+        ret = sparsebundle_sync(sparsebundle, true);
+
+    sparsebundle_release_files();
+
+    return ret < 0 ? sparsebundle_nbd_error(-ret) : 0;
+}
+
+// Receives the next request, with the data of a write, returning
+// false once the client disconnects or breaks the protocol.
+static bool sparsebundle_nbd_receive_request(sparsebundle_nbd_connection_t *connection,
+    sparsebundle_nbd_request_t *request, vector<char> &data)
+{
+    uint8_t header[28];
+    if (!sparsebundle_nbd_receive(connection->fd, header, sizeof(header)))
+        return false;
+    if (sparsebundle_read_big_endian(header, 4) != sparsebundle_nbd_request_magic)
+        return false;
+
+    request->flags = uint16_t(sparsebundle_read_big_endian(header + 4, 2));
+    request->type = uint16_t(sparsebundle_read_big_endian(header + 6, 2));
+    request->handle = sparsebundle_read_big_endian(header + 8, 8);
+    request->offset = sparsebundle_read_big_endian(header + 16, 8);
+    request->length = uint32_t(sparsebundle_read_big_endian(header + 24, 4));
+
+    if (request->type == NBD_CMD_DISC)
+        return false;
+
+    if (request->type == NBD_CMD_WRITE) {
+        if (request->length > sparsebundle_nbd_max_payload)
+            return false;
+        data.resize(request->length);
+        return sparsebundle_nbd_receive(connection->fd, data.data(), request->length);
+    }
+
+    return true;
+}
+
+static void sparsebundle_nbd_serve_requests(sparsebundle_nbd_connection_t *connection)
+{
+    vector<char> data;
+    for (;;) {
+        sparsebundle_nbd_request_t request;
+        {
+            lock_guard<mutex> locker(connection->receive_lock);
+            if (connection->disconnected)
+                return;
+            if (!sparsebundle_nbd_receive_request(connection, &request, data)) {
+                connection->disconnected = true;
+                return;
+            }
+        }
+
+        sparsebundle_trace("nbd request %u of %u bytes at offset %ju",
+            request.type, request.length, uintmax_t(request.offset));
+
+        uint32_t error = sparsebundle_nbd_handle_request(connection, request, data);
+
+        string reply;
+        sparsebundle_append_big_endian(reply, sparsebundle_nbd_reply_magic, 4);
+        sparsebundle_append_big_endian(reply, error, 4);
+        sparsebundle_append_big_endian(reply, request.handle, 8);
+
+        // The data read follows the reply
+        struct iovec iov[2] = { { &reply[0], reply.size() }, { data.data(), data.size() } };
+        int iov_count = request.type == NBD_CMD_READ && !error ? 2 : 1;
+        size_t length = reply.size() + (iov_count == 2 ? data.size() : 0);
+
+        lock_guard<mutex> locker(connection->send_lock);
+        for (size_t sent = 0; sent < length;) {
+            ssize_t ret = writev(connection->fd, iov, iov_count);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret <= 0) {
+                // Wakes up the thread waiting for the next request
+                shutdown(connection->fd, SHUT_RDWR);
+                return;
+            }
+            sent += ret;
+            for (int i = 0; i < iov_count && ret; ++i) {
+                size_t consumed = min(size_t(ret), iov[i].iov_len);
+                iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + consumed;
+                iov[i].iov_len -= consumed;
+                ret -= consumed;
+            }
+        }
+    }
+}
+
+static void sparsebundle_nbd_serve_connection(sparsebundle_nbd_connection_t *connection)
+{
+    if (sparsebundle_nbd_negotiate(connection)) {
+        sparsebundle_debug("nbd client connected to `%s'", connection->sparsebundle->image_path.c_str() + 1);
+
+        vector<thread> threads;
+        for (unsigned i = 1; i < connection->mount->options.nbd_queue_depth; ++i)
+            threads.push_back(thread(sparsebundle_nbd_serve_requests, connection));
+        sparsebundle_nbd_serve_requests(connection);
+        for (thread &request_thread : threads)
+            request_thread.join();
+
+        sparsebundle_debug("nbd client disconnected");
+    }
+
+    // The descriptor is closed once the thread has been joined
+    sparsebundle_release_files();
+    connection->finished = true;
+}
+
+static volatile sig_atomic_t sparsebundle_nbd_stopping = 0;
+
+static void sparsebundle_nbd_stop(int)
+{
+    sparsebundle_nbd_stopping = 1;
+}
+
+static int sparsebundle_serve_nbd(sparsebundle_mount_t *mount, const char *socket_path)
+{
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        sparsebundle_fatal_error("bad socket `%s'", socket_path);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    // Replace the socket of an earlier run, but nothing else
+    struct stat socket_stat;
+    if (lstat(socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode))
+        unlink(socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1)
+        sparsebundle_fatal_error("failed to create socket");
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == -1)
+        sparsebundle_fatal_error("failed to bind socket `%s'", socket_path);
+    if (listen(listen_fd, SOMAXCONN) == -1)
+        sparsebundle_fatal_error("failed to listen on socket `%s'", socket_path);
+
+    sparsebundle_debug("serving nbd on `%s' with queue depth %u",
+        socket_path, mount->options.nbd_queue_depth);
+
+    // Without SA_RESTART, so that accept() returns when stopped
+    struct sigaction stop_action = {};
+    stop_action.sa_handler = sparsebundle_nbd_stop;
+    sigaction(SIGINT, &stop_action, 0);
+    sigaction(SIGTERM, &stop_action, 0);
+    sigaction(SIGHUP, &stop_action, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Signals are handled by this thread alone, which threads started
+    // from the connections inherit.
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGHUP);
+
+    list<unique_ptr<sparsebundle_nbd_connection_t>> connections;
+    while (!sparsebundle_nbd_stopping) {
+        int fd = accept(listen_fd, 0, 0);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                syslog(LOG_ERR, "failed to accept nbd connection: %s", strerror(errno));
+                this_thread::sleep_for(chrono::milliseconds(100));
+            }
+            continue;
+        }
+
+        for (auto iter = connections.begin(); iter != connections.end();) {
+            if (!(*iter)->finished) {
+                ++iter;
+                continue;
+            }
+            (*iter)->connection_thread.join();
+            close((*iter)->fd);
+            iter = connections.erase(iter);
+        }
+
+        unique_ptr<sparsebundle_nbd_connection_t> connection(new sparsebundle_nbd_connection_t());
+        connection->mount = mount;
+        connection->fd = fd;
+
+        sigset_t signals;
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &signals);
+        connection->connection_thread = thread(sparsebundle_nbd_serve_connection, connection.get());
+        pthread_sigmask(SIG_SETMASK, &signals, 0);
+
+        connections.push_back(move(connection));
+    }
+
+    sparsebundle_debug("stopping nbd server");
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    for (auto &connection : connections)
+        shutdown(connection->fd, SHUT_RDWR);
+    for (auto &connection : connections) {
+        connection->connection_thread.join();
+        close(connection->fd);
+    }
+
+    int ret = 0;
+    if (mount->options.read_write) {
+        for (auto &sparsebundle : mount->bundles) {
+            if (sparsebundle_sync(sparsebundle.get(), false) < 0)
+                ret = 1;
+        }
+    }
+
+    return ret;
 }
 
 int main(int argc, char **argv)
@@ -555,65 +6223,105 @@ int main(int argc, char **argv)
     openlog("sparsebundlefs", LOG_PERROR, LOG_USER);
     setlogmask(~(LOG_MASK(LOG_DEBUG)));
 
-    struct sparsebundle_t sparsebundle = {};
+    sparsebundle_mount_t mount = {};
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    fuse_opt_parse(&args, &sparsebundle, sparsebundle_options, sparsebundle_opt_proc);
+    fuse_opt_parse(&args, &mount, sparsebundle_options, sparsebundle_opt_proc);
+
+    if (!mount.options.read_write)
+        fuse_opt_add_arg(&args, "-oro"); // Force read-only mount
 
-    fuse_opt_add_arg(&args, "-oro"); // Force read-only mount
-    fuse_opt_add_arg(&args, "-s"); // Force single-threaded operation
+#if FUSE_SUPPORTS_CONFIG
+    // Let each thread read requests from its own file descriptor,
+    // instead of all of them contending on the one of the session.
+    fuse_opt_add_arg(&args, "-oclone_fd");
+#endif
 
-    if (!sparsebundle.path || !sparsebundle.mountpoint)
+    vector<char *> &arguments = mount.options.arguments;
+    if (arguments.size() < (mount.options.scrub ? 1 : 2)
+        || (mount.options.export_image && arguments.size() != 2))
         return sparsebundle_show_usage(argv[0]);
 
-    syslog(LOG_DEBUG, "mounting `%s' at mount-point `%s'",
-        sparsebundle.path, sparsebundle.mountpoint);
+    if (mount.options.hfs && (mount.options.read_write || mount.options.nbd)) {
+        errno = 0;
+        sparsebundle_fatal_error("hfs can't be combined with %s", mount.options.nbd ? "nbd" : "rw");
+    }
+    if (mount.options.verify && mount.options.read_write) {
+        errno = 0;
+        sparsebundle_fatal_error("verify can only be used with read-only mounts");
+    }
+    if (mount.options.export_image && (mount.options.read_write || mount.options.nbd
+            || mount.options.hfs || mount.options.scrub)) {
+        errno = 0;
+        sparsebundle_fatal_error("export can't be combined with rw, nbd, hfs or scrub");
+    }
+    if (mount.options.format && !mount.options.export_image) {
+        errno = 0;
+        sparsebundle_fatal_error("format only applies to export");
+    }
 
-    char *last_dot = strrchr(sparsebundle.path, '.');
-    if (!last_dot || strcmp(last_dot, ".sparsebundle") != 0)
-        sparsebundle_fatal_error("%s is not a sparse bundle (wrong extension)",
-            sparsebundle.path);
+    // When exporting over NBD the last argument is the socket instead,
+    // when exporting to an image it's the image, and when scrubbing
+    // there's only bundles.
+    size_t bundle_count = arguments.size() - (mount.options.scrub ? 0 : 1);
+    if (!mount.options.nbd && !mount.options.scrub && !mount.options.export_image) {
+        mount.mountpoint = realpath(arguments.back(), 0);
+        if (!mount.mountpoint)
+            sparsebundle_fatal_error("bad mount point `%s'", arguments.back());
+        fuse_opt_add_arg(&args, mount.mountpoint);
+    }
 
-    char *plist_path;
-    if (asprintf(&plist_path, "%s/Info.plist", sparsebundle.path) == -1)
-        sparsebundle_fatal_error("could not resolve Info.plist path");
+    for (size_t i = 0; i < bundle_count; ++i) {
+        unique_ptr<sparsebundle_t> sparsebundle(new sparsebundle_t());
+        sparsebundle->mount = &mount;
+        sparsebundle->path = realpath(arguments[i], 0);
+        if (!sparsebundle->path)
+            sparsebundle_fatal_error("bad sparse-bundle `%s'", arguments[i]);
 
-    ifstream plist_file(plist_path);
-    if (!plist_file.is_open())
-        sparsebundle_fatal_error("failed to open %s", plist_path);
+        sparsebundle_load(sparsebundle.get());
 
-    stringstream plist_data;
-    plist_data << plist_file.rdbuf();
+        if (mount.options.scrub) {
+            mount.bundles.push_back(move(sparsebundle));
+            continue;
+        }
 
-    string key, line;
-    while (getline(plist_data, line)) {
-        static const char whitespace_chars[] = " \n\r\t";
-        line.erase(0, line.find_first_not_of(whitespace_chars));
-        line.erase(line.find_last_not_of(whitespace_chars) + 1);
+        if (mount.options.verify) {
+            sparsebundle->checksums = new sparsebundle_checksums_t();
+            if (!sparsebundle_read_checksums(sparsebundle.get(), sparsebundle->checksums)) {
+                errno = 0;
+                sparsebundle_fatal_error("%s has no checksums to verify, make them with --scrub",
+                    sparsebundle->path);
+            }
+            sparsebundle->checksums->band_checks = vector<atomic<uint8_t>>(sparsebundle->band_count);
+        }
 
-        if (line.compare(0, 5, "<key>") == 0) {
-            key = line.substr(5, line.length() - 11);
-        } else if (!key.empty()) {
-            line.erase(0, line.find_first_of('>') + 1);
-            line.erase(line.find_first_of('<'));
+        sparsebundle->image_path = sparsebundle_image_path(&mount, sparsebundle.get());
+        if (sparsebundle->image_path == stats_path
+            || !mount.images.insert(make_pair(sparsebundle->image_path, sparsebundle.get())).second) {
+            errno = 0;
+            sparsebundle_fatal_error("more than one sparse-bundle would be served as %s",
+                sparsebundle->image_path.c_str() + 1);
+        }
 
-            if (key == "band-size")
-                sparsebundle.band_size = read_size(line);
-            else if (key == "size")
-                sparsebundle.size = read_size(line);
+        if (mount.options.nbd)
+            sparsebundle_debug("exporting `%s' as `%s'", sparsebundle->path,
+                sparsebundle->image_path.c_str() + 1);
+        else if (!mount.options.export_image)
+            sparsebundle_debug("serving `%s' as `%s%s'", sparsebundle->path,
+                mount.mountpoint, sparsebundle->image_path.c_str());
 
-            key.clear();
-        }
+        mount.bundles.push_back(move(sparsebundle));
     }
 
-    syslog(LOG_DEBUG, "bundle has band size %ju and total size %ju",
-        uintmax_t(sparsebundle.band_size), uintmax_t(sparsebundle.size));
+    if (mount.options.scrub)
+        return sparsebundle_scrub(&mount);
 
-    if (!sparsebundle.band_size || !sparsebundle.size)
-        sparsebundle_fatal_error("invalid (zero) band size or total size");
+    mount.most_recently_used_band = sparsebundle_no_band;
+    mount.least_recently_used_band = sparsebundle_no_band;
 
-    syslog(LOG_DEBUG, "mounting as uid=%d, with allow_other=%d and allow_root=%d",
-        getuid(), sparsebundle.options.allow_other, sparsebundle.options.allow_root);
+    if (!mount.options.export_image)
+        sparsebundle_debug("mounting as uid=%d, with allow_other=%d and allow_root=%d",
+            getuid(), mount.options.allow_other, mount.options.allow_root);
 
     struct fuse_operations sparsebundle_filesystem_operations = {};
     sparsebundle_filesystem_operations.getattr = sparsebundle_getattr;
@@ -621,18 +6329,95 @@ int main(int argc, char **argv)
     sparsebundle_filesystem_operations.read = sparsebundle_read;
     sparsebundle_filesystem_operations.readdir = sparsebundle_readdir;
     sparsebundle_filesystem_operations.release = sparsebundle_release;
+    sparsebundle_filesystem_operations.init = sparsebundle_init;
+    if (mount.options.read_write) {
+        sparsebundle_debug("mounting read-write");
+        sparsebundle_filesystem_operations.write = sparsebundle_write;
+        sparsebundle_filesystem_operations.flush = sparsebundle_flush;
+        sparsebundle_filesystem_operations.fsync = sparsebundle_fsync;
+#if FUSE_SUPPORTS_FALLOCATE
+        sparsebundle_filesystem_operations.fallocate = sparsebundle_fallocate;
+#endif
+    }
 #if FUSE_SUPPORTS_ZERO_COPY
-    syslog(LOG_DEBUG, "fuse supports zero-copy");
-    if (sparsebundle.options.noreadbuf)
-        syslog(LOG_DEBUG, "disabling zero-copy");
+    sparsebundle_debug("fuse supports zero-copy");
+    if (mount.options.noreadbuf)
+        sparsebundle_debug("disabling zero-copy");
     else
         sparsebundle_filesystem_operations.read_buf = sparsebundle_read_buf;
+    if ((mount.zeroes_fd = sparsebundle_open_zeroes()) == -1)
+        sparsebundle_fatal_error("failed to open zero device");
 #endif
+#if FUSE_SUPPORTS_LSEEK
+    sparsebundle_debug("fuse supports lseek");
+    sparsebundle_filesystem_operations.lseek = sparsebundle_lseek;
+#endif
+
+    rlim_t max_files = sparsebundle_max_files();
+    sparsebundle_debug("max open file descriptors is %ju", uintmax_t(max_files));
+
+    mount.max_open_bands = mount.options.max_open_bands;
+    if (!mount.max_open_bands) {
+        // Leave room for FUSE, syslog, the zero device, and
+        // the bands directory of each bundle.
+        rlim_t reserved_files = 8 + mount.bundles.size();
+        mount.max_open_bands = size_t(min(max_files > 2 * reserved_files ?
+            max_files - reserved_files : max_files / 2, rlim_t(numeric_limits<size_t>::max())));
+        mount.max_open_bands = max(size_t(1), mount.max_open_bands);
+    }
+    sparsebundle_debug("keeping at most %zu bands open", mount.max_open_bands);
+
+    if (mount.options.cache_size) {
+        if (sparsebundle_filesystem_operations.read_buf && !mount.options.nbd)
+            sparsebundle_debug("block cache only applies with noreadbuf, ignoring cache_size");
+        else
+            mount.block_cache.max_blocks = size_t(min(uint64_t(numeric_limits<size_t>::max()),
+                max(uint64_t(1), mount.options.cache_size / sparsebundle_block_size)));
+        sparsebundle_debug("caching up to %zu blocks of %zu bytes",
+            mount.block_cache.max_blocks, sparsebundle_block_size);
+    }
+
+    if (mount.options.hfs) {
+        // Read serially while probing, as I/O threads started before
+        // FUSE daemonizes wouldn't survive the fork.
+        unsigned io_threads = mount.options.io_threads;
+        mount.options.io_threads = 0;
+
+        for (auto &sparsebundle : mount.bundles) {
+            const string &image_path = sparsebundle->image_path;
+            sparsebundle->hfs = new sparsebundle_hfs_t();
+            sparsebundle->hfs->path = image_path.substr(0, image_path.rfind('.'));
+
+            errno = 0;
+            if (!sparsebundle_hfs_mount(sparsebundle.get()))
+                sparsebundle_fatal_error("no HFS+ volume found in `%s'", sparsebundle->path);
+            if (sparsebundle->hfs->path == stats_path
+                || !mount.volumes.insert(make_pair(sparsebundle->hfs->path, sparsebundle.get())).second)
+                sparsebundle_fatal_error("more than one volume would be served as %s",
+                    sparsebundle->hfs->path.c_str() + 1);
+
+            sparsebundle_debug("serving the volume of `%s' as `%s%s'", sparsebundle->path,
+                mount.mountpoint, sparsebundle->hfs->path.c_str());
+        }
+        sparsebundle_filesystem_operations.readlink = sparsebundle_readlink;
+
+        mount.options.io_threads = io_threads;
+    }
+
+    int ret = 0;
+    if (mount.options.export_image)
+        ret = sparsebundle_export(mount.bundles.front().get(), arguments.back());
+    else if (mount.options.nbd)
+        ret = sparsebundle_serve_nbd(&mount, arguments.back());
+    else
+        ret = fuse_main(args.argc, args.argv, &sparsebundle_filesystem_operations, &mount);
+
+    // When running single-threaded the main thread may still hold
+    // files, and its thread-locals outlive the mount.
+    sparsebundle_release_files();
 
-    syslog(LOG_DEBUG, "max open file descriptors is %ju",
-        uintmax_t(sparsebundle_max_files()));
+    sparsebundle_stop_io_threads();
 
-    int ret = fuse_main(args.argc, args.argv, &sparsebundle_filesystem_operations, &sparsebundle);
-    syslog(LOG_DEBUG, "exiting with return code %d", ret);
+    sparsebundle_debug("exiting with return code %d", ret);
     return ret;
 }
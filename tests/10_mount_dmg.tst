@@ -11,6 +11,13 @@ function test_dmg_has_expected_size() {
     test $size -eq 1099511627776
 }
 
+function test_dmg_reports_allocated_blocks() {
+    usage=$(du -k $dmg_file | awk '{print $1; exit}')
+    bands_usage=$(du -k $TEST_BUNDLE/bands | awk '{print $1; exit}')
+    test $usage -gt 0
+    test $usage -le $bands_usage
+}
+
 function test_dmg_has_correct_owner() {
     owner=$(ls -l $dmg_file | awk '{print $3; exit}')
     test $owner = $(whoami)
@@ -30,6 +37,435 @@ function test_dmg_permissions_reflect_allow_other() {
     umount $mount_dir && rm -Rf $mount_dir
 }
 
+function test_seeks_to_data_and_holes() {
+    # Bands 0 and 2 are missing, band 1 is short with a hole in it
+    local bundle=$(make_bundle 262144 65536 1:4096 3)
+    dd if=/dev/urandom of=$bundle/bands/1 bs=4096 seek=8 count=1 conv=notrunc 2>/dev/null
+
+    local seek_dir
+    read -r seek_dir < <(mount_and_wait sparsebundle.dmg -s $bundle)
+
+    # Otherwise the kernel reports the whole image as data
+    if ! grep -q "fuse supports lseek" $test_output_file; then
+        umount $seek_dir && rm -Rf $seek_dir $(dirname $bundle)
+        skip "built without lseek support"
+        return
+    fi
+
+    local dmg=$seek_dir/sparsebundle.dmg
+    local band_size=65536
+
+    # Missing band
+    test $(_seek $dmg 0 hole) -eq 0
+    test $(_seek $dmg 0 data) -eq $band_size
+    test $(_seek $dmg $((2 * band_size + 1)) data) -eq $((3 * band_size))
+
+    # Hole inside the band file, if the file system keeps it
+    local band_length=$(wc -c < $bundle/bands/1)
+    local hole=$(_seek $bundle/bands/1 0 hole)
+    test $(_seek $dmg $band_size hole) -eq $((band_size + hole))
+    if [[ $hole -lt $band_length ]]; then
+        local data=$(_seek $bundle/bands/1 $hole data)
+        test $(_seek $dmg $((band_size + hole)) data) -eq $((band_size + data))
+    fi
+
+    # Tail of the short band
+    test $(_seek $dmg $((band_size + band_length - 1)) hole) -eq $((band_size + band_length))
+    test $(_seek $dmg $((band_size + band_length)) data) -eq $((3 * band_size))
+
+    # Full band at the end of the image
+    test $(_seek $dmg $((3 * band_size)) hole) -eq $((4 * band_size))
+    test $(_seek $dmg $((4 * band_size - 1)) data) -eq $((4 * band_size - 1))
+    test $(_seek $dmg $((4 * band_size)) data) = ENXIO
+
+    umount $seek_dir && rm -Rf $seek_dir $(dirname $bundle)
+}
+
+function test_stats_file_counts_reads() {
+    dd if=$dmg_file of=/dev/null bs=4096 count=1 2>/dev/null
+    reads=$(awk '$1 == "read_calls" || $1 == "read_buf_calls" { n += $2 } END { print n }' $mount_dir/.stats)
+    test $reads -gt 0
+}
+
+function test_writes_to_bands() {
+    local bundle=$(make_bundle 262144 65536 0)
+    local bundles_dir=$(dirname $bundle)
+    head -c 1000 /dev/urandom > $bundles_dir/data
+
+    local rw_dir
+    read -r rw_dir < <(mount_and_wait sparsebundle.dmg -s -o rw $bundle)
+
+    local dmg=$rw_dir/sparsebundle.dmg
+    dd if=$bundles_dir/data of=$dmg bs=100 seek=1 conv=notrunc 2>/dev/null
+    dd if=/dev/zero of=$dmg bs=65536 seek=2 count=1 conv=notrunc 2>/dev/null
+    dd if=$bundles_dir/data of=$dmg bs=1000 seek=200 conv=notrunc,fsync 2>/dev/null
+
+    # Zeroes written into a missing band don't create it, data does
+    test ! -e $bundle/bands/2
+    test $(wc -c < $bundle/bands/3) -eq $((200000 - 3 * 65536 + 1000))
+    test $(wc -c < $bundle/bands/0) -eq 65536
+
+    umount $rw_dir && rm -Rf $rw_dir
+    read -r rw_dir < <(mount_and_wait sparsebundle.dmg -s $bundle)
+
+    dd if=$rw_dir/sparsebundle.dmg bs=100 skip=1 count=10 2>/dev/null | cmp - $bundles_dir/data
+    dd if=$rw_dir/sparsebundle.dmg bs=1000 skip=200 count=1 2>/dev/null | cmp - $bundles_dir/data
+
+    umount $rw_dir && rm -Rf $rw_dir $bundles_dir
+}
+
+function test_discards_bands() {
+    if [[ $(uname -s) != "Linux" ]]; then
+        skip "discarding is only supported on Linux"
+        return
+    fi
+
+    local bundle=$(make_bundle 262144 65536 0 1 2 3)
+
+    local discard_dir
+    read -r discard_dir < <(mount_and_wait sparsebundle.dmg -s -o rw,attr_timeout=0 $bundle)
+    local dmg=$discard_dir/sparsebundle.dmg
+    local dmg_blocks=$(stat -c %b $dmg)
+    local band_blocks=$(stat -c %b $bundle/bands/2)
+
+    # All of band 1, and the first half of band 2
+    fallocate -p -o 65536 -l 98304 $dmg
+
+    test ! -e $bundle/bands/1
+    test $(stat -c %b $bundle/bands/2) -lt $band_blocks
+    test $(stat -c %s $bundle/bands/2) -eq 65536
+    cmp -n 98304 <(dd if=$dmg bs=16384 skip=4 count=6 2>/dev/null) /dev/zero
+
+    test $(stat -c %b $dmg) -lt $dmg_blocks
+    test $(stat -c %b $dmg) -eq $(stat -c %b $bundle/bands/* | awk '{ n += $1 } END { print n }')
+
+    umount $discard_dir && rm -Rf $discard_dir $(dirname $bundle)
+}
+
+function test_discards_bands_after_zero_copy_reads() {
+    if [[ $(uname -s) != "Linux" ]]; then
+        skip "discarding is only supported on Linux"
+        return
+    fi
+
+    local bundle=$(make_bundle 262144 65536 0 1 2 3)
+
+    # Without -s, so that the reads are spread over FUSE threads, which
+    # then sit idle and mustn't keep band 1 from being deleted
+    local discard_dir
+    read -r discard_dir < <(mount_and_wait sparsebundle.dmg -o rw,attr_timeout=0 $bundle)
+    local dmg=$discard_dir/sparsebundle.dmg
+
+    local readers=()
+    for i in {0..3}; do
+        dd if=$dmg of=/dev/null bs=16384 skip=$((4 + i)) count=1 2>/dev/null &
+        readers+=($!)
+    done
+    for reader in ${readers[@]}; do
+        wait $reader
+    done
+
+    fallocate -p -o 65536 -l 65536 $dmg
+    test ! -e $bundle/bands/1
+    cmp -n 65536 <(dd if=$dmg bs=65536 skip=1 count=1 2>/dev/null) /dev/zero
+
+    umount $discard_dir && rm -Rf $discard_dir $(dirname $bundle)
+}
+
+function test_mounts_several_bundles() {
+    local bundle=$(make_bundle 16777216 8388608 1:4)
+
+    local several_dir
+    read -r several_dir < <(mount_and_wait test.dmg -s $TEST_BUNDLE $bundle)
+
+    size=$(ls -dn $several_dir/basic.dmg | awk '{print $5; exit}')
+    test $size -eq 1099511627776
+    size=$(ls -dn $several_dir/test.dmg | awk '{print $5; exit}')
+    test $size -eq 16777216
+    dd if=$several_dir/test.dmg bs=4 skip=2097152 count=1 2>/dev/null | cmp - $bundle/bands/1
+    test ! -e $several_dir/sparsebundle.dmg
+
+    umount $several_dir && rm -Rf $several_dir $(dirname $bundle)
+}
+
+function test_names_images_after_bundles() {
+    local bundle=$(make_bundle 8192 4096 0)
+    local bundles_dir=$(dirname $bundle)
+    mv $bundle $bundles_dir/.sparsebundle
+    cp -R $bundles_dir/.sparsebundle $bundles_dir/backup
+
+    # Not in the foreground, so that mounting by mistake doesn't hang
+    local names_dir=$(mktemp -d)
+    if sparsebundlefs -s $TEST_BUNDLE $bundles_dir/backup $names_dir 2>$bundles_dir/error; then
+        umount $names_dir
+        false
+    fi
+    grep -q "backup is not a sparse bundle (wrong extension)" $bundles_dir/error
+    rm -Rf $names_dir
+
+    # A name that is all extension is kept whole
+    read -r names_dir < <(mount_and_wait .sparsebundle.dmg -s $TEST_BUNDLE $bundles_dir/.sparsebundle)
+    dd if=$names_dir/.sparsebundle.dmg bs=4096 count=1 2>/dev/null | cmp - $bundles_dir/.sparsebundle/bands/0
+    test ! -e $names_dir/.dmg
+
+    umount $names_dir && rm -Rf $names_dir $bundles_dir
+}
+
+function test_refuses_malformed_bundle() {
+    local bundle=$(make_bundle 8192 4096 0:8192)
+    local bundles_dir=$(dirname $bundle)
+
+    # Not in the foreground, so that mounting by mistake doesn't hang
+    local broken_dir=$(mktemp -d)
+    if sparsebundlefs -s $bundle $broken_dir 2>$bundles_dir/error; then
+        umount $broken_dir
+        false
+    fi
+    grep -q "larger than the band size" $bundles_dir/error
+
+    printf '<plist><dict><key>band-size</key><integer>4096</integer>' > $bundle/Info.plist
+    if sparsebundlefs -s $bundle $broken_dir 2>$bundles_dir/error; then
+        umount $broken_dir
+        false
+    fi
+    grep -q "Info.plist: truncated property list" $bundles_dir/error
+
+    # Binary property lists cut short, or with garbage for a trailer
+    _write_binary_plist $bundles_dir/binary.plist 8192 4096
+    head -c 60 $bundles_dir/binary.plist > $bundles_dir/truncated.plist
+    { printf 'bplist00'; head -c 40 /dev/zero | tr '\0' '\377'; } > $bundles_dir/garbage.plist
+    for plist in $bundles_dir/truncated.plist $bundles_dir/garbage.plist; do
+        cp $plist $bundle/Info.plist
+        if sparsebundlefs -s $bundle $broken_dir 2>$bundles_dir/error; then
+            umount $broken_dir
+            false
+        fi
+        grep -q "Info.plist: invalid binary property list trailer" $bundles_dir/error
+    done
+
+    rm -Rf $broken_dir $bundles_dir
+}
+
+function test_reads_binary_and_single_line_plists() {
+    local bundle=$(make_bundle 16384 4096 1:100)
+    local bundles_dir=$(dirname $bundle)
+
+    # As written by hdiutil, or after a round trip through plutil
+    _write_binary_plist $bundles_dir/binary.plist 16384 4096
+    printf '<?xml version="1.0" encoding="UTF-8"?><plist version="1.0"><dict><key>band-size</key><integer>4096</integer><key>size</key><integer>16384</integer></dict></plist>' \
+        > $bundles_dir/single-line.plist
+
+    for plist in $bundles_dir/binary.plist $bundles_dir/single-line.plist; do
+        cp $plist $bundle/Info.plist
+        local plist_dir
+        read -r plist_dir < <(mount_and_wait sparsebundle.dmg -s $bundle)
+        size=$(ls -dn $plist_dir/sparsebundle.dmg | awk '{print $5; exit}')
+        test $size -eq 16384
+        dd if=$plist_dir/sparsebundle.dmg bs=4096 skip=1 count=1 2>/dev/null | head -c 100 | cmp - $bundle/bands/1
+        umount $plist_dir && rm -Rf $plist_dir
+    done
+
+    rm -Rf $bundles_dir
+}
+
+function test_decrypts_encrypted_bundle() {
+    if ! command -v openssl >/dev/null; then
+        skip "needs openssl to encrypt the bundle"
+        return
+    fi
+
+    # Band 0 has a hole chunk, band 1 is missing and band 2 is short
+    local bundles_dir=$(mktemp -d)
+    local image=$bundles_dir/plain.img
+    {
+        head -c 8192 /dev/urandom; head -c 4096 /dev/zero; head -c 4096 /dev/urandom
+        head -c 16384 /dev/zero
+        head -c 4096 /dev/urandom; head -c 12288 /dev/zero
+    } > $image
+    echo "correct horse" > $bundles_dir/passphrase
+    echo "battery staple" > $bundles_dir/wrong
+    local bundle=$(make_encrypted_bundle $image 16384 $bundles_dir/passphrase $bundles_dir/key)
+    test -e $bundle/bands/0 && test ! -e $bundle/bands/1 && test -e $bundle/bands/2
+
+    local crypt_dir
+    read -r crypt_dir < <(mount_and_wait sparsebundle.dmg -s \
+        -o passphrase_file=$bundles_dir/passphrase $bundle)
+    if grep -q "which this build doesn't support" $test_output_file; then
+        rm -Rf $crypt_dir $bundles_dir
+        skip "built without encryption support"
+        return
+    fi
+    cmp $image $crypt_dir/sparsebundle.dmg
+    # Decrypted into a copy, but counted as the zero-copy reads they are
+    if grep -q "fuse supports zero-copy" $test_output_file; then
+        test $(awk '$1 == "read_buf_calls" { print $2 }' $crypt_dir/.stats) -gt 0
+        test $(awk '$1 == "read_calls" { print $2 }' $crypt_dir/.stats) -eq 0
+    fi
+    umount $crypt_dir && rm -Rf $crypt_dir
+
+    read -r crypt_dir < <(mount_and_wait sparsebundle.dmg -s \
+        -o noreadbuf,key_file=$bundles_dir/key $bundle)
+    cmp $image $crypt_dir/sparsebundle.dmg
+    # Across chunks, starting and ending inside them
+    cmp <(dd if=$image bs=1000 skip=3 count=20 2>/dev/null) \
+        <(dd if=$crypt_dir/sparsebundle.dmg bs=1000 skip=3 count=20 2>/dev/null)
+    umount $crypt_dir
+
+    # Not in the foreground, so that mounting by mistake doesn't hang
+    if sparsebundlefs -s -o passphrase_file=$bundles_dir/wrong $bundle $crypt_dir \
+            2>$bundles_dir/error; then
+        umount $crypt_dir
+        false
+    fi
+    grep -q "wrong passphrase" $bundles_dir/error
+
+    rm -Rf $crypt_dir $bundles_dir
+}
+
+function test_serves_nbd() {
+    if ! command -v qemu-img >/dev/null || ! command -v qemu-io >/dev/null; then
+        skip "needs qemu-img and qemu-io as NBD clients"
+        return
+    fi
+
+    local bundle=$(make_bundle 262144 65536 0 3)
+    local bundles_dir=$(dirname $bundle)
+    { cat $bundle/bands/0; head -c 131072 /dev/zero; cat $bundle/bands/3; } > $bundles_dir/flat.img
+
+    local socket=$bundles_dir/nbd.sock
+    local image="nbd+unix:///sparsebundle.dmg?socket=$socket"
+    sparsebundlefs -D -o nbd,rw $bundle $socket &
+    local nbd_pid=$!
+    for i in {0..50}; do
+        kill -0 $nbd_pid >/dev/null 2>&1 || break
+        test -S $socket && break || sleep 0.1
+    done
+
+    qemu-img info --output=json "$image" | grep -q '"virtual-size": 262144'
+
+    # Several connections at once
+    local readers=()
+    for reader in {1..4}; do
+        qemu-img compare -f raw -F raw "$image" $bundles_dir/flat.img &
+        readers+=($!)
+    done
+    for reader in ${readers[@]}; do
+        wait $reader
+    done
+
+    # Several requests in flight on one connection
+    qemu-io -f raw --discard=unmap "$image" \
+        -c 'aio_write -P 0x11 65536 4096' \
+        -c 'aio_write -P 0x22 131072 4096' \
+        -c 'aio_read 0 65536' \
+        -c 'aio_flush' \
+        -c 'read -P 0x11 65536 4096' \
+        -c 'read -P 0x22 131072 4096' \
+        -c 'discard 196608 65536' > $bundles_dir/qemu-io.log
+    cat $bundles_dir/qemu-io.log
+    if grep -q "failed" $bundles_dir/qemu-io.log; then
+        false
+    fi
+
+    test $(wc -c < $bundle/bands/1) -eq 4096
+    test $(wc -c < $bundle/bands/2) -eq 4096
+    if [[ $(uname -s) == "Linux" ]]; then
+        test ! -e $bundle/bands/3
+    fi
+
+    kill $nbd_pid
+    wait $nbd_pid
+    test ! -e $socket
+
+    rm -Rf $bundles_dir
+}
+
+function test_serves_hfs_volume() {
+    local hfs_dir
+    read -r hfs_dir < <(mount_and_wait sparsebundle -s -o hfs $TEST_BUNDLE)
+
+    for f in $HFSFUSE_DIR/src/*; do
+        f=$(basename $f)
+        echo "Diffing $HFSFUSE_DIR/src/$f"
+        diff $HFSFUSE_DIR/src/$f $hfs_dir/sparsebundle/src/$f
+    done
+    if touch $hfs_dir/sparsebundle/src/new-file; then
+        false
+    fi
+
+    umount $hfs_dir && rm -Rf $hfs_dir
+}
+
+function test_scrub_finds_corrupt_band() {
+    local bundle=$(make_bundle 16384 8192 0 1:100)
+    local bundles_dir=$(dirname $bundle)
+
+    sparsebundlefs --scrub $bundle | grep -q "2 added"
+    test -f $bundle/sparsebundlefs.checksums
+    sparsebundlefs --scrub $bundle | grep -q "2 verified"
+
+    # Corruption leaves the length and modification time as they were
+    touch -r $bundle/bands/1 $bundles_dir/reference
+    printf 'X' | dd of=$bundle/bands/1 bs=1 seek=50 conv=notrunc 2>/dev/null
+    touch -r $bundles_dir/reference $bundle/bands/1
+    if sparsebundlefs --scrub $bundle 2>$bundles_dir/error; then
+        false
+    fi
+    grep -q "band 1 of .* doesn't match its checksum" $bundles_dir/error
+
+    local verify_dir
+    read -r verify_dir < <(mount_and_wait sparsebundle.dmg -s -o verify $bundle)
+    dd if=$verify_dir/sparsebundle.dmg bs=8192 count=1 >/dev/null
+    if dd if=$verify_dir/sparsebundle.dmg bs=8192 skip=1 count=1 >/dev/null 2>$bundles_dir/error; then
+        false
+    fi
+    grep -q "Input/output error" $bundles_dir/error
+
+    umount $verify_dir && rm -Rf $verify_dir $bundles_dir
+}
+
+function test_exports_bundle_to_image() {
+    local bundle=$(make_bundle 24576 8192 0 2:100)
+    local bundles_dir=$(dirname $bundle)
+
+    sparsebundlefs --export $bundle $bundles_dir/exported.raw
+    cat $bundle/bands/0 <(head -c 8192 /dev/zero) $bundle/bands/2 <(head -c 8092 /dev/zero) \
+        | cmp - $bundles_dir/exported.raw
+
+    sparsebundlefs --export -o format=qcow2 $bundle $bundles_dir/exported.qcow2
+    if command -v qemu-img >/dev/null; then
+        qemu-img check $bundles_dir/exported.qcow2
+        qemu-img compare -f raw -F qcow2 $bundles_dir/exported.raw $bundles_dir/exported.qcow2
+    fi
+
+    if sparsebundlefs --export $bundle /dev/null 2>$bundles_dir/error; then
+        false
+    fi
+    grep -q "not a regular file" $bundles_dir/error
+
+    # Refused up front, instead of blocking until a reader shows up
+    mkfifo $bundles_dir/fifo
+    if timeout 10 sparsebundlefs --export $bundle $bundles_dir/fifo 2>$bundles_dir/error; then
+        false
+    fi
+    grep -q "not a regular file" $bundles_dir/error
+
+    cp $bundle/bands/0 $bundles_dir/band
+    if sparsebundlefs --export $bundle $bundle/bands/0 2>$bundles_dir/error; then
+        false
+    fi
+    grep -q "is inside" $bundles_dir/error
+    cmp $bundles_dir/band $bundle/bands/0
+
+    # A band that can't be read fails the export, leaving no partial image
+    rm $bundle/bands/2 && mkdir $bundle/bands/2
+    if sparsebundlefs --export $bundle $bundles_dir/partial.raw 2>$bundles_dir/error; then
+        false
+    fi
+    test ! -e $bundles_dir/partial.raw
+    rm -Rf $bundles_dir
+}
+
 function teardown() {
     umount $mount_dir && rm -Rf $mount_dir
 }
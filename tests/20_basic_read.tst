@@ -16,10 +16,61 @@ function test_dmg_contents_is_same_as_testdata() {
 	_test_dmg_contents_is_same_as_testdata
 }
 
+function test_concurrent_readers_see_testdata() {
+	_test_concurrent_readers_see_testdata
+}
+
 function test_can_handle_ulimit() {
 	_test_can_handle_ulimit
 }
 
+function test_recovers_from_emfile() {
+	_test_recovers_from_emfile
+}
+
+function test_block_cache_serves_repeated_reads() {
+    local mount_dir
+    local dmg_file
+    read -r mount_dir dmg_file < <(mount_sparsebundle $mount_options,cache_size=16M)
+
+    _test_dmg_contents_is_same_as_testdata
+    hits=$(awk '$1 == "block_cache_hits" { print $2 }' $mount_dir/.stats)
+    test $hits -gt 0
+
+    umount $mount_dir && rm -Rf $mount_dir
+}
+
+function test_io_threads_read_across_bands() {
+    # Small bands, so that every read spans many of them, some missing
+    # and some short
+    local bands=()
+    local lengths=()
+    for i in {0..63}; do
+        if ((i % 3 != 1)); then
+            bands+=($(printf %x $i))
+            lengths+=(${bands[-1]}:$((i % 5 ? 4096 : 1000)))
+        fi
+    done
+    local bundle=$(make_bundle 262144 4096 ${lengths[@]})
+    local bundles_dir=$(dirname $bundle)
+
+    truncate -s 262144 $bundles_dir/expected
+    for band in ${bands[@]}; do
+        dd if=$bundle/bands/$band of=$bundles_dir/expected bs=4096 seek=$((16#$band)) \
+            conv=notrunc 2>/dev/null
+    done
+
+    # The log is shared by the whole test suite
+    local starts=$(grep -c "starting 4 I/O threads" $test_output_file || true)
+
+    local threads_dir
+    read -r threads_dir < <(mount_and_wait sparsebundle.dmg $mount_options,io_threads=4 $bundle)
+    dd if=$threads_dir/sparsebundle.dmg bs=1M 2>/dev/null | cmp - $bundles_dir/expected
+    test $(grep -c "starting 4 I/O threads" $test_output_file) -gt $starts
+
+    umount $threads_dir && rm -Rf $threads_dir $bundles_dir
+}
+
 function teardown() {
     umount $mount_dir && rm -Rf $mount_dir
 }
@@ -14,10 +14,18 @@ function test_dmg_contents_is_same_as_testdata() {
     _test_dmg_contents_is_same_as_testdata
 }
 
+function test_concurrent_readers_see_testdata() {
+    _test_concurrent_readers_see_testdata
+}
+
 function test_can_handle_ulimit() {
     _test_can_handle_ulimit
 }
 
+function test_recovers_from_emfile() {
+    _test_recovers_from_emfile
+}
+
 function teardown() {
     umount $mount_dir && rm -Rf $mount_dir
 }
\ No newline at end of file
@@ -1,25 +1,176 @@
 
 sparsebundlefs_ulimit=
 
-function mount_sparsebundle() {
-    test ! -z "$TEST_BUNDLE"
+# Mounts the given options and sparse-bundles on a new mount point in
+# the background, and prints the mount point once the given file shows
+# up in it, or the mount gives up.
+function mount_and_wait() {
+    local expected_file=$1
+    shift
     local mount_dir=$(mktemp -d)
-    local dmg_file="$mount_dir/sparsebundle.dmg"
     (
         if [[ ! -z "${sparsebundlefs_ulimit}" ]]; then
             ulimit -n $sparsebundlefs_ulimit
         fi
-        sparsebundlefs -s -f -D $* $TEST_BUNDLE $mount_dir
+        sparsebundlefs -f -D "$@" $mount_dir
     ) &
     local pid=$!
     for i in {0..50}; do
-        kill -0 $pid >/dev/null 2>&1
-        test -f $dmg_file && break || sleep 0.1
+        kill -0 $pid >/dev/null 2>&1 || break
+        test -e $mount_dir/$expected_file && break || sleep 0.1
     done
 
+    echo $mount_dir
+}
+
+function mount_sparsebundle() {
+    test ! -z "$TEST_BUNDLE"
+    local mount_dir
+    read -r mount_dir < <(mount_and_wait sparsebundle.dmg -s $* $TEST_BUNDLE)
+
     echo $mount_dir "$mount_dir/sparsebundle.dmg"
 }
 
+# Creates a sparse-bundle of the given size and band size in a new
+# directory, and prints its path. The bands to create are given by
+# their file names, each filled with random data, in full or up to
+# the length after a colon, e.g. 1f:100.
+function make_bundle() {
+    local size=$1
+    local band_size=$2
+    shift 2
+    local bundle=$(mktemp -d)/test.sparsebundle
+    mkdir -p $bundle/bands
+    cat > $bundle/Info.plist <<PLIST
+<?xml version="1.0" encoding="UTF-8"?>
+<plist version="1.0">
+<dict>
+	<key>band-size</key>
+	<integer>$band_size</integer>
+	<key>size</key>
+	<integer>$size</integer>
+</dict>
+</plist>
+PLIST
+
+    for band in "$@"; do
+        local length=$band_size
+        if [[ $band == *:* ]]; then
+            length=${band#*:}
+        fi
+        head -c $length /dev/urandom > $bundle/bands/${band%%:*}
+    done
+
+    echo $bundle
+}
+
+# Prints where seeking the given file from the given offset to data,
+# or to a hole, lands, or the name of the error, e.g. ENXIO, as there
+# is no shell tool for SEEK_DATA and SEEK_HOLE.
+function _seek() {
+    python3 - "$@" <<'EOF'
+import errno, os, sys
+path, offset, to = sys.argv[1:]
+fd = os.open(path, os.O_RDONLY)
+try:
+    print(os.lseek(fd, int(offset), os.SEEK_DATA if to == 'data' else os.SEEK_HOLE))
+except OSError as e:
+    print(errno.errorcode[e.errno])
+EOF
+}
+
+# Writes a binary Info.plist with the given size and band size, and
+# the other keys hdiutil writes.
+function _write_binary_plist() {
+    python3 - "$@" <<'EOF'
+import plistlib, sys
+plistlib.dump({
+    'CFBundleInfoDictionaryVersion': '6.0',
+    'band-size': int(sys.argv[3]),
+    'bundle-backingstore-version': 1,
+    'diskimage-bundle-type': 'com.apple.diskimage.sparsebundle',
+    'size': int(sys.argv[2]),
+}, open(sys.argv[1], 'wb'), fmt=plistlib.FMT_BINARY)
+EOF
+}
+
+# Creates an encrypted sparse-bundle next to the given plain image,
+# the way hdiutil does with -encryption AES-128, and prints its path.
+# The key is wrapped with the passphrase in the given file, and also
+# written to the given key file, unwrapped. Chunks of the image that
+# are all zeroes are left as holes, and bands of only such chunks out.
+function make_encrypted_bundle() {
+    local image=$1
+    local band_size=$2
+    local passphrase_file=$3
+    local key_file=$4
+    local bundle=$(dirname $image)/encrypted.sparsebundle
+    mkdir -p $bundle/bands
+    local size=$(wc -c < $image)
+    cat > $bundle/Info.plist <<PLIST
+<?xml version="1.0" encoding="UTF-8"?>
+<plist version="1.0">
+<dict>
+	<key>band-size</key>
+	<integer>$band_size</integer>
+	<key>size</key>
+	<integer>$size</integer>
+</dict>
+</plist>
+PLIST
+
+    python3 - $image $band_size $passphrase_file $key_file $bundle <<'EOF'
+import hashlib, hmac, os, struct, subprocess, sys
+image, band_size, passphrase_file, key_file, bundle = sys.argv[1:]
+band_size = int(band_size)
+chunk_size = 4096
+
+def encrypt(cipher, key, iv, data, padding=False):
+    command = ['openssl', 'enc', '-' + cipher, '-K', key.hex(), '-iv', iv.hex()]
+    return subprocess.run(command + ([] if padding else ['-nopad']),
+        input=data, stdout=subprocess.PIPE, check=True).stdout
+
+# Fixed keys and salts, so that the wrong passphrase is known to fail
+aes_key = bytes(range(16))
+hmac_key = bytes(range(16, 36))
+salt = bytes(range(36, 56))
+blob_iv = bytes(range(56, 64))
+iterations = 1000
+open(key_file, 'wb').write(aes_key + hmac_key)
+
+passphrase = open(passphrase_file, 'rb').read().rstrip(b'\r\n')
+wrapping_key = hashlib.pbkdf2_hmac('sha1', passphrase, salt, iterations, 24)
+blob = encrypt('des-ede3-cbc', wrapping_key, blob_iv, aes_key + hmac_key, padding=True)
+
+data = open(image, 'rb').read()
+header = b'encrcdsa' + struct.pack('>III', 2, 16, 0) + bytes(4) + struct.pack('>I', 128)
+header += bytes(52 - len(header)) + struct.pack('>IQ', chunk_size, len(data))
+header += bytes(72 - len(header)) + struct.pack('>I', 1)
+header += struct.pack('>IQQ', 1, 96, 104 + len(blob))
+key = struct.pack('>IIII', 103, 0, iterations, len(salt)) + salt.ljust(32, b'\0')
+key += struct.pack('>I', len(blob_iv)) + blob_iv.ljust(32, b'\0')
+key += struct.pack('>IIIII', 192, 17, 7, 6, len(blob)) + blob
+open(bundle + '/token', 'wb').write(header + key)
+
+for band in range(0, len(data), band_size):
+    chunks = []
+    for offset in range(band, min(band + band_size, len(data)), chunk_size):
+        chunk = data[offset:offset + chunk_size]
+        if chunk.count(0) == len(chunk):
+            chunks.append(chunk)
+            continue
+        number = struct.pack('>I', offset // chunk_size)
+        iv = hmac.new(hmac_key, number, hashlib.sha1).digest()[:16]
+        chunks.append(encrypt('aes-128-cbc', aes_key, iv, chunk))
+    contents = b''.join(chunks).rstrip(b'\0')
+    if contents:
+        length = -(-len(contents) // chunk_size) * chunk_size
+        open('%s/bands/%x' % (bundle, band // band_size), 'wb').write(contents.ljust(length, b'\0'))
+EOF
+
+    echo $bundle
+}
+
 function _test_dmg_has_correct_number_of_blocks() {
     hfsdump $dmg_file | grep "total_blocks: 268435456"
 }
@@ -32,16 +183,33 @@ function _test_dmg_contents_is_same_as_testdata() {
     done
 }
 
-function _test_can_handle_ulimit() {
+function _test_concurrent_readers_see_testdata() {
     local mount_dir
-    local dmg_file
+    # Unlike mount_sparsebundle, without -s, so reads run on several threads
+    read -r mount_dir < <(mount_and_wait sparsebundle.dmg $mount_options $TEST_BUNDLE)
+    local dmg_file=$mount_dir/sparsebundle.dmg
 
+    local readers=()
+    for reader in {1..4}; do
+        (
+            for f in $HFSFUSE_DIR/src/*; do
+                f=$(basename $f)
+                diff -q $HFSFUSE_DIR/src/$f <(hfsdump $dmg_file read "/src/$f") || exit 1
+            done
+        ) &
+        readers+=($!)
+    done
+    for reader in ${readers[@]}; do
+        wait $reader
+    done
 
-    sparsebundlefs_ulimit=12
-    read -r mount_dir dmg_file < <(mount_sparsebundle $mount_options)
-    sparsebundlefs_ulimit=
+    umount $mount_dir && rm -Rf $mount_dir
+}
 
-    hfs_dir=$(mktemp -d)
+# Mounts the given HFS+ image with hfsfuse and reads every file in it
+function _read_hfs_volume() {
+    local dmg_file=$1
+    local hfs_dir=$(mktemp -d)
     hfsfuse -f $dmg_file $hfs_dir &
     local hfs_pid=$!
     for i in {0..50}; do
@@ -54,8 +222,41 @@ function _test_can_handle_ulimit() {
         cat $f > /dev/null
     done
 
-    grep -q "too many open file descriptors" $test_output_file
-
     umount $hfs_dir && rm -Rf $hfs_dir
+}
+
+function _test_can_handle_ulimit() {
+    local mount_dir
+    local dmg_file
+
+    sparsebundlefs_ulimit=12
+    read -r mount_dir dmg_file < <(mount_sparsebundle $mount_options)
+    sparsebundlefs_ulimit=
+
+    _read_hfs_volume $dmg_file
+
+    grep -qE "too many open file descriptors|evicting band" $test_output_file
+
+    umount $mount_dir && rm -Rf $mount_dir
+}
+
+function _test_recovers_from_emfile() {
+    local mount_dir
+    local dmg_file
+
+    # The log is shared by the whole test suite
+    local emfiles=$(grep -c "too many open file descriptors" $test_output_file || true)
+
+    # More bands allowed open than there are file descriptors
+    sparsebundlefs_ulimit=12
+    read -r mount_dir dmg_file < <(mount_sparsebundle $mount_options -o max_open_bands=1000)
+    sparsebundlefs_ulimit=
+
+    _read_hfs_volume $dmg_file
+
+    test $(grep -c "too many open file descriptors" $test_output_file) -gt $emfiles
+    recoveries=$(awk '$1 == "band_cache_emfile_recoveries" { print $2 }' $mount_dir/.stats)
+    test $recoveries -gt 0
+
     umount $mount_dir && rm -Rf $mount_dir
 }
@@ -55,6 +55,12 @@ function testrunner::absolute_path() {
     printf "$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
 }
 
+# Marks the current test as skipped, for the given reason. The test
+# still has to return, and fails as usual if it fails before that.
+function skip() {
+    test_skipped="$*"
+}
+
 function testrunner::pid() {
     # Portable subshell-aware PID
     exec bash -c 'echo $PPID'
@@ -70,6 +76,7 @@ function testrunner::run_test() {
     printf -- "- ${pretty_testcase} "
 
     test_failure=""
+    test_skipped=""
     trap 'testrunner::register_failure "$BASH_COMMAND" $? && return' ERR INT
 
     # Work around older bash versions not getting location correct on error
@@ -82,7 +89,12 @@ function testrunner::run_test() {
     trap - ERR INT DEBUG
 
     if [[ -z "$test_failure" ]]; then
-        printf "${kGreen}✔${kReset}\n"
+        if [[ -n "$test_skipped" ]]; then
+            tests_skipped+=1
+            printf "${kYellow}skipped${kReset} ${kDark}(${test_skipped})${kReset}\n"
+        else
+            printf "${kGreen}✔${kReset}\n"
+        fi
 
         if [[ $DEBUG -eq 1 ]]; then
             testrunner::print_test_output
@@ -285,7 +297,11 @@ function testrunner::print_summary() {
     fi
     printf ": $tests_total tests"
     if [[ $tests_total -gt 0 ]]; then
-        printf ", $tests_failed failures\n"
+        printf ", $tests_failed failures"
+        if [[ $tests_skipped -gt 0 ]]; then
+            printf ", $tests_skipped skipped"
+        fi
+        printf "\n"
         return $tests_failed
     else
         printf "\n"
@@ -307,6 +323,7 @@ done
 
 declare -i tests_total=0
 declare -i tests_failed=0
+declare -i tests_skipped=0
 declare interrupted=0
 trap 'interrupted=1' INT
 
@@ -321,10 +338,11 @@ for testsuite in "${testsuites[@]}"; do
 
         tests_total=0
         tests_failed=0
+        tests_skipped=0
         testrunner::run_tests
 
         # Export results out of sub-shell
-        printf "tests_total+=${tests_total}; tests_failed+=${tests_failed}" >&3
+        printf "tests_total+=${tests_total}; tests_failed+=${tests_failed}; tests_skipped+=${tests_skipped}" >&3
 
         testrunner::signal_children TERM $$
         testrunner::signal_children KILL $$